@@ -0,0 +1,276 @@
+//
+// Created by Richard Hodges on 27/04/2017.
+//
+// Microbenchmarks for the codec, hashing, escaping and query building hot paths.
+// None of these need a server. For machine readable output run with
+//    amy-bench --benchmark_format=json --benchmark_out=bench.json
+//
+
+#include "config.hpp"
+
+#include <benchmark/benchmark.h>
+#include <mysql/mysql.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "proto/test.pb.h"
+#include "proto/proto_storage.pb.h"
+
+#include "base64.hpp"
+#include "hasher.hpp"
+#include "hex.hpp"
+#include "member_history.hpp"
+#include "metrics.hpp"
+#include "packed_field.hpp"
+#include "query_builder.hpp"
+#include "sql_escaper.hpp"
+#include "storage_plan.hpp"
+
+namespace {
+
+    std::string random_bytes(std::size_t length)
+    {
+        std::default_random_engine eng(length);
+        std::uniform_int_distribution<int> dist(0, 255);
+        std::string result(length, 0);
+        for (auto& c : result)
+            c = char(dist(eng));
+        return result;
+    }
+
+    /// A client handle which is initialised but never connected. Enough for escaping.
+    MYSQL* unconnected_handle()
+    {
+        static MYSQL* handle = mysql_init(nullptr);
+        return handle;
+    }
+
+    test::BigMessage make_big_message(std::size_t elements)
+    {
+        test::BigMessage message;
+        message.mutable_y()->set_a("value for a");
+        message.mutable_y()->set_b(42);
+        for (std::size_t i = 0; i < elements; ++i)
+            message.mutable_y()->add_c("element " + std::to_string(i));
+        return message;
+    }
+
+    proto::storage::HashAlgorithm const& table_name_algorithm()
+    {
+        static proto::storage::HashAlgorithm const algorithm = [] {
+            proto::storage::HashAlgorithm algorithm;
+            algorithm.mutable_cryptogenerichash()->set_hashlength(22);
+            return algorithm;
+        }();
+        return algorithm;
+    }
+}
+
+static void base64_encode(benchmark::State& state)
+{
+    auto input = random_bytes(state.range(0));
+    auto b = base64();
+    std::string output(b.needed_encoded_length(int(input.size())), ' ');
+    while (state.KeepRunning()) {
+        b.encode(input.data(), input.size(), &output[0]);
+        benchmark::DoNotOptimize(output.data());
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(base64_encode)->RangeMultiplier(16)->Range(64, 1 << 20);
+
+static void base64_decode(benchmark::State& state)
+{
+    auto input = random_bytes(state.range(0));
+    auto b = base64();
+    std::string encoded(b.needed_encoded_length(int(input.size())), ' ');
+    b.encode(input.data(), input.size(), &encoded[0]);
+    encoded.erase(encoded.find('\0'));
+    std::string output(b.needed_decoded_length(int(encoded.size())) + 3, ' ');
+    while (state.KeepRunning()) {
+        auto len = b.decode(encoded.data(), encoded.size(), &output[0], nullptr);
+        benchmark::DoNotOptimize(len);
+    }
+    state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(base64_decode)->RangeMultiplier(16)->Range(64, 1 << 20);
+
+static void hex_encode_digest(benchmark::State& state)
+{
+    auto input = random_bytes(state.range(0));
+    while (state.KeepRunning()) {
+        auto result = hex_encode(input.begin(), input.end());
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(hex_encode_digest)->Arg(22)->Arg(64)->Arg(1024);
+
+static void hex_decode_digest(benchmark::State& state)
+{
+    auto input = random_bytes(state.range(0));
+    auto encoded = hex_encode(input.begin(), input.end());
+    auto output = std::vector<std::uint8_t>();
+    output.reserve(input.size());
+    while (state.KeepRunning()) {
+        output.clear();
+        auto ok = hex_decode(encoded, output);
+        benchmark::DoNotOptimize(ok);
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(hex_decode_digest)->Arg(22)->Arg(64)->Arg(1024);
+
+static void hash_table_name(benchmark::State& state)
+{
+    auto input = random_bytes(state.range(0));
+    std::vector<std::uint8_t> target;
+    while (state.KeepRunning()) {
+        hash(target, input.begin(), input.end(), table_name_algorithm());
+        benchmark::DoNotOptimize(target.data());
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(hash_table_name)->Arg(16)->Arg(64)->Arg(1024);
+
+static void escape_string(benchmark::State& state)
+{
+    auto input = random_bytes(state.range(0));
+    sql_escaper escaper(unconnected_handle());
+    while (state.KeepRunning()) {
+        auto&& result = escaper(input);
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(escape_string)->RangeMultiplier(16)->Range(64, 1 << 20);
+
+static void escape_db_name(benchmark::State& state)
+{
+    sql_escaper escaper(unconnected_handle());
+    auto name = db_name("0123456789ABCDEF0123456789ABCDEF0123456789AB");
+    while (state.KeepRunning()) {
+        auto&& result = escaper(name);
+        benchmark::DoNotOptimize(result.data());
+    }
+}
+BENCHMARK(escape_db_name);
+
+static void build_insert_query(benchmark::State& state)
+{
+    auto payload = random_bytes(state.range(0));
+    sql_escaper escaper(unconnected_handle());
+    while (state.KeepRunning()) {
+        auto query = build_query(escaper,
+                                 "INSERT INTO tbl_message_store (type_id, binary_data) VALUES(%1%, %2%)",
+                                 verbatim("2271560481"), payload);
+        benchmark::DoNotOptimize(query.data());
+    }
+    state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(build_insert_query)->RangeMultiplier(16)->Range(64, 1 << 20);
+
+static void query_builder_create_table(benchmark::State& state)
+{
+    sql_escaper escaper(unconnected_handle());
+    query_builder builder(escaper);
+    auto const table = db_name("0123456789ABCDEF0123456789ABCDEF0123456789AB");
+    auto const parent = db_name("ABCDEF0123456789ABCDEF0123456789ABCDEF0123");
+    auto render = [&] {
+        builder.clear();
+        builder.add_component("CREATE TABLE IF NOT EXISTS %s (\n", table);
+        builder.add_component(" __id__ INT NOT NULL AUTO_INCREMENT PRIMARY KEY\n");
+        builder.add_component(",__parent__ INT NOT NULL\n");
+        builder.add_component(", CONSTRAINT FOREIGN KEY (__parent__)"
+                                  " REFERENCES %s (__id__)"
+                                  " ON DELETE CASCADE"
+                                  " ON UPDATE CASCADE", parent);
+        builder.add_component(")");
+        auto&& query = builder();
+        benchmark::DoNotOptimize(query.data());
+    };
+
+    // the first render sizes the buffers; after that the builder must not touch the heap
+    render();
+    auto allocations = std::uint64_t(0);
+    while (state.KeepRunning()) {
+        auto before = metrics::thread_allocations();
+        render();
+        allocations += metrics::thread_allocations() - before;
+    }
+#if AMYTEST_METRICS
+    if (allocations)
+        state.SkipWithError("query_builder allocated after warm-up");
+#endif
+}
+BENCHMARK(query_builder_create_table);
+
+static void member_history_name(benchmark::State& state)
+{
+    auto history = member_history(test::BigMessage::descriptor());
+    auto little = test::BigMessage::descriptor()->FindFieldByName("y");
+    for (int i = 0; i < state.range(0); ++i)
+        history += little;
+    while (state.KeepRunning()) {
+        auto name = history.name();
+        benchmark::DoNotOptimize(name.data());
+    }
+}
+BENCHMARK(member_history_name)->Arg(0)->Arg(1)->Arg(4);
+
+static void storage_plan_table(benchmark::State& state)
+{
+    auto&& plan = storage_plan::get(test::BigMessage::descriptor());
+    auto path = std::vector<google::protobuf::FieldDescriptor const *>();
+    if (state.range(0))
+        path.push_back(test::BigMessage::descriptor()->FindFieldByName("y"));
+    while (state.KeepRunning()) {
+        auto&& table = plan.table(path);
+        benchmark::DoNotOptimize(table.hash_name.data());
+    }
+}
+BENCHMARK(storage_plan_table)->Arg(0)->Arg(1);
+
+static void big_message_serialize(benchmark::State& state)
+{
+    auto message = make_big_message(state.range(0));
+    std::string buffer;
+    while (state.KeepRunning()) {
+        buffer.clear();
+        message.SerializeToString(&buffer);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetBytesProcessed(state.iterations() * buffer.size());
+}
+BENCHMARK(big_message_serialize)->RangeMultiplier(10)->Range(1, 10000);
+
+static void big_message_parse(benchmark::State& state)
+{
+    auto buffer = make_big_message(state.range(0)).SerializeAsString();
+    test::BigMessage message;
+    while (state.KeepRunning()) {
+        message.ParseFromArray(buffer.data(), int(buffer.size()));
+        benchmark::DoNotOptimize(&message);
+    }
+    state.SetBytesProcessed(state.iterations() * buffer.size());
+}
+BENCHMARK(big_message_parse)->RangeMultiplier(10)->Range(1, 10000);
+
+static void packed_repeated_decode(benchmark::State& state)
+{
+    auto source = make_big_message(state.range(0));
+    auto field = test::BigMessage::LittleMessage::descriptor()->FindFieldByName("c");
+    std::string column;
+    encode_packed(source.y(), field, column);
+    test::BigMessage::LittleMessage message;
+    while (state.KeepRunning()) {
+        decode_packed(column, message, field);
+        benchmark::DoNotOptimize(&message);
+    }
+    state.SetBytesProcessed(state.iterations() * column.size());
+}
+BENCHMARK(packed_repeated_decode)->RangeMultiplier(10)->Range(1, 10000);
+
+BENCHMARK_MAIN();
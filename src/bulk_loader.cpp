@@ -0,0 +1,237 @@
+//
+// Created by Richard Hodges on 24/04/2017.
+//
+
+#include "bulk_loader.hpp"
+#include "sql_escaper.hpp"
+#include "metrics.hpp"
+#include "type_dictionary.hpp"
+
+#include <mysql/mysql.h>
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <ostream>
+#include <unordered_map>
+
+namespace {
+
+    const char bulk_load_template[] = "LOAD DATA LOCAL INFILE";
+
+    struct infile_state
+    {
+        bool refill(std::size_t wanted)
+        {
+            // drop what has been read, so pending_ holds at most one read's worth plus a row
+            pending_.erase(0, consumed_);
+            consumed_ = 0;
+            while (not exhausted_ and pending_.size() - consumed_ < wanted) {
+                row_.buffer_.clear();
+                row_.fields_ = 0;
+                if (not producer_(row_)) {
+                    exhausted_ = true;
+                    break;
+                }
+                row_.buffer_.push_back('\n');
+                pending_ += row_.buffer_;
+                ++stats_.rows;
+            }
+            return pending_.size() > consumed_;
+        }
+
+        int read(char *buf, unsigned int buf_len)
+        {
+            try {
+                if (not refill(buf_len))
+                    return 0;
+                auto n = std::min<std::size_t>(buf_len, pending_.size() - consumed_);
+                std::memcpy(buf, pending_.data() + consumed_, n);
+                consumed_ += n;
+                stats_.bytes += n;
+                AMYTEST_METRIC_COUNT(bytes_out, n);
+                return int(n);
+            }
+            catch (...) {
+                error_ = std::current_exception();
+                return -1;
+            }
+        }
+
+        bulk_row_producer producer_;
+        bulk_row row_;
+        std::string pending_;
+        std::size_t consumed_ = 0;
+        bool exhausted_ = false;
+        std::exception_ptr error_;
+        bulk_load_stats stats_;
+    };
+
+    extern "C" int infile_init(void **ptr, const char *, void *userdata)
+    {
+        *ptr = userdata;
+        return 0;
+    }
+
+    extern "C" int infile_read(void *ptr, char *buf, unsigned int buf_len)
+    {
+        return static_cast<infile_state *>(ptr)->read(buf, buf_len);
+    }
+
+    extern "C" void infile_end(void *)
+    {
+    }
+
+    extern "C" int infile_error(void *ptr, char *error_msg, unsigned int error_msg_len)
+    {
+        static const char message[] = "bulk row producer failed";
+        std::strncpy(error_msg, message, error_msg_len);
+        if (error_msg_len) error_msg[error_msg_len - 1] = 0;
+        return 2000;    // CR_UNKNOWN_ERROR
+    }
+
+    /// Put the default handlers back even if the load throws
+    struct infile_handler_guard
+    {
+        infile_handler_guard(amy::connector& conn, infile_state& state)
+            : conn(conn)
+        {
+            mysql_set_local_infile_handler(conn.native(),
+                                           &infile_init, &infile_read, &infile_end, &infile_error,
+                                           &state);
+        }
+
+        ~infile_handler_guard()
+        {
+            mysql_set_local_infile_default(conn.native());
+        }
+
+        amy::connector& conn;
+    };
+}
+
+double bulk_load_stats::rows_per_second() const
+{
+    auto secs = std::chrono::duration<double>(elapsed).count();
+    return secs > 0 ? rows / secs : 0.0;
+}
+
+double bulk_load_stats::bytes_per_second() const
+{
+    auto secs = std::chrono::duration<double>(elapsed).count();
+    return secs > 0 ? bytes / secs : 0.0;
+}
+
+std::ostream& operator<<(std::ostream& os, bulk_load_stats const& stats)
+{
+    return os << stats.rows << " rows (" << stats.stored << " stored), "
+              << stats.bytes << " bytes in "
+              << std::chrono::duration<double>(stats.elapsed).count() << "s ("
+              << stats.rows_per_second() << " rows/s, "
+              << stats.bytes_per_second() << " bytes/s)";
+}
+
+bulk_row& bulk_row::add(const char *data, std::size_t length)
+{
+    if (fields_++) buffer_.push_back('\t');
+    buffer_.reserve(buffer_.size() + length);
+    auto last = data + length;
+    while (data != last) {
+        auto c = *data++;
+        switch (c) {
+            case '\\':
+                buffer_ += "\\\\";
+                break;
+            case '\t':
+                buffer_ += "\\t";
+                break;
+            case '\n':
+                buffer_ += "\\n";
+                break;
+            case '\0':
+                buffer_ += "\\0";
+                break;
+            default:
+                buffer_.push_back(c);
+        }
+    }
+    return *this;
+}
+
+bulk_row& bulk_row::add(std::int64_t value)
+{
+    if (fields_++) buffer_.push_back('\t');
+    buffer_ += std::to_string(value);
+    return *this;
+}
+
+bulk_row& bulk_row::add_null()
+{
+    if (fields_++) buffer_.push_back('\t');
+    buffer_ += "\\N";
+    return *this;
+}
+
+bulk_load_stats bulk_load(amy::connector& conn,
+                          std::string const& table_name,
+                          std::vector<std::string> const& columns,
+                          bulk_row_producer producer)
+{
+    auto escaper = sql_escaper(conn);
+    auto query = std::string("LOAD DATA LOCAL INFILE 'amytest-bulk' INTO TABLE ");
+    query += escaper(db_name(table_name));
+    query += " CHARACTER SET binary"
+        " FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\'"
+        " LINES TERMINATED BY '\\n' (";
+    const char *sep = "";
+    for (auto&& column : columns) {
+        query += sep;
+        query += escaper(db_name(column));
+        sep = ", ";
+    }
+    query += ")";
+
+    infile_state state;
+    state.producer_ = std::move(producer);
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        infile_handler_guard guard(conn, state);
+        try {
+            AMYTEST_METRIC_QUERY(bulk_load_template);
+            state.stats_.stored = execute(conn, query);
+        }
+        catch (...) {
+            if (state.error_) std::rethrow_exception(state.error_);
+            throw;
+        }
+    }
+    state.stats_.elapsed = std::chrono::steady_clock::now() - start;
+    AMYTEST_METRIC_COUNT(rows, state.stats_.rows);
+    return state.stats_;
+}
+
+bulk_load_stats bulk_load_messages(amy::connector& conn, serialized_message_producer producer)
+{
+    serialized_message message;
+
+    // the connection is busy until the load completes, so types are recorded in the dictionary afterwards
+    auto types = std::unordered_map<std::string, type_dictionary::type_id>();
+    auto stats = bulk_load(conn, "tbl_message_store", {"type_id", "binary_data"},
+                           [&](bulk_row& row)
+                           {
+                               if (not producer(message))
+                                   return false;
+                               auto ifind = types.find(message.message_type);
+                               if (ifind == types.end()) {
+                                   auto id = type_dictionary::id_for(message.message_type);
+                                   ifind = types.emplace(message.message_type, id).first;
+                               }
+                               row.add(std::int64_t(ifind->second)).add(message.payload);
+                               return true;
+                           });
+
+    auto dictionary = type_dictionary(conn);
+    for (auto&& entry : types)
+        dictionary.lookup(entry.first);
+    return stats;
+}
@@ -0,0 +1,76 @@
+//
+// Created by Richard Hodges on 24/04/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include <amy.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+struct bulk_load_stats
+{
+    double rows_per_second() const;
+    double bytes_per_second() const;
+
+    std::uint64_t rows = 0;
+
+    /// The rows the server reports as stored. LOAD DATA LOCAL skips a row which duplicates a unique key
+    /// instead of failing, so this can be less than `rows`.
+    std::uint64_t stored = 0;
+
+    std::uint64_t bytes = 0;
+    std::chrono::steady_clock::duration elapsed {};
+};
+
+std::ostream& operator<<(std::ostream& os, bulk_load_stats const& stats);
+
+/// One row of a bulk load, in LOAD DATA text format.
+/// Producers add fields in the same order as the column list given to the loader.
+/// Field data is escaped as it is appended, so binary payloads are safe.
+struct bulk_row
+{
+    bulk_row& add(const char* data, std::size_t length);
+
+    bulk_row& add(std::string const& str)
+    {
+        return add(str.data(), str.size());
+    }
+
+    bulk_row& add(std::int64_t value);
+
+    bulk_row& add_null();
+
+    std::string buffer_;
+    std::size_t fields_ = 0;
+};
+
+/// Return false when there are no more rows. The row passed in is empty.
+using bulk_row_producer = std::function<bool(bulk_row&)>;
+
+/// Stream rows from the producer into `table_name` with LOAD DATA LOCAL INFILE.
+/// No temporary file is written: the client's local-infile callbacks pull rows straight from the producer.
+/// @note the connection must have been opened with amy::client_local_files
+bulk_load_stats bulk_load(amy::connector& conn,
+                          std::string const& table_name,
+                          std::vector<std::string> const& columns,
+                          bulk_row_producer producer);
+
+struct serialized_message
+{
+    std::string message_type;
+    std::string payload;
+};
+
+/// Return false when there are no more messages.
+using serialized_message_producer = std::function<bool(serialized_message&)>;
+
+/// Bulk ingest into tbl_message_store. Payloads are stored verbatim in binary_data.
+/// Each message_type is recorded in the type dictionary once the load has finished.
+/// Payloads are not parsed, so nothing is added to tbl_message_index.
+bulk_load_stats bulk_load_messages(amy::connector& conn, serialized_message_producer producer);
@@ -0,0 +1,500 @@
+//
+// Created by Richard Hodges on 12/05/2017.
+//
+
+#include "change_feed.hpp"
+#include "message_store.hpp"
+#include "query_builder.hpp"
+#include "typed_rows.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+    using type_id = type_dictionary::type_id;
+
+    const char select_watermark_template[] =
+        "SELECT unique_id FROM tbl_feed_watermark WHERE subscriber = %1%";
+}
+
+change_feed::change_feed(amytest::asio::io_service& owner, amy::connector& conn, change_feed_options options)
+    : owner_(owner)
+    , connection_(conn)
+    , options_(options)
+    , timer_(owner)
+    , interval_(options.min_interval)
+{
+    if (options_.batch_size == 0 or options_.max_unacknowledged == 0)
+        throw std::invalid_argument("change feed batch size and unacknowledged limit must be at least 1");
+}
+
+void change_feed::init()
+{
+    execute(connection_, R"__(
+CREATE TABLE IF NOT EXISTS `tbl_feed_watermark` (
+  `subscriber` varchar(255) NOT NULL,
+  `unique_id` int(11) NOT NULL,
+  PRIMARY KEY (`subscriber`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+)__");
+}
+
+auto change_feed::subscribe(std::string const& name, google::protobuf::Message const& prototype, handler h)
+    -> subscription_id
+{
+    if (started_)
+        throw std::logic_error("change feed subscribers must be added before it starts");
+
+    connection_.query(build_query(connection_, select_watermark_template, name));
+    auto rs = connection_.store_result();
+    auto rows = typed_rows<int>(rs);
+    auto watermark = rows.empty() ? 0 : std::get<0>(rows.at(0));
+
+    auto s = subscription();
+    s.name = name;
+    s.type = type_dictionary::id_for(prototype.GetDescriptor());
+    s.message.reset(prototype.New());
+    s.on_message = std::move(h);
+    s.watermark = s.delivered = s.settled = s.settle_to = s.saved = watermark;
+    subscriptions_.push_back(std::move(s));
+    AMY_LOG(info, "change feed subscriber ", name, " resumes after ", watermark);
+    return subscriptions_.size() - 1;
+}
+
+void change_feed::acknowledge(subscription_id subscriber, int unique_id)
+{
+    owner_.post([this, subscriber, unique_id]
+                {
+                    this->do_acknowledge(subscriber, unique_id);
+                });
+}
+
+void change_feed::start()
+{
+    if (started_)
+        return;
+    started_ = true;
+    owner_.post([this] { this->poll(); });
+}
+
+void change_feed::stop()
+{
+    owner_.post([this]
+                {
+                    stopped_ = true;
+                    timer_.cancel();
+                });
+}
+
+int change_feed::watermark(subscription_id subscriber) const
+{
+    return subscriptions_.at(subscriber).watermark;
+}
+
+bool change_feed::accepting(subscription const& s) const
+{
+    return s.unacknowledged.size() < options_.max_unacknowledged;
+}
+
+void change_feed::update_watermark(subscription& s)
+{
+    auto acknowledged = s.unacknowledged.empty() ? s.delivered : *s.unacknowledged.begin() - 1;
+    s.watermark = std::min(acknowledged, s.settled);
+}
+
+int change_feed::offer(amy::result_set const& rs, std::vector<bool>& included, bool bounded)
+{
+    auto last_id = 0;
+    typed_rows<int, type_id, optional_bytes, optional_bytes>(rs).for_each(
+        [&](int id, type_id type, optional_bytes blob, optional_bytes json)
+        {
+            last_id = id;
+            for (std::size_t i = 0; i < subscriptions_.size(); ++i) {
+                auto& s = subscriptions_[i];
+                if (not included[i] or s.type != type or id <= s.settled or (bounded and id > s.settle_to)
+                    or s.seen.count(id))
+                    continue;
+                if (not accepting(s)) {
+                    included[i] = false;    // the rest is fetched again later
+                    continue;
+                }
+                s.seen.insert(id);
+                s.delivered = std::max(s.delivered, id);
+                try {
+                    s.message->Clear();
+                    parse_stored(type, blob, json, *s.message);
+                    s.unacknowledged.insert(id);
+                    s.on_message(i, id, *s.message);
+                }
+                catch (std::exception const& e) {
+                    // one bad row or handler must not stop the feed, so the message is passed over
+                    s.unacknowledged.erase(id);
+                    AMY_LOG(error, "change feed subscriber ", s.name, " skipped message ", id, ": ", e.what());
+                }
+            }
+        });
+    return last_id;
+}
+
+void change_feed::poll()
+{
+    busy_ = false;
+    if (stopped_)
+        return;
+
+    // subscribers with a full backlog are left out until they acknowledge
+    auto after = std::numeric_limits<int>::max();
+    auto types = std::vector<type_id>();
+    fetching_.assign(subscriptions_.size(), false);
+    for (std::size_t i = 0; i < subscriptions_.size(); ++i) {
+        auto&& s = subscriptions_[i];
+        if (not accepting(s))
+            continue;
+        fetching_[i] = true;
+        after = std::min(after, s.delivered);
+        if (std::find(types.begin(), types.end(), s.type) == types.end())
+            types.push_back(s.type);
+    }
+    if (types.empty())
+        return;
+
+    auto query = std::string("SELECT"
+                                 " unique_id, type_id, binary_data, json_data"
+                                 " FROM tbl_message_store"
+                                 " WHERE unique_id > ");
+    query += std::to_string(after);
+    query += " AND type_id IN (";
+    const char *sep = "";
+    for (auto type : types) {
+        query += sep;
+        query += std::to_string(type);
+        sep = ",";
+    }
+    query += ") ORDER BY unique_id LIMIT ";
+    query += std::to_string(options_.batch_size);
+
+    busy_ = true;
+    AMY_LOG(trace, "change feed: ", query);
+    connection_.async_query(query,
+                            [this](auto&& ...args)
+                            {
+                                this->handle_fetch(std::forward<decltype(args)>(args)...);
+                            });
+}
+
+void change_feed::handle_fetch(boost::system::error_code const& ec)
+{
+    if (ec) {
+        fail(ec);
+        return;
+    }
+    connection_.async_store_result([this](auto&& ...args)
+                                   {
+                                       this->handle_rows(std::forward<decltype(args)>(args)...);
+                                   });
+}
+
+void change_feed::handle_rows(boost::system::error_code const& ec, amy::result_set rs)
+{
+    if (ec) {
+        fail(ec);
+        return;
+    }
+
+    try {
+        // the subscribers this batch was fetched for
+        auto included = fetching_;
+        auto last_id = offer(rs, included, false);
+
+        // a subscriber which took every row of its type has seen everything up to the end of the batch
+        for (std::size_t i = 0; i < subscriptions_.size(); ++i) {
+            auto& s = subscriptions_[i];
+            if (included[i] and not rs.empty())
+                s.delivered = std::max(s.delivered, last_id);
+        }
+        if (not rs.empty())
+            horizon_.emplace_back(last_id, clock::now());
+
+        batch_rows_ = rs.size();
+        batch_was_full_ = rs.size() == options_.batch_size;
+        recheck();
+    }
+    catch (std::exception const& e) {
+        fail(e.what());
+    }
+}
+
+void change_feed::recheck()
+{
+    // the newest batch end which has had settle_interval to gather any lower ids still in flight
+    auto cutoff = clock::now() - options_.settle_interval;
+    settling_ = 0;
+    while (settling_ < horizon_.size() and horizon_[settling_].second <= cutoff)
+        ++settling_;
+    if (settling_ == 0) {
+        save_watermarks();
+        return;
+    }
+    auto target = horizon_[settling_ - 1].first;
+
+    auto after = std::numeric_limits<int>::max();
+    auto types = std::vector<type_id>();
+    rechecking_.assign(subscriptions_.size(), false);
+    for (std::size_t i = 0; i < subscriptions_.size(); ++i) {
+        auto&& s = subscriptions_[i];
+        s.settle_to = std::min(target, s.delivered);
+        if (s.settle_to <= s.settled or not accepting(s))
+            continue;
+        rechecking_[i] = true;
+        after = std::min(after, s.settled);
+        if (std::find(types.begin(), types.end(), s.type) == types.end())
+            types.push_back(s.type);
+    }
+    if (types.empty()) {
+        settle();
+        return;
+    }
+
+    auto query = std::string("SELECT unique_id, type_id FROM tbl_message_store WHERE unique_id > ");
+    query += std::to_string(after);
+    query += " AND unique_id <= ";
+    query += std::to_string(target);
+    query += " AND type_id IN (";
+    const char *sep = "";
+    for (auto type : types) {
+        query += sep;
+        query += std::to_string(type);
+        sep = ",";
+    }
+    query += ')';
+
+    AMY_LOG(trace, "change feed: ", query);
+    connection_.async_query(query,
+                            [this](boost::system::error_code const& ec)
+                            {
+                                if (ec) {
+                                    this->fail(ec);
+                                    return;
+                                }
+                                connection_.async_store_result([this](auto&& ...args)
+                                                               {
+                                                                   this->handle_recheck_ids(
+                                                                       std::forward<decltype(args)>(args)...);
+                                                               });
+                            });
+}
+
+void change_feed::handle_recheck_ids(boost::system::error_code const& ec, amy::result_set rs)
+{
+    if (ec) {
+        fail(ec);
+        return;
+    }
+
+    try {
+        auto missing = std::set<int>();
+        typed_rows<int, type_id>(rs).for_each([&](int id, type_id type)
+                                              {
+                                                  for (std::size_t i = 0; i < subscriptions_.size(); ++i) {
+                                                      auto&& s = subscriptions_[i];
+                                                      if (rechecking_[i] and s.type == type and id > s.settled
+                                                          and id <= s.settle_to and not s.seen.count(id))
+                                                          missing.insert(id);
+                                                  }
+                                              });
+        if (missing.empty()) {
+            settle();
+            return;
+        }
+
+        AMY_LOG(info, "change feed: ", missing.size(), " messages committed late, first ", *missing.begin());
+        auto query = std::string("SELECT"
+                                     " unique_id, type_id, binary_data, json_data"
+                                     " FROM tbl_message_store"
+                                     " WHERE unique_id IN (");
+        const char *sep = "";
+        for (auto id : missing) {
+            query += sep;
+            query += std::to_string(id);
+            sep = ",";
+        }
+        query += ") ORDER BY unique_id";
+
+        AMY_LOG(trace, "change feed: ", query);
+        connection_.async_query(query,
+                                [this](boost::system::error_code const& ec)
+                                {
+                                    if (ec) {
+                                        this->fail(ec);
+                                        return;
+                                    }
+                                    connection_.async_store_result([this](auto&& ...args)
+                                                                   {
+                                                                       this->handle_recheck_rows(
+                                                                           std::forward<decltype(args)>(args)...);
+                                                                   });
+                                });
+    }
+    catch (std::exception const& e) {
+        fail(e.what());
+    }
+}
+
+void change_feed::handle_recheck_rows(boost::system::error_code const& ec, amy::result_set rs)
+{
+    if (ec) {
+        fail(ec);
+        return;
+    }
+
+    try {
+        // a subscriber which fills up drops out of rechecking_, and is settled later
+        offer(rs, rechecking_, true);
+        settle();
+    }
+    catch (std::exception const& e) {
+        fail(e.what());
+    }
+}
+
+void change_feed::settle()
+{
+    auto complete = true;
+    for (std::size_t i = 0; i < subscriptions_.size(); ++i) {
+        auto& s = subscriptions_[i];
+        if (not rechecking_[i]) {
+            complete = complete and s.settle_to <= s.settled;
+            continue;
+        }
+        s.settled = s.settle_to;
+        s.seen.erase(s.seen.begin(), s.seen.upper_bound(s.settled));
+        update_watermark(s);
+    }
+
+    // a subscriber paused by backpressure settles the range in a later re-check
+    if (complete)
+        horizon_.erase(horizon_.begin(), horizon_.begin() + settling_);
+    settling_ = 0;
+    save_watermarks();
+}
+
+void change_feed::save_watermarks()
+{
+    auto escaper = sql_escaper(connection_);
+    auto query = std::string("REPLACE INTO tbl_feed_watermark (subscriber, unique_id) VALUES ");
+    const char *sep = "";
+    for (auto&& s : subscriptions_) {
+        if (s.watermark == s.saved)
+            continue;
+        query += sep;
+        query += '(';
+        query += escaper(s.name);
+        query += ", ";
+        query += std::to_string(s.watermark);
+        query += ')';
+        sep = ", ";
+    }
+    if (*sep == 0) {
+        handle_save(boost::system::error_code());
+        return;
+    }
+
+    // remember what is being written, since acknowledgements may move the watermarks meanwhile
+    auto saving = std::make_shared<std::vector<int>>();
+    for (auto&& s : subscriptions_)
+        saving->push_back(s.watermark);
+
+    AMY_LOG(trace, "change feed: ", query);
+    connection_.async_query(query,
+                            [this, saving](boost::system::error_code const& ec)
+                            {
+                                if (ec) {
+                                    this->handle_save(ec);
+                                    return;
+                                }
+                                connection_.async_store_result(
+                                    [this, saving](boost::system::error_code const& ec, amy::result_set)
+                                    {
+                                        if (not ec) {
+                                            for (std::size_t i = 0; i < saving->size(); ++i)
+                                                subscriptions_[i].saved = (*saving)[i];
+                                        }
+                                        this->handle_save(ec);
+                                    });
+                            });
+}
+
+void change_feed::handle_save(boost::system::error_code const& ec)
+{
+    if (ec) {
+        fail(ec);
+        return;
+    }
+
+    // adaptive polling: straight back for a full batch, slowing down while there is nothing new
+    if (batch_was_full_) {
+        interval_ = options_.min_interval;
+        schedule(std::chrono::milliseconds::zero());
+    }
+    else if (batch_rows_) {
+        interval_ = options_.min_interval;
+        schedule(interval_);
+    }
+    else {
+        auto delay = interval_;
+        interval_ = std::min(interval_ * 2, options_.max_interval);
+        schedule(delay);
+    }
+}
+
+void change_feed::schedule(std::chrono::milliseconds delay)
+{
+    if (stopped_) {
+        busy_ = false;
+        return;
+    }
+    busy_ = true;
+    if (delay == std::chrono::milliseconds::zero()) {
+        owner_.post([this] { this->poll(); });
+        return;
+    }
+    timer_.expires_from_now(delay);
+    timer_.async_wait([this](boost::system::error_code const& ec)
+                      {
+                          if (ec)
+                              busy_ = false;
+                          else
+                              this->poll();
+                      });
+}
+
+void change_feed::do_acknowledge(subscription_id subscriber, int unique_id)
+{
+    auto& s = subscriptions_.at(subscriber);
+    auto was_accepting = accepting(s);
+    if (not s.unacknowledged.erase(unique_id)) {
+        AMY_LOG(warning, "change feed subscriber ", s.name, " acknowledged ", unique_id,
+                " which is not outstanding");
+        return;
+    }
+    update_watermark(s);
+
+    // a feed paused by backpressure resumes as soon as there is room
+    if (not was_accepting and accepting(s) and started_ and not busy_)
+        poll();
+}
+
+void change_feed::fail(boost::system::error_code const& ec)
+{
+    fail(connection_.error_message(ec));
+}
+
+void change_feed::fail(std::string const& what)
+{
+    AMY_LOG(error, "change feed: ", what);
+    interval_ = options_.max_interval;
+    schedule(options_.max_interval);
+}
@@ -0,0 +1,147 @@
+//
+// Created by Richard Hodges on 12/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include "type_dictionary.hpp"
+#include <amy.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
+#include <google/protobuf/message.h>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+struct change_feed_options
+{
+    /// Rows fetched per query
+    std::size_t batch_size = 500;
+
+    /// After a batch with rows the feed polls again after min_interval, or at once if the batch was full.
+    /// Each empty poll doubles the interval, up to max_interval.
+    std::chrono::milliseconds min_interval { 10 };
+    std::chrono::milliseconds max_interval { 2000 };
+
+    /// A subscriber with this many unacknowledged messages receives no more until it acknowledges some
+    std::size_t max_unacknowledged = 1000;
+
+    /// How long after an id has been seen the feed looks again for lower ids which were not yet committed,
+    /// before the watermark may pass them
+    std::chrono::milliseconds settle_interval { 1000 };
+};
+
+/// Delivers messages appended to tbl_message_store to subscribers, in unique_id order, by polling on a
+/// connection of its own.
+///
+/// Each subscriber names one message type and has a watermark: the highest unique_id below which it has
+/// acknowledged every message. Within a run each message is delivered to a subscriber once. Watermarks are
+/// saved in tbl_feed_watermark under the subscriber's name after each poll, so a restarted subscriber
+/// resumes after its last saved watermark; messages delivered but not yet acknowledged at that point are
+/// delivered again.
+///
+/// AUTO_INCREMENT ids are allocated at insert but become visible at commit, so a lower id can appear after a
+/// higher one has been delivered. Such a message is delivered late, out of id order. Once settle_interval has
+/// passed since an id was fetched, the feed lists the ids below it once more, delivers any it missed, and only
+/// then lets the watermark pass them. A transaction which commits later than that is not delivered.
+///
+/// Everything runs on the io_service. acknowledge() and stop() may be called from any thread.
+struct change_feed
+{
+    using subscription_id = std::size_t;
+
+    /// `message` is only valid during the call. A message which fails to parse, or whose handler throws, is
+    /// logged and passed over.
+    using handler = std::function<void(subscription_id, int unique_id, google::protobuf::Message const& message)>;
+
+    /// `conn` must be connected, and is used by nothing else while the feed runs
+    change_feed(amytest::asio::io_service& owner, amy::connector& conn, change_feed_options options = {});
+
+    change_feed(change_feed const&) = delete;
+    change_feed& operator=(change_feed const&) = delete;
+
+    /// Create tbl_feed_watermark
+    void init();
+
+    /// Add a subscriber for messages of the prototype's type, resuming from the watermark saved under `name`
+    /// or, for a new name, from the start of the table. Only before start().
+    subscription_id subscribe(std::string const& name, google::protobuf::Message const& prototype, handler h);
+
+    /// Mark a delivered message as processed
+    void acknowledge(subscription_id subscriber, int unique_id);
+
+    void start();
+
+    /// Stop polling once the current query completes. Unsaved watermarks are not saved.
+    void stop();
+
+    /// Only on the io_service's thread, or when it is not running
+    int watermark(subscription_id subscriber) const;
+
+private:
+    struct subscription
+    {
+        std::string name;
+        type_dictionary::type_id type;
+        std::unique_ptr<google::protobuf::Message> message;
+        handler on_message;
+
+        int watermark;                  // every id up to here is acknowledged and settled
+        int delivered;                  // the highest id delivered, or passed over as another type's
+        int settled;                    // no id up to here can still appear
+        int settle_to;                  // where the outstanding re-check will settle
+        int saved;                      // the watermark in tbl_feed_watermark
+        std::set<int> seen;             // the ids above `settled` which have been delivered
+        std::set<int> unacknowledged;
+    };
+
+    using optional_bytes = boost::optional<boost::string_view>;
+    using clock = std::chrono::steady_clock;
+
+    bool accepting(subscription const& s) const;
+
+    void update_watermark(subscription& s);
+
+    /// Deliver each row to the included subscribers which have not seen it and for which it is no higher
+    /// than their settle_to, or any id if `bounded` is false. A subscriber which fills up is excluded from
+    /// the rest. Returns the last id.
+    int offer(amy::result_set const& rs, std::vector<bool>& included, bool bounded);
+
+    void poll();
+    void handle_fetch(boost::system::error_code const& ec);
+    void handle_rows(boost::system::error_code const& ec, amy::result_set rs);
+    void recheck();
+    void handle_recheck_ids(boost::system::error_code const& ec, amy::result_set rs);
+    void handle_recheck_rows(boost::system::error_code const& ec, amy::result_set rs);
+    void settle();
+    void save_watermarks();
+    void handle_save(boost::system::error_code const& ec);
+    void schedule(std::chrono::milliseconds delay);
+    void do_acknowledge(subscription_id subscriber, int unique_id);
+    void fail(boost::system::error_code const& ec);
+
+    /// Log, and poll again after max_interval
+    void fail(std::string const& what);
+
+    amytest::asio::io_service& owner_;
+    amy::connector& connection_;
+    change_feed_options options_;
+    amytest::asio::steady_timer timer_;
+    std::vector<subscription> subscriptions_;
+    std::vector<bool> fetching_;        // the subscribers the outstanding fetch is for
+    std::vector<bool> rechecking_;      // the subscribers the outstanding re-check is for
+    std::deque<std::pair<int, clock::time_point>> horizon_;    // the last id of each batch, and when
+    std::size_t settling_ = 0;          // the horizon entries the outstanding re-check covers
+
+    std::chrono::milliseconds interval_;
+    bool started_ = false;
+    bool stopped_ = false;
+    bool busy_ = false;                 // a query or a timer is outstanding
+    bool batch_was_full_ = false;
+    std::size_t batch_rows_ = 0;
+};
@@ -0,0 +1,1264 @@
+//
+// Created by Richard Hodges on 28/04/2017.
+//
+
+#include "fake_database.hpp"
+#include "base64.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+
+namespace {
+
+    bool iequals(std::string const& l, const char *r)
+    {
+        auto len = std::strlen(r);
+        if (l.size() != len) return false;
+        for (std::size_t i = 0; i < len; ++i)
+            if (std::toupper((unsigned char) l[i]) != std::toupper((unsigned char) r[i]))
+                return false;
+        return true;
+    }
+
+    bool iequals(std::string const& l, std::string const& r)
+    {
+        return iequals(l, r.c_str());
+    }
+
+    [[noreturn]] void parse_error(std::string const& near)
+    {
+        throw fake_sql_error(1064, "42000", "You have an error in your SQL syntax near '" + near + "'");
+    }
+
+    char unescape(char c)
+    {
+        switch (c) {
+            case '0': return '\0';
+            case 'b': return '\b';
+            case 'n': return '\n';
+            case 'r': return '\r';
+            case 't': return '\t';
+            case 'Z': return '\032';
+            default: return c;
+        }
+    }
+
+    std::vector<fake_token> lex(std::string const& sql)
+    {
+        std::vector<fake_token> tokens;
+        auto first = sql.begin();
+        auto last = sql.end();
+        while (first != last) {
+            auto c = *first;
+            if (std::isspace((unsigned char) c)) {
+                ++first;
+            }
+            else if (c == '-' and std::next(first) != last and *std::next(first) == '-') {
+                first = std::find(first, last, '\n');
+            }
+            else if (c == '\'' or c == '"') {
+                auto quote = c;
+                std::string text;
+                ++first;
+                while (true) {
+                    if (first == last) parse_error("unterminated string");
+                    auto ch = *first++;
+                    if (ch == '\\' and first != last) {
+                        text.push_back(unescape(*first++));
+                    }
+                    else if (ch == quote) {
+                        if (first != last and *first == quote) {
+                            text.push_back(quote);
+                            ++first;
+                        }
+                        else break;
+                    }
+                    else text.push_back(ch);
+                }
+                tokens.push_back({fake_token::string, std::move(text)});
+            }
+            else if (c == '`') {
+                auto close = std::find(std::next(first), last, '`');
+                if (close == last) parse_error("unterminated identifier");
+                tokens.push_back({fake_token::quoted_identifier, std::string(std::next(first), close)});
+                first = std::next(close);
+            }
+            else if (std::isdigit((unsigned char) c)) {
+                auto end = std::find_if(first, last, [](char ch) { return not(std::isalnum((unsigned char) ch) or ch == '.'); });
+                tokens.push_back({fake_token::number, std::string(first, end)});
+                first = end;
+            }
+            else if (std::isalpha((unsigned char) c) or c == '_' or c == '@') {
+                auto end = std::find_if(first, last, [](char ch) { return not(std::isalnum((unsigned char) ch) or ch == '_' or ch == '@' or ch == '$'); });
+                tokens.push_back({fake_token::identifier, std::string(first, end)});
+                first = end;
+            }
+            else if (c == '?') {
+                tokens.push_back({fake_token::placeholder, "?"});
+                ++first;
+            }
+            else {
+                static const char *const doubles[] = {"<=", ">=", "<>", "!="};
+                auto text = std::string(1, c);
+                if (std::next(first) != last) {
+                    auto pair = std::string(first, first + 2);
+                    for (auto d : doubles)
+                        if (pair == d) text = pair;
+                }
+                first += text.size();
+                tokens.push_back({fake_token::symbol, std::move(text)});
+            }
+        }
+        return tokens;
+    }
+
+    std::int64_t to_integer(std::string const& s)
+    {
+        return std::strtoll(s.c_str(), nullptr, 10);
+    }
+
+    int compare(fake_column const& column, fake_value const& l, fake_value const& r)
+    {
+        if (not l or not r) return int(bool(l)) - int(bool(r));
+        if (column.integer) {
+            auto a = to_integer(*l), b = to_integer(*r);
+            return a < b ? -1 : (b < a ? 1 : 0);
+        }
+        return l->compare(*r);
+    }
+
+    /// A primary key value as stored in table::by_key, or false if a key column is NULL
+    bool append_key(std::string& key, fake_column const& column, fake_value const& value)
+    {
+        if (not value) return false;
+        auto text = column.integer ? std::to_string(to_integer(*value)) : *value;
+        key += std::to_string(text.size());
+        key += ':';
+        key += text;
+        return true;
+    }
+
+    boost::optional<std::string> key_of(fake_database::table const& t, fake_row const& row)
+    {
+        if (t.primary_key.empty()) return boost::none;
+        std::string key;
+        for (auto k : t.primary_key)
+            if (not append_key(key, t.columns[k], row[k])) return boost::none;
+        return key;
+    }
+
+    void reindex(fake_database::table& t)
+    {
+        t.by_key.clear();
+        for (std::size_t i = 0; i < t.rows.size(); ++i)
+            if (auto key = key_of(t, t.rows[i])) t.by_key[*key] = i;
+    }
+
+    std::string from_base64(std::string const& in)
+    {
+        auto b = base64();
+        std::string result(b.needed_decoded_length(int(in.size())) + 3, 0);
+        auto len = b.decode(in.data(), in.size(), &result[0], nullptr);
+        if (len < 0) throw fake_sql_error(1064, "42000", "invalid base64");
+        result.resize(len);
+        return result;
+    }
+
+    std::string unhex(std::string const& in)
+    {
+        auto nibble = [](char c) -> int {
+            if (c >= '0' and c <= '9') return c - '0';
+            if (c >= 'a' and c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' and c <= 'F') return c - 'A' + 10;
+            throw fake_sql_error(1064, "42000", "invalid hex");
+        };
+        std::string result;
+        result.reserve(in.size() / 2);
+        for (std::size_t i = 0; i + 1 < in.size(); i += 2)
+            result.push_back(char(nibble(in[i]) << 4 | nibble(in[i + 1])));
+        return result;
+    }
+
+    bool is_integer_type(std::string const& type)
+    {
+        static const char *const types[] = {"INT", "INTEGER", "BIGINT", "SMALLINT", "TINYINT", "MEDIUMINT"};
+        for (auto t : types)
+            if (iequals(type, t)) return true;
+        return false;
+    }
+
+    bool is_binary_type(std::string const& type)
+    {
+        static const char *const types[] = {"BLOB", "LONGBLOB", "MEDIUMBLOB", "TINYBLOB", "BINARY", "VARBINARY"};
+        for (auto t : types)
+            if (iequals(type, t)) return true;
+        return false;
+    }
+}
+
+/// Recursive descent over a statement's tokens, executing as it goes
+struct fake_executor
+{
+    using table = fake_database::table;
+
+    fake_executor(fake_database& db, fake_statement const& statement,
+                  std::vector<fake_value> const& params, fake_session& session)
+        : db(db)
+        , session(session)
+    {
+        if (params.size() != statement.param_count)
+            throw fake_sql_error(1210, "HY000", "Incorrect arguments to mysqld_stmt_execute");
+        auto next_param = params.begin();
+        tokens.reserve(statement.tokens.size());
+        for (auto&& token : statement.tokens) {
+            if (token.kind == fake_token::placeholder) {
+                auto&& value = *next_param++;
+                if (value) tokens.push_back({fake_token::string, *value});
+                else tokens.push_back({fake_token::null_value, "NULL"});
+            }
+            else tokens.push_back(token);
+        }
+    }
+
+    // token helpers
+
+    bool at_end() const { return pos == tokens.size(); }
+
+    fake_token const& peek(std::size_t ahead = 0) const
+    {
+        static const fake_token end_token{fake_token::symbol, ""};
+        return pos + ahead < tokens.size() ? tokens[pos + ahead] : end_token;
+    }
+
+    fake_token const& next()
+    {
+        if (at_end()) parse_error("end of statement");
+        return tokens[pos++];
+    }
+
+    bool is_keyword(const char *word, std::size_t ahead = 0) const
+    {
+        auto&& t = peek(ahead);
+        return t.kind == fake_token::identifier and iequals(t.text, word);
+    }
+
+    bool accept_keyword(const char *word)
+    {
+        if (not is_keyword(word)) return false;
+        ++pos;
+        return true;
+    }
+
+    void expect_keyword(const char *word)
+    {
+        if (not accept_keyword(word)) parse_error(peek().text);
+    }
+
+    bool is_symbol(const char *sym) const
+    {
+        auto&& t = peek();
+        return t.kind == fake_token::symbol and t.text == sym;
+    }
+
+    bool accept_symbol(const char *sym)
+    {
+        if (not is_symbol(sym)) return false;
+        ++pos;
+        return true;
+    }
+
+    void expect_symbol(const char *sym)
+    {
+        if (not accept_symbol(sym)) parse_error(peek().text);
+    }
+
+    std::string parse_name()
+    {
+        auto&& t = next();
+        if (t.kind != fake_token::identifier and t.kind != fake_token::quoted_identifier)
+            parse_error(t.text);
+        auto name = t.text;
+        if (accept_symbol(".")) {
+            auto&& member = next();
+            name += "." + member.text;
+        }
+        return name;
+    }
+
+    std::string string_literal()
+    {
+        auto&& t = next();
+        if (t.kind != fake_token::string) parse_error(t.text);
+        return t.text;
+    }
+
+    fake_value parse_value()
+    {
+        auto&& t = next();
+        switch (t.kind) {
+            case fake_token::string:
+            case fake_token::number:
+                return t.text;
+            case fake_token::null_value:
+                return boost::none;
+            case fake_token::symbol:
+                if (t.text == "-") {
+                    auto&& n = next();
+                    if (n.kind != fake_token::number) parse_error(n.text);
+                    return "-" + n.text;
+                }
+                if (t.text == "(") {
+                    auto v = parse_value();
+                    expect_symbol(")");
+                    return v;
+                }
+                break;
+            case fake_token::identifier:
+            case fake_token::quoted_identifier:
+                if (t.kind == fake_token::identifier) {
+                    if (iequals(t.text, "NULL")) return boost::none;
+                    if (iequals(t.text, "TRUE")) return std::string("1");
+                    if (iequals(t.text, "FALSE")) return std::string("0");
+                    if (accept_symbol("(")) return parse_function(t.text);
+                }
+                if (source_row)
+                    return (*source_row)[column_index(*source_table, t.text)];
+                break;
+            default:
+                break;
+        }
+        parse_error(t.text);
+    }
+
+    fake_value parse_function(std::string const& name)
+    {
+        if (iequals(name, "LAST_INSERT_ID")) {
+            expect_symbol(")");
+            return std::to_string(session.last_insert_id);
+        }
+        if (iequals(name, "DATABASE")) {
+            expect_symbol(")");
+            if (session.database.empty()) return boost::none;
+            return session.database;
+        }
+        auto arg = parse_value();
+        expect_symbol(")");
+        if (not arg) return arg;
+        if (iequals(name, "FROM_BASE64")) return from_base64(*arg);
+        if (iequals(name, "UNHEX")) return unhex(*arg);
+        throw fake_sql_error(1305, "42000", "FUNCTION " + name + " does not exist");
+    }
+
+    // schema helpers
+
+    table& find_table(std::string const& name)
+    {
+        auto ifind = db.tables_.find(name);
+        if (ifind == db.tables_.end())
+            throw fake_sql_error(1146, "42S02", "Table '" + name + "' doesn't exist");
+        return ifind->second;
+    }
+
+    /// The table, about to be written: saved first in each undo log of the open transaction that lacks it
+    table& writable(std::string const& name)
+    {
+        auto& t = find_table(name);
+        if (session.in_transaction) {
+            auto save = [&](fake_session::undo_log& log) {
+                if (not log.count(name)) log.emplace(name, fake_session::saved_table { t, 0 });
+            };
+            save(session.transaction);
+            for (auto&& savepoint : session.savepoints)
+                save(savepoint.second);
+        }
+        noted_write(name, ++t.version);
+        return t;
+    }
+
+    void noted_write(std::string const& name, std::uint64_t version)
+    {
+        auto note = [&](fake_session::undo_log& log) {
+            auto ifind = log.find(name);
+            if (ifind != log.end()) ifind->second.version = version;
+        };
+        note(session.transaction);
+        for (auto&& savepoint : session.savepoints)
+            note(savepoint.second);
+    }
+
+    /// Put back every table in `log`, or none of them if another session has written one since
+    void undo(fake_session::undo_log& log)
+    {
+        for (auto&& entry : log) {
+            auto ifind = db.tables_.find(entry.first);
+            if (ifind == db.tables_.end() or ifind->second.version != entry.second.version)
+                throw fake_sql_error(1235, "42000", "This version of the fake server doesn't yet support rolling back"
+                                                    " '" + entry.first + "' after another session wrote it");
+        }
+        for (auto&& entry : log) {
+            auto& t = db.tables_.at(entry.first);
+            auto version = t.version + 1;
+            t = std::move(entry.second.before);
+            t.version = version;
+            noted_write(entry.first, version);
+        }
+        log.clear();
+    }
+
+    fake_result begin()
+    {
+        commit();
+        session.in_transaction = true;
+        return fake_result();
+    }
+
+    void commit()
+    {
+        session.in_transaction = false;
+        session.transaction.clear();
+        session.savepoints.clear();
+    }
+
+    std::vector<std::pair<std::string, fake_session::undo_log>>::iterator find_savepoint(std::string const& name)
+    {
+        auto ifind = std::find_if(session.savepoints.begin(), session.savepoints.end(),
+                                  [&](auto&& savepoint) { return iequals(savepoint.first, name); });
+        if (ifind == session.savepoints.end())
+            throw fake_sql_error(1305, "42000", "SAVEPOINT " + name + " does not exist");
+        return ifind;
+    }
+
+    fake_result rollback()
+    {
+        accept_keyword("WORK");
+        if (accept_keyword("TO")) {
+            accept_keyword("SAVEPOINT");
+            auto name = parse_name();
+            expect_end();
+            auto ifind = find_savepoint(name);
+            undo(ifind->second);
+            session.savepoints.erase(std::next(ifind), session.savepoints.end());
+            return fake_result();
+        }
+        expect_end();
+        try {
+            undo(session.transaction);
+        }
+        catch (...) {
+            // the transaction ends either way; its changes stay and the client is told so
+            commit();
+            throw;
+        }
+        commit();
+        return fake_result();
+    }
+
+    fake_result savepoint()
+    {
+        auto name = parse_name();
+        expect_end();
+        if (not session.in_transaction)
+            return fake_result();
+        auto ifind = std::find_if(session.savepoints.begin(), session.savepoints.end(),
+                                  [&](auto&& savepoint) { return iequals(savepoint.first, name); });
+        if (ifind != session.savepoints.end())
+            session.savepoints.erase(ifind);
+        session.savepoints.emplace_back(name, fake_session::undo_log());
+        return fake_result();
+    }
+
+    fake_result release()
+    {
+        expect_keyword("SAVEPOINT");
+        auto name = parse_name();
+        expect_end();
+        session.savepoints.erase(find_savepoint(name), session.savepoints.end());
+        return fake_result();
+    }
+
+    static std::size_t column_index(table const& t, std::string const& name)
+    {
+        for (std::size_t i = 0; i < t.columns.size(); ++i)
+            if (iequals(t.columns[i].name, name)) return i;
+        throw fake_sql_error(1054, "42S22", "Unknown column '" + name + "'");
+    }
+
+    /// information_schema.COLUMNS, built on demand
+    table columns_view() const
+    {
+        table view;
+        for (auto name : {"TABLE_SCHEMA", "TABLE_NAME", "COLUMN_NAME"}) {
+            fake_column c;
+            c.name = name;
+            view.columns.push_back(c);
+        }
+        for (auto&& entry : db.tables_)
+            for (auto&& column : entry.second.columns)
+                view.rows.push_back({fake_value(session.database), fake_value(entry.first), fake_value(column.name)});
+        return view;
+    }
+
+    // statements
+
+    fake_result run()
+    {
+        if (accept_keyword("SELECT")) return select(false);
+        if (accept_keyword("INSERT")) return insert(false);
+        if (accept_keyword("REPLACE")) return insert(true);
+        if (accept_keyword("UPDATE")) return update();
+        if (accept_keyword("DELETE")) return erase();
+        if (accept_keyword("LOAD")) return load_data();
+        if (accept_keyword("START")) { expect_keyword("TRANSACTION"); return begin(); }
+        if (accept_keyword("BEGIN")) { accept_keyword("WORK"); return begin(); }
+        if (accept_keyword("COMMIT")) { accept_keyword("WORK"); commit(); return fake_result(); }
+        if (accept_keyword("ROLLBACK")) return rollback();
+        if (accept_keyword("SAVEPOINT")) return savepoint();
+        if (accept_keyword("RELEASE")) return release();
+
+        // schema changes commit the open transaction
+        static const char *const schema_changes[] = {"CREATE", "DROP", "RENAME", "ALTER"};
+        for (auto word : schema_changes)
+            if (is_keyword(word)) commit();
+        if (accept_keyword("CREATE")) return create();
+        if (accept_keyword("DROP")) return drop();
+        if (accept_keyword("RENAME")) return rename();
+        if (accept_keyword("ALTER")) return alter();
+
+        if (accept_keyword("SET")) return fake_result();
+        if (accept_keyword("USE")) {
+            session.database = parse_name();
+            return fake_result();
+        }
+        throw fake_sql_error(1235, "42000", "This version of the fake server doesn't yet support '" + peek().text + "'");
+    }
+
+    /// A LIMIT or OFFSET operand, which must be a non-negative integer
+    std::size_t parse_row_count()
+    {
+        auto value = parse_value();
+        if (describing)
+            return 0;
+        if (not value or value->empty()
+            or not std::all_of(value->begin(), value->end(), [](char c) { return std::isdigit((unsigned char) c); }))
+            throw fake_sql_error(1210, "HY000", "Incorrect arguments to LIMIT: " + (value ? *value : "NULL"));
+        return std::size_t(to_integer(*value));
+    }
+
+    struct select_item
+    {
+        enum kind_type { column, count, value } kind;
+        std::size_t index = 0;
+        fake_value constant;
+        std::string name;
+    };
+
+    struct condition
+    {
+        std::size_t column;
+        std::string op;
+        std::vector<fake_value> values;
+    };
+
+    std::vector<condition> parse_where(table const& t)
+    {
+        std::vector<condition> result;
+        if (not accept_keyword("WHERE")) return result;
+        do {
+            condition c;
+            c.column = column_index(t, parse_name());
+            if (accept_keyword("IN")) {
+                c.op = "IN";
+                expect_symbol("(");
+                do c.values.push_back(parse_value()); while (accept_symbol(","));
+                expect_symbol(")");
+            }
+            else if (accept_keyword("IS")) {
+                c.op = accept_keyword("NOT") ? "IS NOT NULL" : "IS NULL";
+                expect_keyword("NULL");
+            }
+            else {
+                auto&& op = next();
+                if (op.kind != fake_token::symbol) parse_error(op.text);
+                c.op = op.text;
+                c.values.push_back(parse_value());
+            }
+            result.push_back(std::move(c));
+        } while (accept_keyword("AND"));
+        return result;
+    }
+
+    static bool matches(table const& t, fake_row const& row, std::vector<condition> const& conditions)
+    {
+        for (auto&& c : conditions) {
+            auto&& column = t.columns[c.column];
+            auto&& value = row[c.column];
+            if (c.op == "IS NULL") { if (value) return false; continue; }
+            if (c.op == "IS NOT NULL") { if (not value) return false; continue; }
+            if (not value) return false;
+            if (c.op == "IN") {
+                if (std::none_of(c.values.begin(), c.values.end(),
+                                 [&](auto&& v) { return v and compare(column, value, v) == 0; }))
+                    return false;
+                continue;
+            }
+            if (not c.values[0]) return false;
+            auto cmp = compare(column, value, c.values[0]);
+            auto ok = (c.op == "=") ? cmp == 0
+                    : (c.op == "<") ? cmp < 0
+                    : (c.op == ">") ? cmp > 0
+                    : (c.op == "<=") ? cmp <= 0
+                    : (c.op == ">=") ? cmp >= 0
+                    : (c.op == "!=" or c.op == "<>") ? cmp != 0
+                    : false;
+            if (not ok) return false;
+        }
+        return true;
+    }
+
+    /// The positions of the rows matching `conditions`, in table order. A single column primary key compared
+    /// with = or IN is looked up rather than scanned for.
+    std::vector<std::size_t> candidates(table const& t, std::vector<condition> const& conditions)
+    {
+        std::vector<std::size_t> result;
+        if (t.primary_key.size() == 1) {
+            auto k = t.primary_key.front();
+            for (auto&& c : conditions) {
+                if (c.column != k or (c.op != "=" and c.op != "IN")) continue;
+                for (auto&& value : c.values) {
+                    std::string key;
+                    if (not append_key(key, t.columns[k], value)) continue;
+                    auto ifind = t.by_key.find(key);
+                    if (ifind != t.by_key.end() and matches(t, t.rows[ifind->second], conditions))
+                        result.push_back(ifind->second);
+                }
+                std::sort(result.begin(), result.end());
+                result.erase(std::unique(result.begin(), result.end()), result.end());
+                return result;
+            }
+        }
+        for (std::size_t i = 0; i < t.rows.size(); ++i)
+            if (matches(t, t.rows[i], conditions)) result.push_back(i);
+        return result;
+    }
+
+    std::vector<select_item> parse_select_list()
+    {
+        std::vector<select_item> items;
+        do {
+            select_item item;
+            if (accept_symbol("*")) {
+                item.kind = select_item::column;
+                item.name = "*";
+            }
+            else if (is_keyword("COUNT") and peek(1).text == "(") {
+                pos += 2;
+                expect_symbol("*");
+                expect_symbol(")");
+                item.kind = select_item::count;
+                item.name = "count(*)";
+            }
+            else if ((peek().kind == fake_token::identifier or peek().kind == fake_token::quoted_identifier)
+                     and peek(1).text != "(" and not is_keyword("NULL")) {
+                item.kind = select_item::column;
+                item.name = parse_name();
+            }
+            else {
+                auto start = pos;
+                item.kind = select_item::value;
+                item.constant = parse_value();
+                for (auto i = start; i < pos; ++i) item.name += tokens[i].text;
+            }
+            if (accept_keyword("AS")) item.name = parse_name();
+            items.push_back(std::move(item));
+        } while (accept_symbol(","));
+        return items;
+    }
+
+    fake_result select(bool describe_only)
+    {
+        fake_result result;
+        result.has_rows = true;
+        auto items = parse_select_list();
+
+        if (not accept_keyword("FROM")) {
+            fake_row row;
+            for (auto&& item : items) {
+                if (item.kind != select_item::value) parse_error(item.name);
+                fake_column c;
+                c.name = item.name;
+                c.integer = item.constant and not item.constant->empty()
+                            and std::all_of(item.constant->begin(), item.constant->end(),
+                                            [](char ch) { return std::isdigit((unsigned char) ch); });
+                result.columns.push_back(c);
+                row.push_back(item.constant);
+            }
+            if (not describe_only) result.rows.push_back(std::move(row));
+            return result;
+        }
+
+        auto name = parse_name();
+        table view;
+        table& t = iequals(name, "information_schema.COLUMNS") ? (view = columns_view(), view) : find_table(name);
+
+        // resolve the select list
+        std::vector<std::pair<select_item::kind_type, std::size_t>> plan;
+        bool aggregate = false;
+        for (auto&& item : items) {
+            if (item.kind == select_item::column and item.name == "*") {
+                for (std::size_t i = 0; i < t.columns.size(); ++i) {
+                    result.columns.push_back(t.columns[i]);
+                    plan.emplace_back(select_item::column, i);
+                }
+            }
+            else if (item.kind == select_item::column) {
+                auto dot = item.name.rfind('.');
+                auto index = column_index(t, dot == std::string::npos ? item.name : item.name.substr(dot + 1));
+                auto c = t.columns[index];
+                c.name = item.name.substr(dot == std::string::npos ? 0 : dot + 1);
+                result.columns.push_back(c);
+                plan.emplace_back(select_item::column, index);
+            }
+            else if (item.kind == select_item::count) {
+                fake_column c;
+                c.name = item.name;
+                c.integer = true;
+                result.columns.push_back(c);
+                plan.emplace_back(select_item::count, 0);
+                aggregate = true;
+            }
+            else parse_error(item.name);
+        }
+        if (describe_only) return result;
+
+        auto conditions = parse_where(t);
+        std::vector<fake_row const *> selected;
+        for (auto i : candidates(t, conditions)) selected.push_back(&t.rows[i]);
+
+        if (accept_keyword("ORDER")) {
+            expect_keyword("BY");
+            auto index = column_index(t, parse_name());
+            auto descending = accept_keyword("DESC");
+            if (not descending) accept_keyword("ASC");
+            auto&& column = t.columns[index];
+            std::stable_sort(selected.begin(), selected.end(), [&](auto l, auto r) {
+                auto cmp = compare(column, (*l)[index], (*r)[index]);
+                return descending ? cmp > 0 : cmp < 0;
+            });
+        }
+        if (accept_keyword("LIMIT")) {
+            auto limit = parse_row_count();
+            std::size_t offset = 0;
+            if (accept_symbol(",")) {
+                offset = limit;
+                limit = parse_row_count();
+            }
+            else if (accept_keyword("OFFSET")) {
+                offset = parse_row_count();
+            }
+            offset = std::min(offset, selected.size());
+            selected.erase(selected.begin(), selected.begin() + offset);
+            if (selected.size() > limit) selected.resize(limit);
+        }
+        expect_end();
+
+        if (aggregate) {
+            fake_row row;
+            for (auto&& step : plan) {
+                if (step.first == select_item::count) row.push_back(std::to_string(selected.size()));
+                else row.push_back(selected.empty() ? fake_value() : (*selected.front())[step.second]);
+            }
+            result.rows.push_back(std::move(row));
+        }
+        else {
+            result.rows.reserve(selected.size());
+            for (auto source : selected) {
+                fake_row row;
+                row.reserve(plan.size());
+                for (auto&& step : plan) row.push_back((*source)[step.second]);
+                result.rows.push_back(std::move(row));
+            }
+        }
+        return result;
+    }
+
+    void expect_end()
+    {
+        if (not at_end()) parse_error(peek().text);
+    }
+
+    std::uint64_t insert_row(table& t, std::vector<std::size_t> const& indices, fake_row values, bool replace)
+    {
+        if (values.size() != indices.size())
+            throw fake_sql_error(1136, "21S01", "Column count doesn't match value count");
+        fake_row row(t.columns.size());
+        std::vector<bool> assigned(t.columns.size(), false);
+        for (std::size_t i = 0; i < indices.size(); ++i) {
+            row[indices[i]] = std::move(values[i]);
+            assigned[indices[i]] = true;
+        }
+        std::uint64_t generated = 0;
+        for (std::size_t i = 0; i < t.columns.size(); ++i) {
+            auto&& column = t.columns[i];
+            if (column.auto_increment) {
+                if (not row[i] or *row[i] == "0") {
+                    generated = std::uint64_t(t.next_id);
+                    row[i] = std::to_string(t.next_id++);
+                }
+                else t.next_id = std::max(t.next_id, to_integer(*row[i]) + 1);
+            }
+            else if (not assigned[i]) row[i] = column.default_value;
+        }
+        auto key = key_of(t, row);
+        if (key) {
+            auto existing = t.by_key.find(*key);
+            if (existing != t.by_key.end()) {
+                if (not replace)
+                    throw fake_sql_error(1062, "23000", "Duplicate entry for key 'PRIMARY'");
+                t.rows[existing->second] = std::move(row);
+                return generated;
+            }
+            t.by_key.emplace(std::move(*key), t.rows.size());
+        }
+        t.rows.push_back(std::move(row));
+        return generated;
+    }
+
+    fake_result insert(bool replace)
+    {
+        auto ignore = accept_keyword("IGNORE");
+        accept_keyword("INTO");
+        auto& t = writable(parse_name());
+        std::vector<std::size_t> indices;
+        if (accept_symbol("(")) {
+            do indices.push_back(column_index(t, parse_name())); while (accept_symbol(","));
+            expect_symbol(")");
+        }
+        else {
+            for (std::size_t i = 0; i < t.columns.size(); ++i) indices.push_back(i);
+        }
+        if (accept_keyword("SELECT")) return insert_select(t, indices, replace, ignore);
+        if (not accept_keyword("VALUES")) expect_keyword("VALUE");
+
+        fake_result result;
+        do {
+            expect_symbol("(");
+            fake_row values;
+            do values.push_back(parse_value()); while (accept_symbol(","));
+            expect_symbol(")");
+            std::uint64_t id = 0;
+            try {
+                id = insert_row(t, indices, std::move(values), replace);
+            }
+            catch (fake_sql_error const& e) {
+                if (not ignore or e.code != 1062) throw;
+                continue;
+            }
+            if (id and not result.last_insert_id) result.last_insert_id = id;
+            ++result.affected_rows;
+        } while (accept_symbol(","));
+        expect_end();
+        return result;
+    }
+
+    /// INSERT ... SELECT with a select list of values, columns of the source and functions of them
+    fake_result insert_select(table& t, std::vector<std::size_t> const& indices, bool replace, bool ignore)
+    {
+        auto list = pos;
+        int depth = 0;
+        while (not at_end() and not (depth == 0 and is_keyword("FROM"))) {
+            if (is_symbol("(")) ++depth;
+            if (is_symbol(")")) --depth;
+            ++pos;
+        }
+        expect_keyword("FROM");
+        auto& source = find_table(parse_name());
+        if (&source == &t)
+            throw fake_sql_error(1093, "HY000", "Table is specified twice, both as a target for 'INSERT' and as a"
+                                                " separate source for data");
+        auto conditions = parse_where(source);
+        expect_end();
+        auto end = pos;
+
+        fake_result result;
+        for (auto&& row : source.rows) {
+            if (not matches(source, row, conditions)) continue;
+            source_table = &source;
+            source_row = &row;
+            pos = list;
+            fake_row values;
+            do values.push_back(parse_value()); while (accept_symbol(","));
+            source_row = nullptr;
+            std::uint64_t id = 0;
+            try {
+                id = insert_row(t, indices, std::move(values), replace);
+            }
+            catch (fake_sql_error const& e) {
+                if (not ignore or e.code != 1062) throw;
+                continue;
+            }
+            if (id and not result.last_insert_id) result.last_insert_id = id;
+            ++result.affected_rows;
+        }
+        pos = end;
+        return result;
+    }
+
+    fake_column parse_column_definition()
+    {
+        fake_column column;
+        column.name = parse_name();
+        auto type = next().text;
+        column.integer = is_integer_type(type);
+        column.binary = is_binary_type(type);
+        int depth = 0;
+        while (not at_end()) {
+            if (depth == 0 and (is_symbol(",") or is_symbol(")"))) break;
+            if (accept_symbol("(")) { ++depth; continue; }
+            if (accept_symbol(")")) { --depth; continue; }
+            if (accept_keyword("AUTO_INCREMENT")) column.auto_increment = true;
+            else if (accept_keyword("DEFAULT")) column.default_value = parse_value();
+            else ++pos;
+        }
+        return column;
+    }
+
+    void skip_definition()
+    {
+        int depth = 0;
+        while (not at_end()) {
+            if (depth == 0 and (is_symbol(",") or is_symbol(")"))) break;
+            if (is_symbol("(")) ++depth;
+            if (is_symbol(")")) --depth;
+            ++pos;
+        }
+    }
+
+    fake_result create()
+    {
+        if (accept_keyword("UNIQUE") or accept_keyword("INDEX")) {
+            // secondary indexes are not modelled
+            return fake_result();
+        }
+        expect_keyword("TABLE");
+        bool if_not_exists = false;
+        if (accept_keyword("IF")) {
+            expect_keyword("NOT");
+            expect_keyword("EXISTS");
+            if_not_exists = true;
+        }
+        auto name = parse_name();
+        table t;
+        std::vector<std::string> primary_key;
+        expect_symbol("(");
+        do {
+            if (accept_keyword("PRIMARY")) {
+                expect_keyword("KEY");
+                expect_symbol("(");
+                do primary_key.push_back(parse_name()); while (accept_symbol(","));
+                expect_symbol(")");
+                skip_definition();
+            }
+            else if (is_keyword("UNIQUE") or is_keyword("INDEX") or is_keyword("KEY")
+                     or is_keyword("CONSTRAINT") or is_keyword("FOREIGN") or is_keyword("FULLTEXT")) {
+                skip_definition();
+            }
+            else {
+                auto start = pos;
+                auto column = parse_column_definition();
+                for (auto i = start; i + 1 < pos; ++i)
+                    if (iequals(tokens[i].text, "PRIMARY") and iequals(tokens[i + 1].text, "KEY"))
+                        primary_key.push_back(column.name);
+                t.columns.push_back(std::move(column));
+            }
+        } while (accept_symbol(","));
+        expect_symbol(")");
+        for (auto&& key : primary_key)
+            t.primary_key.push_back(column_index(t, key));
+
+        if (db.tables_.count(name)) {
+            if (if_not_exists) return fake_result();
+            throw fake_sql_error(1050, "42S01", "Table '" + name + "' already exists");
+        }
+        db.tables_.emplace(name, std::move(t));
+        return fake_result();
+    }
+
+    fake_result drop()
+    {
+        expect_keyword("TABLE");
+        bool if_exists = false;
+        if (accept_keyword("IF")) {
+            expect_keyword("EXISTS");
+            if_exists = true;
+        }
+        do {
+            auto name = parse_name();
+            if (not db.tables_.erase(name) and not if_exists)
+                throw fake_sql_error(1051, "42S02", "Unknown table '" + name + "'");
+        } while (accept_symbol(","));
+        return fake_result();
+    }
+
+    /// RENAME TABLE a TO b, c TO d: each pair in turn, all or nothing
+    fake_result rename()
+    {
+        expect_keyword("TABLE");
+        std::vector<std::pair<std::string, std::string>> renames;
+        do {
+            auto from = parse_name();
+            expect_keyword("TO");
+            renames.emplace_back(from, parse_name());
+        } while (accept_symbol(","));
+        expect_end();
+
+        std::set<std::string> names;
+        for (auto&& entry : db.tables_) names.insert(entry.first);
+        for (auto&& r : renames) {
+            if (not names.erase(r.first))
+                throw fake_sql_error(1146, "42S02", "Table '" + r.first + "' doesn't exist");
+            if (not names.insert(r.second).second)
+                throw fake_sql_error(1050, "42S01", "Table '" + r.second + "' already exists");
+        }
+        for (auto&& r : renames) {
+            auto t = std::move(db.tables_.at(r.first));
+            db.tables_.erase(r.first);
+            db.tables_.emplace(r.second, std::move(t));
+        }
+        return fake_result();
+    }
+
+    fake_result alter()
+    {
+        expect_keyword("TABLE");
+        auto& t = find_table(parse_name());
+        do {
+            if (accept_keyword("ADD")) {
+                if (is_keyword("INDEX") or is_keyword("UNIQUE") or is_keyword("KEY")
+                    or is_keyword("CONSTRAINT") or is_keyword("PRIMARY")) {
+                    skip_definition();
+                    continue;
+                }
+                accept_keyword("COLUMN");
+                auto column = parse_column_definition();
+                for (auto&& row : t.rows) row.push_back(column.default_value);
+                t.columns.push_back(std::move(column));
+            }
+            else if (accept_keyword("DROP")) {
+                accept_keyword("COLUMN");
+                auto index = column_index(t, parse_name());
+                t.columns.erase(t.columns.begin() + index);
+                for (auto&& row : t.rows) row.erase(row.begin() + index);
+                t.primary_key.erase(std::remove(t.primary_key.begin(), t.primary_key.end(), index),
+                                    t.primary_key.end());
+                for (auto&& k : t.primary_key) if (k > index) --k;
+                reindex(t);
+            }
+            else skip_definition();
+        } while (accept_symbol(","));
+        return fake_result();
+    }
+
+    fake_result update()
+    {
+        auto& t = writable(parse_name());
+        expect_keyword("SET");
+        std::vector<std::pair<std::size_t, fake_value>> assignments;
+        do {
+            auto index = column_index(t, parse_name());
+            expect_symbol("=");
+            assignments.emplace_back(index, parse_value());
+        } while (accept_symbol(","));
+        auto conditions = parse_where(t);
+        expect_end();
+        fake_result result;
+        for (auto i : candidates(t, conditions)) {
+            for (auto&& a : assignments) t.rows[i][a.first] = a.second;
+            ++result.affected_rows;
+        }
+        auto sets_key = std::any_of(assignments.begin(), assignments.end(), [&](auto&& a) {
+            return std::find(t.primary_key.begin(), t.primary_key.end(), a.first) != t.primary_key.end();
+        });
+        if (sets_key and result.affected_rows) reindex(t);
+        return result;
+    }
+
+    fake_result erase()
+    {
+        expect_keyword("FROM");
+        auto& t = writable(parse_name());
+        auto conditions = parse_where(t);
+        expect_end();
+        auto before = t.rows.size();
+        auto doomed = candidates(t, conditions);
+        auto next = doomed.begin();
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < t.rows.size(); ++i) {
+            if (next != doomed.end() and *next == i) { ++next; continue; }
+            if (kept != i) t.rows[kept] = std::move(t.rows[i]);
+            ++kept;
+        }
+        t.rows.resize(kept);
+        fake_result result;
+        result.affected_rows = before - t.rows.size();
+        if (result.affected_rows) reindex(t);
+        return result;
+    }
+
+    char single_char()
+    {
+        auto s = string_literal();
+        if (s.size() != 1) throw fake_sql_error(1235, "42000", "multi-character terminators are not supported");
+        return s[0];
+    }
+
+    fake_result load_data()
+    {
+        expect_keyword("DATA");
+        expect_keyword("LOCAL");
+        expect_keyword("INFILE");
+        fake_load_request request;
+        request.file_name = string_literal();
+        expect_keyword("INTO");
+        expect_keyword("TABLE");
+        request.table = parse_name();
+        auto& t = find_table(request.table);
+        if (accept_keyword("CHARACTER")) {
+            expect_keyword("SET");
+            next();
+        }
+        if (accept_keyword("FIELDS") or accept_keyword("COLUMNS")) {
+            while (true) {
+                if (accept_keyword("TERMINATED")) { expect_keyword("BY"); request.field_terminator = single_char(); }
+                else if (accept_keyword("ESCAPED")) { expect_keyword("BY"); request.escape = single_char(); }
+                else break;
+            }
+        }
+        if (accept_keyword("LINES")) {
+            expect_keyword("TERMINATED");
+            expect_keyword("BY");
+            request.line_terminator = single_char();
+        }
+        if (accept_symbol("(")) {
+            do request.columns.push_back(parse_name()); while (accept_symbol(","));
+            expect_symbol(")");
+        }
+        else {
+            for (auto&& column : t.columns) request.columns.push_back(column.name);
+        }
+        expect_end();
+        fake_result result;
+        result.load_request = std::move(request);
+        return result;
+    }
+
+    fake_result load(fake_load_request const& request, std::string const& data)
+    {
+        auto& t = writable(request.table);
+        std::vector<std::size_t> indices;
+        for (auto&& name : request.columns) indices.push_back(column_index(t, name));
+
+        fake_result result;
+        fake_row values;
+        std::string field;
+        bool escaped_null = false;
+        auto finish_field = [&] {
+            if (escaped_null) values.push_back(boost::none);
+            else values.push_back(field);
+            field.clear();
+            escaped_null = false;
+        };
+        auto finish_row = [&] {
+            finish_field();
+            auto id = insert_row(t, indices, std::move(values), false);
+            if (id and not result.last_insert_id) result.last_insert_id = id;
+            ++result.affected_rows;
+            values.clear();
+        };
+        for (std::size_t i = 0; i < data.size(); ++i) {
+            auto c = data[i];
+            if (c == request.escape and i + 1 < data.size()) {
+                auto e = data[++i];
+                if (e == 'N' and field.empty()) escaped_null = true;
+                else field.push_back(unescape(e));
+            }
+            else if (c == request.field_terminator) {
+                finish_field();
+            }
+            else if (c == request.line_terminator) {
+                finish_row();
+            }
+            else field.push_back(c);
+        }
+
+        // the last line need not be terminated
+        if (not values.empty() or not field.empty() or escaped_null)
+            finish_row();
+        return result;
+    }
+
+    fake_database& db;
+    fake_session& session;
+    std::vector<fake_token> tokens;
+    std::size_t pos = 0;
+
+    // the row an INSERT ... SELECT is evaluating, whose columns parse_value() resolves
+    table const *source_table = nullptr;
+    fake_row const *source_row = nullptr;
+
+    // set by describe(), whose parameters are placeholders rather than the values a LIMIT needs
+    bool describing = false;
+};
+
+std::vector<fake_statement> fake_database::parse(std::string const& sql)
+{
+    std::vector<fake_statement> result;
+    fake_statement current;
+    for (auto&& token : lex(sql)) {
+        if (token.kind == fake_token::symbol and token.text == ";") {
+            if (not current.tokens.empty()) result.push_back(std::move(current));
+            current = fake_statement();
+            continue;
+        }
+        if (token.kind == fake_token::placeholder) ++current.param_count;
+        current.tokens.push_back(std::move(token));
+    }
+    if (not current.tokens.empty()) result.push_back(std::move(current));
+    return result;
+}
+
+fake_result fake_database::execute(fake_statement const& statement,
+                                   std::vector<fake_value> const& params,
+                                   fake_session& session)
+{
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    fake_executor executor(*this, statement, params, session);
+    auto result = executor.run();
+    if (result.last_insert_id)
+        session.last_insert_id = result.last_insert_id;
+    return result;
+}
+
+std::vector<fake_column> fake_database::describe(fake_statement const& statement, fake_session const& session)
+{
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    auto params = std::vector<fake_value>(statement.param_count, fake_value(std::string()));
+    auto scratch = session;
+    fake_executor executor(*this, statement, params, scratch);
+    executor.describing = true;
+    if (not executor.accept_keyword("SELECT"))
+        return {};
+    return executor.select(true).columns;
+}
+
+fake_result fake_database::load(fake_load_request const& request, std::string const& data, fake_session& session)
+{
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    fake_executor executor(*this, fake_statement(), {}, session);
+    auto result = executor.load(request, data);
+    if (result.last_insert_id)
+        session.last_insert_id = result.last_insert_id;
+    return result;
+}
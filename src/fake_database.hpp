@@ -0,0 +1,141 @@
+//
+// Created by Richard Hodges on 28/04/2017.
+//
+
+#pragma once
+
+#include <boost/optional.hpp>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// The in-memory SQL engine behind fake_mysql_server.
+/// It understands just enough SQL to run this project's queries:
+/// CREATE/DROP/ALTER/RENAME TABLE, INSERT/REPLACE (of values or ... SELECT), SELECT with simple WHERE/ORDER BY/LIMIT, UPDATE, DELETE,
+/// LOAD DATA LOCAL INFILE, information_schema.COLUMNS, LAST_INSERT_ID() and DATABASE().
+/// Transactions and savepoints are undone by restoring each table a session wrote, which fails if another
+/// session has written the table since. Schema changes commit the open transaction, as in MySQL.
+
+using fake_value = boost::optional<std::string>;
+using fake_row = std::vector<fake_value>;
+
+struct fake_sql_error
+    : std::runtime_error
+{
+    fake_sql_error(int code, std::string sql_state, std::string const& message)
+        : std::runtime_error(message)
+        , code(code)
+        , sql_state(std::move(sql_state))
+    {}
+
+    int code;
+    std::string sql_state;
+};
+
+struct fake_column
+{
+    std::string name;
+    bool integer = false;
+    bool binary = false;
+    bool auto_increment = false;
+    fake_value default_value;
+};
+
+struct fake_token
+{
+    enum kind_type { identifier, quoted_identifier, string, number, symbol, placeholder, null_value };
+
+    kind_type kind;
+    std::string text;
+};
+
+/// A lexed statement. Placeholders ('?') are replaced by bound values at execution time.
+struct fake_statement
+{
+    std::vector<fake_token> tokens;
+    std::size_t param_count = 0;
+};
+
+struct fake_load_request
+{
+    std::string file_name;
+    std::string table;
+    std::vector<std::string> columns;
+    char field_terminator = '\t';
+    char escape = '\\';
+    char line_terminator = '\n';
+};
+
+struct fake_result
+{
+    bool has_rows = false;
+    std::vector<fake_column> columns;
+    std::vector<fake_row> rows;
+    std::uint64_t affected_rows = 0;
+    std::uint64_t last_insert_id = 0;
+    boost::optional<fake_load_request> load_request;
+};
+
+struct fake_session;
+
+struct fake_database
+{
+    /// Split a (possibly multi-statement) query into statements
+    static std::vector<fake_statement> parse(std::string const& sql);
+
+    fake_result execute(fake_statement const& statement,
+                        std::vector<fake_value> const& params,
+                        fake_session& session);
+
+    /// The columns a statement would return, for COM_STMT_PREPARE. Empty for statements without a result set.
+    std::vector<fake_column> describe(fake_statement const& statement, fake_session const& session);
+
+    /// Complete a LOAD DATA LOCAL INFILE with the file contents sent by the client
+    fake_result load(fake_load_request const& request, std::string const& data, fake_session& session);
+
+    struct table
+    {
+        std::vector<fake_column> columns;
+        std::vector<fake_row> rows;
+        std::vector<std::size_t> primary_key;
+        std::int64_t next_id = 1;
+
+        /// Row position by primary key, so that inserts and key lookups do not scan the table
+        std::unordered_map<std::string, std::size_t> by_key;
+
+        /// Bumped by every write, so that a rollback can tell whether another session has written the table
+        std::uint64_t version = 0;
+    };
+
+private:
+    friend struct fake_executor;
+
+    std::mutex mutex_;
+    std::map<std::string, table> tables_;
+};
+
+struct fake_session
+{
+    std::string database;
+    std::uint64_t last_insert_id = 0;
+
+    /// From START TRANSACTION or BEGIN until COMMIT, ROLLBACK or a schema change
+    bool in_transaction = false;
+
+    /// A table as it was before this session's first write since the transaction or savepoint began, and the
+    /// table's version after the session's latest write
+    struct saved_table
+    {
+        fake_database::table before;
+        std::uint64_t version;
+    };
+
+    using undo_log = std::map<std::string, saved_table>;
+
+    undo_log transaction;
+    std::vector<std::pair<std::string, undo_log>> savepoints;
+};
@@ -0,0 +1,743 @@
+//
+// Created by Richard Hodges on 28/04/2017.
+//
+
+#include "fake_mysql_server.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+namespace {
+
+    namespace capability {
+        constexpr std::uint32_t long_password = 0x1;
+        constexpr std::uint32_t found_rows = 0x2;
+        constexpr std::uint32_t long_flag = 0x4;
+        constexpr std::uint32_t connect_with_db = 0x8;
+        constexpr std::uint32_t local_files = 0x80;
+        constexpr std::uint32_t protocol_41 = 0x200;
+        constexpr std::uint32_t transactions = 0x2000;
+        constexpr std::uint32_t secure_connection = 0x8000;
+        constexpr std::uint32_t multi_statements = 0x10000;
+        constexpr std::uint32_t multi_results = 0x20000;
+        constexpr std::uint32_t ps_multi_results = 0x40000;
+        constexpr std::uint32_t plugin_auth = 0x80000;
+        constexpr std::uint32_t plugin_auth_lenenc = 0x200000;
+
+        constexpr std::uint32_t server = long_password | found_rows | long_flag | connect_with_db | local_files
+                                         | protocol_41 | transactions | secure_connection | multi_statements
+                                         | multi_results | ps_multi_results | plugin_auth;
+    }
+
+    constexpr std::uint16_t status_in_transaction = 0x0001;
+    constexpr std::uint16_t status_autocommit = 0x0002;
+    constexpr std::uint16_t status_more_results = 0x0008;
+
+    constexpr std::uint8_t type_longlong = 0x08;
+    constexpr std::uint8_t type_blob = 0xfc;
+    constexpr std::uint8_t type_var_string = 0xfd;
+
+    constexpr std::uint8_t com_quit = 0x01;
+    constexpr std::uint8_t com_init_db = 0x02;
+    constexpr std::uint8_t com_query = 0x03;
+    constexpr std::uint8_t com_ping = 0x0e;
+    constexpr std::uint8_t com_stmt_prepare = 0x16;
+    constexpr std::uint8_t com_stmt_execute = 0x17;
+    constexpr std::uint8_t com_stmt_send_long_data = 0x18;
+    constexpr std::uint8_t com_stmt_close = 0x19;
+    constexpr std::uint8_t com_stmt_reset = 0x1a;
+    constexpr std::uint8_t com_set_option = 0x1b;
+
+    constexpr std::size_t max_packet_payload = 0xffffff;
+
+    void put_int(std::string& out, std::uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i)
+            out.push_back(char((value >> (8 * i)) & 0xff));
+    }
+
+    void put_lenenc_int(std::string& out, std::uint64_t value)
+    {
+        if (value < 251) put_int(out, value, 1);
+        else if (value < (1 << 16)) { out.push_back(char(0xfc)); put_int(out, value, 2); }
+        else if (value < (1 << 24)) { out.push_back(char(0xfd)); put_int(out, value, 3); }
+        else { out.push_back(char(0xfe)); put_int(out, value, 8); }
+    }
+
+    void put_lenenc_str(std::string& out, std::string const& s)
+    {
+        put_lenenc_int(out, s.size());
+        out += s;
+    }
+
+    /// Reads little endian protocol fields from a received payload
+    struct packet_reader
+    {
+        packet_reader(std::string const& payload) : data(payload) {}
+
+        bool at_end() const { return pos >= data.size(); }
+
+        void require(std::size_t n) const
+        {
+            if (pos + n > data.size())
+                throw fake_sql_error(1835, "HY000", "Malformed communication packet");
+        }
+
+        std::uint64_t get_int(int bytes)
+        {
+            require(bytes);
+            std::uint64_t value = 0;
+            for (int i = 0; i < bytes; ++i)
+                value |= std::uint64_t(std::uint8_t(data[pos++])) << (8 * i);
+            return value;
+        }
+
+        std::uint64_t get_lenenc_int()
+        {
+            auto first = get_int(1);
+            switch (first) {
+                case 0xfc: return get_int(2);
+                case 0xfd: return get_int(3);
+                case 0xfe: return get_int(8);
+                default: return first;
+            }
+        }
+
+        std::string get_bytes(std::size_t n)
+        {
+            require(n);
+            auto result = data.substr(pos, n);
+            pos += n;
+            return result;
+        }
+
+        std::string get_lenenc_str() { return get_bytes(get_lenenc_int()); }
+
+        std::string get_null_str()
+        {
+            auto end = data.find('\0', pos);
+            if (end == std::string::npos) end = data.size();
+            auto result = data.substr(pos, end - pos);
+            pos = std::min(end + 1, data.size());
+            return result;
+        }
+
+        std::string rest()
+        {
+            auto result = data.substr(std::min(pos, data.size()));
+            pos = data.size();
+            return result;
+        }
+
+        void skip(std::size_t n) { require(n); pos += n; }
+
+        std::string const& data;
+        std::size_t pos = 0;
+    };
+
+    std::uint8_t wire_type(fake_column const& column)
+    {
+        if (column.integer) return type_longlong;
+        if (column.binary) return type_blob;
+        return type_var_string;
+    }
+
+    /// Binary protocol parameter value as text
+    fake_value read_binary_param(packet_reader& reader, std::uint16_t type)
+    {
+        auto is_unsigned = (type & 0x8000) != 0;
+        auto signed_value = [&](int bytes) -> std::string {
+            auto raw = reader.get_int(bytes);
+            if (is_unsigned) return std::to_string(raw);
+            auto shift = 64 - 8 * bytes;
+            return std::to_string(std::int64_t(raw << shift) >> shift);
+        };
+        switch (type & 0xff) {
+            case 0x01: return signed_value(1);
+            case 0x02: case 0x0d: return signed_value(2);
+            case 0x03: case 0x09: return signed_value(4);
+            case 0x08: return signed_value(8);
+            case 0x04: {
+                auto raw = std::uint32_t(reader.get_int(4));
+                float f;
+                std::memcpy(&f, &raw, sizeof(f));
+                return std::to_string(f);
+            }
+            case 0x05: {
+                auto raw = reader.get_int(8);
+                double d;
+                std::memcpy(&d, &raw, sizeof(d));
+                return std::to_string(d);
+            }
+            case 0x06: return boost::none;
+            case 0x07: case 0x0a: case 0x0b: case 0x0c: {
+                auto len = reader.get_int(1);
+                auto bytes = reader.get_bytes(len);
+                auto raw = packet_reader(bytes);
+                char buf[64] = "0000-00-00 00:00:00";
+                if (len >= 4) {
+                    auto year = raw.get_int(2), month = raw.get_int(1), day = raw.get_int(1);
+                    std::uint64_t hour = 0, minute = 0, second = 0;
+                    if (len >= 7) { hour = raw.get_int(1); minute = raw.get_int(1); second = raw.get_int(1); }
+                    std::snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u",
+                                  unsigned(year), unsigned(month), unsigned(day),
+                                  unsigned(hour), unsigned(minute), unsigned(second));
+                }
+                return std::string(buf);
+            }
+            default:
+                return reader.get_lenenc_str();
+        }
+    }
+}
+
+struct fake_mysql_server::session
+    : std::enable_shared_from_this<session>
+{
+    using socket_type = amytest::asio::ip::tcp::socket;
+    using timer_type = amytest::asio::steady_timer;
+    using continuation = std::function<void()>;
+
+    struct prepared
+    {
+        fake_statement statement;
+        std::vector<fake_column> columns;
+        std::vector<std::uint16_t> param_types;
+        std::map<std::size_t, std::string> long_data;
+    };
+
+    session(amytest::asio::io_service& owner, socket_type socket, fake_server_options const& options,
+            std::shared_ptr<fake_database> database, std::uint32_t connection_id)
+        : socket_(std::move(socket))
+        , timer_(owner)
+        , options_(options)
+        , database_(std::move(database))
+        , connection_id_(connection_id)
+    {
+        state_.database = options_.default_database;
+    }
+
+    void start()
+    {
+        write_handshake();
+        send([self = shared_from_this()] { self->read_packet([self] { self->handle_handshake_response(); }); });
+    }
+
+    // -- transport
+
+    std::chrono::microseconds transfer_delay(std::size_t bytes) const
+    {
+        auto delay = options_.latency;
+        if (options_.bytes_per_second)
+            delay += std::chrono::microseconds(bytes * 1000000 / options_.bytes_per_second);
+        return delay;
+    }
+
+    void after(std::chrono::microseconds delay, continuation next)
+    {
+        if (delay.count() == 0)
+            return next();
+        timer_.expires_from_now(delay);
+        timer_.async_wait([self = shared_from_this(), next = std::move(next)](auto const& ec) {
+            if (not ec) next();
+        });
+    }
+
+    void write_packet(std::string const& payload)
+    {
+        std::size_t offset = 0;
+        do {
+            auto len = std::min(max_packet_payload, payload.size() - offset);
+            put_int(out_, len, 3);
+            put_int(out_, seq_++, 1);
+            out_.append(payload, offset, len);
+            offset += len;
+            if (len < max_packet_payload) break;
+        } while (true);
+    }
+
+    void send(continuation next)
+    {
+        auto buffer = std::make_shared<std::string>();
+        buffer->swap(out_);
+        after(transfer_delay(buffer->size()), [self = shared_from_this(), buffer, next = std::move(next)] {
+            amytest::asio::async_write(self->socket_, amytest::asio::buffer(*buffer),
+                                       [self, buffer, next](auto const& ec, std::size_t) {
+                                           if (not ec) next();
+                                       });
+        });
+    }
+
+    /// Read one logical packet (reassembling 16M continuations) into in_, then call next after the inbound delay
+    void read_packet(continuation next)
+    {
+        in_.clear();
+        read_fragment(std::move(next));
+    }
+
+    void read_fragment(continuation next)
+    {
+        amytest::asio::async_read(socket_, amytest::asio::buffer(header_),
+                                  [self = shared_from_this(), next = std::move(next)](auto const& ec, std::size_t) mutable {
+                                      if (ec) return;
+                                      auto len = std::size_t(self->header_[0])
+                                                 | std::size_t(self->header_[1]) << 8
+                                                 | std::size_t(self->header_[2]) << 16;
+                                      self->seq_ = std::uint8_t(self->header_[3] + 1);
+                                      auto start = self->in_.size();
+                                      self->in_.resize(start + len);
+                                      amytest::asio::async_read(self->socket_,
+                                                                amytest::asio::buffer(&self->in_[start], len),
+                                                                [self, len, next = std::move(next)](auto const& ec, std::size_t) mutable {
+                                                                    if (ec) return;
+                                                                    if (len == max_packet_payload)
+                                                                        return self->read_fragment(std::move(next));
+                                                                    self->after(self->transfer_delay(self->in_.size() + 4), std::move(next));
+                                                                });
+                                  });
+    }
+
+    void read_command()
+    {
+        read_packet([self = shared_from_this()] { self->handle_command(); });
+    }
+
+    // -- generic responses
+
+    void write_ok(std::uint64_t affected_rows = 0, std::uint64_t last_insert_id = 0, bool more = false)
+    {
+        std::string p;
+        p.push_back(0x00);
+        put_lenenc_int(p, affected_rows);
+        put_lenenc_int(p, last_insert_id);
+        put_int(p, status(more), 2);
+        put_int(p, 0, 2);
+        write_packet(p);
+    }
+
+    void write_eof(bool more = false)
+    {
+        std::string p;
+        p.push_back(char(0xfe));
+        put_int(p, 0, 2);
+        put_int(p, status(more), 2);
+        write_packet(p);
+    }
+
+    void write_error(int code, std::string const& sql_state, std::string const& message)
+    {
+        std::string p;
+        p.push_back(char(0xff));
+        put_int(p, code, 2);
+        p.push_back('#');
+        p += sql_state.substr(0, 5);
+        p += message;
+        write_packet(p);
+    }
+
+    void write_error(fake_sql_error const& e)
+    {
+        write_error(e.code, e.sql_state, e.what());
+    }
+
+    /// Anything else thrown while serving a command is a fault in the fake server, reported as ER_UNKNOWN_ERROR
+    void write_error(std::exception const& e)
+    {
+        write_error(1105, "HY000", e.what());
+    }
+
+    std::uint16_t status(bool more) const
+    {
+        return status_autocommit | (state_.in_transaction ? status_in_transaction : 0)
+               | (more ? status_more_results : 0);
+    }
+
+    void write_column_definition(fake_column const& column)
+    {
+        std::string p;
+        put_lenenc_str(p, "def");
+        put_lenenc_str(p, state_.database);
+        put_lenenc_str(p, "");
+        put_lenenc_str(p, "");
+        put_lenenc_str(p, column.name);
+        put_lenenc_str(p, column.name);
+        put_lenenc_int(p, 0x0c);
+        auto type = wire_type(column);
+        put_int(p, type == type_var_string ? 33 : 63, 2);
+        put_int(p, type == type_longlong ? 20 : 0xffffffff, 4);
+        p.push_back(char(type));
+        std::uint16_t flags = 0;
+        if (type == type_longlong) flags |= 0x8000 | 0x80;      // NUM | BINARY
+        if (type == type_blob) flags |= 0x10 | 0x80;            // BLOB | BINARY
+        put_int(p, flags, 2);
+        p.push_back(0);
+        put_int(p, 0, 2);
+        write_packet(p);
+    }
+
+    void write_result(fake_result const& result, bool more, bool binary)
+    {
+        if (not result.has_rows)
+            return write_ok(result.affected_rows, result.last_insert_id, more);
+
+        std::string p;
+        put_lenenc_int(p, result.columns.size());
+        write_packet(p);
+        for (auto&& column : result.columns)
+            write_column_definition(column);
+        write_eof();
+        for (auto&& row : result.rows) {
+            p.clear();
+            if (binary) {
+                p.push_back(0x00);
+                auto bitmap_at = p.size();
+                p.append((row.size() + 7 + 2) / 8, '\0');
+                for (std::size_t i = 0; i < row.size(); ++i) {
+                    if (not row[i]) {
+                        p[bitmap_at + (i + 2) / 8] |= char(1 << ((i + 2) % 8));
+                    }
+                    else if (wire_type(result.columns[i]) == type_longlong) {
+                        put_int(p, std::uint64_t(std::strtoll(row[i]->c_str(), nullptr, 10)), 8);
+                    }
+                    else put_lenenc_str(p, *row[i]);
+                }
+            }
+            else {
+                for (auto&& value : row) {
+                    if (value) put_lenenc_str(p, *value);
+                    else p.push_back(char(0xfb));
+                }
+            }
+            write_packet(p);
+        }
+        write_eof(more);
+    }
+
+    // -- connection phase
+
+    void write_handshake()
+    {
+        std::string p;
+        p.push_back(10);
+        p += "5.7.0-amytest-fake";
+        p.push_back(0);
+        put_int(p, connection_id_, 4);
+        p += "abcdefgh";
+        p.push_back(0);
+        put_int(p, capability::server & 0xffff, 2);
+        p.push_back(33);
+        put_int(p, status_autocommit, 2);
+        put_int(p, capability::server >> 16, 2);
+        p.push_back(21);
+        p.append(10, '\0');
+        p += "ijklmnopqrst";
+        p.push_back(0);
+        p += "mysql_native_password";
+        p.push_back(0);
+        seq_ = 0;
+        write_packet(p);
+    }
+
+    void handle_handshake_response()
+    {
+        try {
+            packet_reader reader(in_);
+            client_capabilities_ = std::uint32_t(reader.get_int(4));
+            reader.skip(4 + 1 + 23);
+            reader.get_null_str();
+            if (client_capabilities_ & capability::plugin_auth_lenenc) reader.get_lenenc_str();
+            else if (client_capabilities_ & capability::secure_connection) reader.get_bytes(reader.get_int(1));
+            else reader.get_null_str();
+            if ((client_capabilities_ & capability::connect_with_db) and not reader.at_end()) {
+                auto db = reader.get_null_str();
+                if (not db.empty()) state_.database = db;
+            }
+            write_ok();
+            send([self = shared_from_this()] { self->read_command(); });
+        }
+        catch (fake_sql_error const& e) {
+            write_error(e);
+            send([] {});
+        }
+        catch (std::exception const& e) {
+            write_error(e);
+            send([] {});
+        }
+    }
+
+    // -- command phase
+
+    void handle_command()
+    {
+        if (in_.empty()) return read_command();
+        auto command = std::uint8_t(in_[0]);
+        auto body = in_.substr(1);
+        try {
+            switch (command) {
+                case com_quit:
+                    socket_.close();
+                    return;
+                case com_init_db:
+                    state_.database = body;
+                    write_ok();
+                    break;
+                case com_ping:
+                    write_ok();
+                    break;
+                case com_set_option:
+                    write_eof();
+                    break;
+                case com_query:
+                    return run_query(body);
+                case com_stmt_prepare:
+                    prepare(body);
+                    break;
+                case com_stmt_execute:
+                    execute(body);
+                    break;
+                case com_stmt_send_long_data: {
+                    packet_reader reader(body);
+                    auto id = std::uint32_t(reader.get_int(4));
+                    auto param = std::size_t(reader.get_int(2));
+                    auto ifind = statements_.find(id);
+                    if (ifind != statements_.end())
+                        ifind->second.long_data[param] += reader.rest();
+                    return read_command();      // no response, even for an unknown statement
+                }
+                case com_stmt_close: {
+                    packet_reader reader(body);
+                    statements_.erase(std::uint32_t(reader.get_int(4)));
+                    return read_command();      // no response
+                }
+                case com_stmt_reset: {
+                    packet_reader reader(body);
+                    find_statement(std::uint32_t(reader.get_int(4)), "mysqld_stmt_reset").long_data.clear();
+                    write_ok();
+                    break;
+                }
+                default:
+                    write_error(1047, "08S01", "Unknown command");
+            }
+        }
+        catch (fake_sql_error const& e) {
+            write_error(e);
+        }
+        catch (std::exception const& e) {
+            write_error(e);
+        }
+        send([self = shared_from_this()] { self->read_command(); });
+    }
+
+    void run_query(std::string const& sql)
+    {
+        try {
+            pending_ = fake_database::parse(sql);
+        }
+        catch (fake_sql_error const& e) {
+            write_error(e);
+            return send([self = shared_from_this()] { self->read_command(); });
+        }
+        catch (std::exception const& e) {
+            write_error(e);
+            return send([self = shared_from_this()] { self->read_command(); });
+        }
+        next_statement_ = 0;
+        if (pending_.empty()) {
+            write_error(1065, "42000", "Query was empty");
+            return send([self = shared_from_this()] { self->read_command(); });
+        }
+        run_statements();
+    }
+
+    void run_statements()
+    {
+        while (next_statement_ < pending_.size()) {
+            auto&& statement = pending_[next_statement_++];
+            auto more = next_statement_ < pending_.size();
+            try {
+                auto result = database_->execute(statement, {}, state_);
+                if (result.load_request) {
+                    load_request_ = std::move(*result.load_request);
+                    load_data_.clear();
+                    std::string p;
+                    p.push_back(char(0xfb));
+                    p += load_request_.file_name;
+                    write_packet(p);
+                    return send([self = shared_from_this()] { self->read_infile(); });
+                }
+                write_result(result, more, false);
+            }
+            catch (fake_sql_error const& e) {
+                write_error(e);
+                break;
+            }
+            catch (std::exception const& e) {
+                write_error(e);
+                break;
+            }
+        }
+        pending_.clear();
+        send([self = shared_from_this()] { self->read_command(); });
+    }
+
+    void read_infile()
+    {
+        read_packet([self = shared_from_this()] {
+            if (not self->in_.empty()) {
+                self->load_data_ += self->in_;
+                return self->read_infile();
+            }
+            auto more = self->next_statement_ < self->pending_.size();
+            try {
+                auto result = self->database_->load(self->load_request_, self->load_data_, self->state_);
+                self->write_ok(result.affected_rows, result.last_insert_id, more);
+            }
+            catch (fake_sql_error const& e) {
+                self->write_error(e);
+                self->pending_.clear();
+                self->next_statement_ = 0;
+            }
+            catch (std::exception const& e) {
+                self->write_error(e);
+                self->pending_.clear();
+                self->next_statement_ = 0;
+            }
+            self->load_data_.clear();
+            self->run_statements();
+        });
+    }
+
+    void prepare(std::string const& sql)
+    {
+        auto statements = fake_database::parse(sql);
+        if (statements.size() != 1)
+            throw fake_sql_error(1064, "42000", "prepared statements must contain exactly one statement");
+        prepared stmt;
+        stmt.statement = std::move(statements.front());
+        stmt.columns = database_->describe(stmt.statement, state_);
+        auto id = next_statement_id_++;
+
+        std::string p;
+        p.push_back(0x00);
+        put_int(p, id, 4);
+        put_int(p, stmt.columns.size(), 2);
+        put_int(p, stmt.statement.param_count, 2);
+        p.push_back(0);
+        put_int(p, 0, 2);
+        write_packet(p);
+        if (stmt.statement.param_count) {
+            fake_column param;
+            param.name = "?";
+            for (std::size_t i = 0; i < stmt.statement.param_count; ++i)
+                write_column_definition(param);
+            write_eof();
+        }
+        if (not stmt.columns.empty()) {
+            for (auto&& column : stmt.columns)
+                write_column_definition(column);
+            write_eof();
+        }
+        statements_.emplace(id, std::move(stmt));
+    }
+
+    prepared& find_statement(std::uint32_t id, const char *command)
+    {
+        auto ifind = statements_.find(id);
+        if (ifind == statements_.end())
+            throw fake_sql_error(1243, "HY000", "Unknown prepared statement handler (" + std::to_string(id)
+                                                + ") given to " + command);
+        return ifind->second;
+    }
+
+    void execute(std::string const& body)
+    {
+        packet_reader reader(body);
+        auto& stmt = find_statement(std::uint32_t(reader.get_int(4)), "mysqld_stmt_execute");
+        reader.skip(1 + 4);     // flags, iteration count
+        auto count = stmt.statement.param_count;
+        std::vector<fake_value> params(count);
+        if (count) {
+            auto null_bitmap = reader.get_bytes((count + 7) / 8);
+            if (reader.get_int(1)) {
+                stmt.param_types.clear();
+                for (std::size_t i = 0; i < count; ++i)
+                    stmt.param_types.push_back(std::uint16_t(reader.get_int(2)));
+            }
+            if (stmt.param_types.size() != count)
+                throw fake_sql_error(1210, "HY000", "Incorrect arguments to mysqld_stmt_execute");
+            for (std::size_t i = 0; i < count; ++i) {
+                auto ilong = stmt.long_data.find(i);
+                if (ilong != stmt.long_data.end()) params[i] = ilong->second;
+                else if (null_bitmap[i / 8] & (1 << (i % 8))) params[i] = boost::none;
+                else params[i] = read_binary_param(reader, stmt.param_types[i]);
+            }
+        }
+        stmt.long_data.clear();
+        auto result = database_->execute(stmt.statement, params, state_);
+        if (result.load_request)
+            throw fake_sql_error(1295, "HY000", "This command is not supported in the prepared statement protocol yet");
+        write_result(result, false, true);
+    }
+
+    socket_type socket_;
+    timer_type timer_;
+    fake_server_options options_;
+    std::shared_ptr<fake_database> database_;
+    std::uint32_t connection_id_;
+    std::uint32_t client_capabilities_ = 0;
+    fake_session state_;
+
+    std::uint8_t header_[4];
+    std::string in_;
+    std::string out_;
+    std::uint8_t seq_ = 0;
+
+    std::vector<fake_statement> pending_;
+    std::size_t next_statement_ = 0;
+    fake_load_request load_request_;
+    std::string load_data_;
+
+    std::map<std::uint32_t, prepared> statements_;
+    std::uint32_t next_statement_id_ = 1;
+};
+
+fake_mysql_server::fake_mysql_server(amytest::asio::io_service& owner,
+                                     amytest::tcp_endpoint const& endpoint,
+                                     fake_server_options options)
+    : owner_(owner)
+    , acceptor_(owner, endpoint)
+    , socket_(owner)
+    , options_(std::move(options))
+    , database_(std::make_shared<fake_database>())
+{
+}
+
+fake_mysql_server::~fake_mysql_server() = default;
+
+void fake_mysql_server::start()
+{
+    accept();
+}
+
+void fake_mysql_server::stop()
+{
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+}
+
+amytest::tcp_endpoint fake_mysql_server::local_endpoint() const
+{
+    return acceptor_.local_endpoint();
+}
+
+void fake_mysql_server::accept()
+{
+    acceptor_.async_accept(socket_, [this](auto const& ec) {
+        if (ec) return;
+        auto s = std::make_shared<session>(owner_, std::move(socket_), options_, database_, next_connection_id_++);
+        s->start();
+        this->accept();
+    });
+}
@@ -0,0 +1,61 @@
+//
+// Created by Richard Hodges on 28/04/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include "fake_database.hpp"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct fake_server_options
+{
+    /// Delay applied to every flight of packets, in each direction
+    std::chrono::microseconds latency { 0 };
+
+    /// Link speed in each direction. 0 means unlimited
+    std::uint64_t bytes_per_second = 0;
+
+    /// Used when the client does not name a database at connect time
+    std::string default_database = "test";
+};
+
+/// A stand-in MySQL server speaking enough of the client/server protocol for this project:
+/// the v10 handshake (any credentials are accepted, no SSL), COM_QUERY with text result sets and
+/// multi-results, LOAD DATA LOCAL INFILE, and COM_STMT_PREPARE/EXECUTE/SEND_LONG_DATA/RESET/CLOSE
+/// with binary result sets. Queries run against a fake_database shared by all connections.
+///
+/// The client library blocks during connect, so run the server's io_service on its own thread
+/// when the client is in the same process.
+struct fake_mysql_server
+{
+    fake_mysql_server(amytest::asio::io_service& owner,
+                      amytest::tcp_endpoint const& endpoint,
+                      fake_server_options options = {});
+
+    ~fake_mysql_server();
+
+    void start();
+
+    void stop();
+
+    /// The bound endpoint. Useful when constructed with port 0
+    amytest::tcp_endpoint local_endpoint() const;
+
+    fake_database& database() { return *database_; }
+
+    struct session;
+
+private:
+    void accept();
+
+    amytest::asio::io_service& owner_;
+    amytest::asio::ip::tcp::acceptor acceptor_;
+    amytest::asio::ip::tcp::socket socket_;
+    fake_server_options options_;
+    std::shared_ptr<fake_database> database_;
+    std::uint32_t next_connection_id_ = 1;
+};
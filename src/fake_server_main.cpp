@@ -0,0 +1,47 @@
+//
+// Created by Richard Hodges on 28/04/2017.
+//
+// Standalone stand-in server. Run several on different ports to simulate a sharded deployment:
+//    amy-fake-server --port 3307 --latency-us 250 --bytes-per-second 12500000
+//
+
+#include "config.hpp"
+#include "fake_mysql_server.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using namespace amytest;
+
+int main(int argc, char **argv)
+{
+    auto port    = 3306;
+    auto options = fake_server_options();
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (std::strcmp(argv[i], "--port") == 0) {
+            port = std::atoi(argv[i + 1]);
+        }
+        else if (std::strcmp(argv[i], "--latency-us") == 0) {
+            options.latency = std::chrono::microseconds(std::atoll(argv[i + 1]));
+        }
+        else if (std::strcmp(argv[i], "--bytes-per-second") == 0) {
+            options.bytes_per_second = std::strtoull(argv[i + 1], nullptr, 10);
+        }
+        else if (std::strcmp(argv[i], "--database") == 0) {
+            options.default_database = argv[i + 1];
+        }
+        else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--port n] [--latency-us n] [--bytes-per-second n] [--database name]" << std::endl;
+            return 1;
+        }
+    }
+
+    asio::io_service ios;
+    fake_mysql_server server(ios, tcp_endpoint(ip_address::from_string("127.0.0.1"), port), options);
+    server.start();
+    std::cout << "fake mysql server listening on " << server.local_endpoint() << std::endl;
+    ios.run();
+}
@@ -0,0 +1,22 @@
+//
+// Created by Richard Hodges on 25/04/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include <amy.hpp>
+#include <cstddef>
+
+/// A view of a field's raw bytes as they sit in the client's row buffer.
+/// Only valid while the result_set that owns the row is alive.
+struct field_bytes
+{
+    field_bytes(amy::field const& f)
+        : data(f.data())
+        , size(f.length())
+    {}
+
+    const char *data;
+    std::size_t size;
+};
@@ -0,0 +1,255 @@
+//
+// Created by Richard Hodges on 08/05/2017.
+//
+
+#include "field_index.hpp"
+#include "storage_plan.hpp"
+#include "hasher.hpp"
+#include "query_builder.hpp"
+#include "typed_rows.hpp"
+#include "metrics.hpp"
+#include "logging.hpp"
+
+#include "proto/limits.pb.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+    using google::protobuf::Descriptor;
+    using google::protobuf::FieldDescriptor;
+    using google::protobuf::FileDescriptor;
+    using google::protobuf::Message;
+    using google::protobuf::Reflection;
+
+    const char insert_index_template[] =
+        "INSERT IGNORE INTO tbl_message_index (field_id, value, unique_id) VALUES (%1%, %2%, %3%), ...";
+    const char select_index_template[] =
+        "SELECT unique_id FROM tbl_message_index WHERE field_id = %1% AND value = %2% ORDER BY unique_id";
+
+    auto field_hash_algorithm() -> proto::storage::HashAlgorithm const&
+    {
+        static auto const algorithm = []
+        {
+            auto result = proto::storage::HashAlgorithm();
+            result.mutable_cryptogenerichash()->set_hashlength(16);
+            return result;
+        }();
+        return algorithm;
+    }
+
+    /// Hashed like a type id, but under a "field:" prefix so that a field path can never share an id with a
+    /// type name. The prefix cannot occur in a protobuf name.
+    std::uint32_t field_id_for(std::string const& field_name)
+    {
+        auto text = "field:" + field_name;
+        std::vector<std::uint8_t> digest;
+        hash(digest, std::begin(text), std::end(text), field_hash_algorithm());
+        return std::uint32_t(digest[0]) << 24 | std::uint32_t(digest[1]) << 16
+               | std::uint32_t(digest[2]) << 8 | std::uint32_t(digest[3]);
+    }
+
+    bool indexable(FieldDescriptor const *field)
+    {
+        switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_FLOAT:
+            case FieldDescriptor::CPPTYPE_DOUBLE:
+            case FieldDescriptor::CPPTYPE_MESSAGE:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    void collect_fields(Descriptor const *root,
+                        Descriptor const *descriptor,
+                        std::string const& prefix,
+                        std::vector<FieldDescriptor const *>& chain,
+                        std::vector<Descriptor const *>& visiting,
+                        std::vector<indexed_field>& result)
+    {
+        for (int i = 0; i < descriptor->field_count(); ++i) {
+            auto field = descriptor->field(i);
+            auto path = prefix.empty() ? field->name() : prefix + "." + field->name();
+            chain.push_back(field);
+
+            if (field->options().GetExtension(limits::index)) {
+                if (not indexable(field))
+                    throw std::invalid_argument("field " + field->full_name() + " cannot be indexed");
+                result.push_back({ path, chain, field_id_for(root->full_name() + "." + path) });
+            }
+
+            // follow singular sub-messages, but not round a recursive type
+            if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE and not field->is_repeated()) {
+                auto child = field->message_type();
+                if (std::find(visiting.begin(), visiting.end(), child) == visiting.end()) {
+                    visiting.push_back(child);
+                    collect_fields(root, child, path, chain, visiting, result);
+                    visiting.pop_back();
+                }
+            }
+
+            chain.pop_back();
+        }
+    }
+
+    std::string value_text(Reflection const *reflection, Message const& message, FieldDescriptor const *field,
+                           int index)
+    {
+        auto repeated = index >= 0;
+        switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_STRING:
+                return repeated ? reflection->GetRepeatedString(message, field, index)
+                                : reflection->GetString(message, field);
+            case FieldDescriptor::CPPTYPE_INT32:
+                return std::to_string(repeated ? reflection->GetRepeatedInt32(message, field, index)
+                                               : reflection->GetInt32(message, field));
+            case FieldDescriptor::CPPTYPE_INT64:
+                return std::to_string(repeated ? reflection->GetRepeatedInt64(message, field, index)
+                                               : reflection->GetInt64(message, field));
+            case FieldDescriptor::CPPTYPE_UINT32:
+                return std::to_string(repeated ? reflection->GetRepeatedUInt32(message, field, index)
+                                               : reflection->GetUInt32(message, field));
+            case FieldDescriptor::CPPTYPE_UINT64:
+                return std::to_string(repeated ? reflection->GetRepeatedUInt64(message, field, index)
+                                               : reflection->GetUInt64(message, field));
+            case FieldDescriptor::CPPTYPE_BOOL:
+                return (repeated ? reflection->GetRepeatedBool(message, field, index)
+                                 : reflection->GetBool(message, field)) ? "1" : "0";
+            case FieldDescriptor::CPPTYPE_ENUM:
+                return std::to_string(repeated ? reflection->GetRepeatedEnumValue(message, field, index)
+                                               : reflection->GetEnumValue(message, field));
+            default:
+                throw std::logic_error("field " + field->full_name() + " cannot be indexed");
+        }
+    }
+
+    void collect_values(Message const& message,
+                        std::vector<FieldDescriptor const *> const& chain,
+                        std::size_t depth,
+                        std::vector<std::string>& values)
+    {
+        auto field = chain[depth];
+        auto reflection = message.GetReflection();
+        if (depth + 1 < chain.size()) {
+            if (reflection->HasField(message, field))
+                collect_values(reflection->GetMessage(message, field), chain, depth + 1, values);
+            return;
+        }
+
+        if (field->is_repeated()) {
+            auto size = reflection->FieldSize(message, field);
+            for (int i = 0; i < size; ++i)
+                values.push_back(value_text(reflection, message, field, i));
+            return;
+        }
+
+        // proto3 scalars outside a oneof always have a value; anything else may be absent
+        auto has_presence = field->containing_oneof()
+                            or field->file()->syntax() != FileDescriptor::SYNTAX_PROTO3;
+        if (has_presence and not reflection->HasField(message, field))
+            return;
+        values.push_back(value_text(reflection, message, field, -1));
+    }
+
+    std::string stored_value(std::string const& value)
+    {
+        return value.substr(0, max_index_value_length);
+    }
+}
+
+std::vector<indexed_field> plan_indexed_fields(google::protobuf::Descriptor const *descriptor)
+{
+    auto fields = std::vector<indexed_field>();
+    auto chain = std::vector<FieldDescriptor const *>();
+    auto visiting = std::vector<Descriptor const *> { descriptor };
+    collect_fields(descriptor, descriptor, std::string(), chain, visiting, fields);
+    return fields;
+}
+
+std::vector<indexed_field> const& indexed_fields(google::protobuf::Descriptor const *descriptor)
+{
+    return storage_plan::get(descriptor).indexes;
+}
+
+indexed_field const& find_indexed_field(google::protobuf::Descriptor const *descriptor, std::string const& path)
+{
+    auto&& fields = indexed_fields(descriptor);
+    auto ifind = std::find_if(fields.begin(), fields.end(), [&path](auto&& field) { return field.path == path; });
+    if (ifind == fields.end())
+        throw std::invalid_argument(descriptor->full_name() + " has no indexed field " + path);
+    return *ifind;
+}
+
+void extract_index_values(google::protobuf::Message const& message,
+                          indexed_field const& field,
+                          std::vector<std::string>& values)
+{
+    collect_values(message, field.chain, 0, values);
+}
+
+void make_field_index(amy::connector& conn)
+{
+    execute(conn, R"__(
+CREATE TABLE IF NOT EXISTS `tbl_message_index` (
+  `field_id` int(10) unsigned NOT NULL,
+  `value` varbinary(255) NOT NULL,
+  `unique_id` int(11) NOT NULL,
+  PRIMARY KEY (`field_id`, `value`, `unique_id`),
+  KEY `unique_id` (`unique_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+)__");
+}
+
+void index_message(amy::connector& conn, int unique_id, google::protobuf::Message const& message)
+{
+    auto&& fields = indexed_fields(message.GetDescriptor());
+    if (fields.empty())
+        return;
+
+    auto escaper = sql_escaper(conn);
+    auto id_text = std::to_string(unique_id);
+    auto query = std::string("INSERT IGNORE INTO tbl_message_index (field_id, value, unique_id) VALUES ");
+    auto values = std::vector<std::string>();
+    const char *sep = "";
+    for (auto&& field : fields) {
+        values.clear();
+        extract_index_values(message, field, values);
+        for (auto&& value : values) {
+            query += sep;
+            query += '(';
+            query += std::to_string(field.field_id);
+            query += ", ";
+            query += escaper(stored_value(value));
+            query += ", ";
+            query += id_text;
+            query += ')';
+            sep = ", ";
+        }
+    }
+    if (*sep == 0)
+        return;     // every indexed field was absent
+
+    AMY_LOG(debug, "executing: ", query);
+    AMYTEST_METRIC_COUNT(bytes_out, query.size());
+    AMYTEST_METRIC_QUERY(insert_index_template);
+    execute(conn, query);
+}
+
+std::vector<int> lookup_index(amy::connector& conn, indexed_field const& field, std::string const& value)
+{
+    auto query = build_query(conn, select_index_template,
+                             field.field_id, stored_value(value));
+    AMY_LOG(debug, "executing: ", query);
+    auto rs = [&] {
+        AMYTEST_METRIC_QUERY(select_index_template);
+        conn.query(query);
+        return conn.store_result();
+    }();
+    auto ids = std::vector<int>();
+    ids.reserve(rs.size());
+    for (auto&& row : typed_rows<int>(rs))
+        ids.push_back(std::get<0>(row));
+    return ids;
+}
@@ -0,0 +1,58 @@
+//
+// Created by Richard Hodges on 08/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include <amy.hpp>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Secondary indexes over tbl_message_store, declared with the (limits.index) field option.
+///
+/// Each indexed value of a stored message is a row (field_id, value, unique_id) in tbl_message_index.
+/// field_id identifies the message type and field path, e.g. "test.BigMessage.y.a", by a hash like
+/// type_dictionary's ids but in a domain of its own. Two fields sharing an id only cost extra candidates. Values are stored as text: strings and bytes as they are, integers and
+/// enums in decimal, bools as 0 or 1. Only the first max_index_value_length bytes are kept, so a lookup can match
+/// a longer value with the same prefix; find_messages() rechecks the decoded messages.
+
+struct indexed_field
+{
+    /// Dot separated field names from the root message, e.g. "y.a"
+    std::string path;
+
+    /// The fields along the path. All but the last are singular message fields
+    std::vector<google::protobuf::FieldDescriptor const *> chain;
+
+    std::uint32_t field_id;
+};
+
+constexpr std::size_t max_index_value_length = 255;
+
+/// Every field of `descriptor`, or of its nested messages, which carries (limits.index).
+/// Throws std::invalid_argument if one of them cannot be indexed.
+std::vector<indexed_field> plan_indexed_fields(google::protobuf::Descriptor const *descriptor);
+
+/// plan_indexed_fields(), as held by the type's storage_plan
+std::vector<indexed_field> const& indexed_fields(google::protobuf::Descriptor const *descriptor);
+
+/// The indexed field at `path`. Throws std::invalid_argument if there is none
+indexed_field const& find_indexed_field(google::protobuf::Descriptor const *descriptor, std::string const& path);
+
+/// The text form of each value of `field` in `message`. A field which is absent yields nothing.
+void extract_index_values(google::protobuf::Message const& message,
+                          indexed_field const& field,
+                          std::vector<std::string>& values);
+
+void make_field_index(amy::connector& conn);
+
+/// Record the indexed values of a message which has been stored as `unique_id`. Does nothing for
+/// types without indexed fields.
+void index_message(amy::connector& conn, int unique_id, google::protobuf::Message const& message);
+
+/// The ids of messages whose indexed `field` may have `value`
+std::vector<int> lookup_index(amy::connector& conn, indexed_field const& field, std::string const& value);
@@ -0,0 +1,71 @@
+//
+// Created by Richard Hodges on 27/04/2017.
+//
+
+#include "hex.hpp"
+#include <cstring>
+#include <iterator>
+
+namespace {
+
+    /// Both directions are a single table lookup per byte rather than per nibble
+    struct hex_tables
+    {
+        hex_tables()
+        {
+            static const char myDigits[] = "0123456789ABCDEF";
+            for (int byte = 0; byte < 256; ++byte) {
+                pairs[byte][0] = myDigits[byte >> 4];
+                pairs[byte][1] = myDigits[byte & 0xf];
+                nibbles[byte] = -1;
+            }
+            for (int i = 0; i < 16; ++i) {
+                nibbles[std::uint8_t(myDigits[i])] = std::int8_t(i);
+                nibbles[std::uint8_t("0123456789abcdef"[i])] = std::int8_t(i);
+            }
+        }
+
+        char pairs[256][2];
+        std::int8_t nibbles[256];
+    };
+
+    hex_tables const& tables() {
+        static const hex_tables tables_;
+        return tables_;
+    }
+}
+
+void hex_encode(std::uint8_t const *first, std::uint8_t const *const last, char *out) {
+    auto&& pairs = tables().pairs;
+    while (first != last) {
+        std::memcpy(out, pairs[*first++], 2);
+        out += 2;
+    }
+}
+
+std::string hex_encode(std::uint8_t const *first, std::uint8_t const *const last) {
+    std::string myResult(std::distance(first, last) * 2, '\0');
+    hex_encode(first, last, &myResult[0]);
+    return myResult;
+}
+
+bool hex_decode(boost::string_view text, std::vector<std::uint8_t>& out) {
+    if (text.size() % 2)
+        return false;
+    auto&& nibbles = tables().nibbles;
+    auto start = out.size();
+    out.resize(start + text.size() / 2);
+    auto dest = out.data() + start;
+    int invalid = 0;
+    for (std::size_t i = 0; i < text.size(); i += 2) {
+        auto high = nibbles[std::uint8_t(text[i])];
+        auto low = nibbles[std::uint8_t(text[i + 1])];
+        invalid |= high | low;      // negative if either is not a digit
+        *dest++ = std::uint8_t(std::uint8_t(high) << 4 | (std::uint8_t(low) & 0xf));
+    }
+    if (invalid < 0) {
+        out.resize(start);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+//
+// Created by Richard Hodges on 27/04/2017.
+//
+
+#pragma once
+
+#include <boost/utility/string_view.hpp>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Write two upper case digits per byte to `out`, which must have room for 2 * (last - first) chars
+void hex_encode(std::uint8_t const *first, std::uint8_t const *const last, char *out);
+
+std::string hex_encode(std::uint8_t const *first, std::uint8_t const *const last);
+
+template<class Iter>
+std::string hex_encode(Iter first, Iter last) {
+    return hex_encode(reinterpret_cast<std::uint8_t const *>(std::addressof(*first)),
+                      reinterpret_cast<std::uint8_t const *>(std::addressof(*last)));
+}
+
+/// Append the bytes spelled by `text`, in upper or lower case, to `out`.
+/// Returns false, leaving `out` unchanged, if `text` has an odd length or a character which is not a hex digit.
+bool hex_decode(boost::string_view text, std::vector<std::uint8_t>& out);
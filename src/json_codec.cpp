@@ -0,0 +1,130 @@
+//
+// Created by Richard Hodges on 26/04/2017.
+//
+
+#include "json_codec.hpp"
+#include "metrics.hpp"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/util/type_resolver_util.h>
+#include <mysql/mysql.h>
+#include <stdexcept>
+
+namespace {
+    const char type_url_prefix[] = "type.googleapis.com";
+
+    /// Per-thread scratch space for the intermediate wire format
+    std::string& scratch()
+    {
+        thread_local std::string buffer;
+        buffer.clear();
+        return buffer;
+    }
+}
+
+escaping_output_stream::~escaping_output_stream()
+{
+    flush();
+}
+
+bool escaping_output_stream::Next(void **data, int *size)
+{
+    flush();
+    *data = block_.data();
+    *size = int(block_.size());
+    pending_ = int(block_.size());
+    total_ += pending_;
+    return true;
+}
+
+void escaping_output_stream::BackUp(int count)
+{
+    pending_ -= count;
+    total_ -= count;
+}
+
+google::protobuf::int64 escaping_output_stream::ByteCount() const
+{
+    return total_;
+}
+
+void escaping_output_stream::flush()
+{
+    if (pending_ == 0)
+        return;
+    auto start = target.size();
+    target.resize(start + pending_ * 2 + 1);
+    auto length = mysql_real_escape_string_quote(connector.native(),
+                                                 &target[start],
+                                                 block_.data(), pending_,
+                                                 '\'');
+    target.resize(start + length);
+    pending_ = 0;
+}
+
+json_codec const& json_codec::instance()
+{
+    static const json_codec codec;
+    return codec;
+}
+
+json_codec::json_codec()
+    : resolver_(google::protobuf::util::NewTypeResolverForDescriptorPool(
+    type_url_prefix, google::protobuf::DescriptorPool::generated_pool()))
+{
+}
+
+std::string json_codec::type_url(google::protobuf::Descriptor const *descriptor)
+{
+    return std::string(type_url_prefix) + "/" + descriptor->full_name();
+}
+
+void json_codec::to_json(google::protobuf::Message const& message,
+                         google::protobuf::io::ZeroCopyOutputStream& output) const
+{
+    AMYTEST_METRIC_STAGE(serialize);
+    auto& binary = scratch();
+    message.SerializeToString(&binary);
+    google::protobuf::io::ArrayInputStream input(binary.data(), int(binary.size()));
+    auto status = google::protobuf::util::BinaryToJsonStream(resolver_.get(),
+                                                             type_url(message.GetDescriptor()),
+                                                             &input, &output,
+                                                             print_options_);
+    if (not status.ok()) {
+        throw std::runtime_error("failed to convert to json: " + status.ToString());
+    }
+}
+
+void json_codec::append_escaped(amy::connector& connector,
+                                google::protobuf::Message const& message,
+                                std::string& target) const
+{
+    escaping_output_stream output(connector, target);
+    to_json(message, output);
+}
+
+void json_codec::append(google::protobuf::Message const& message, std::string& target) const
+{
+    google::protobuf::io::StringOutputStream output(&target);
+    to_json(message, output);
+}
+
+void json_codec::parse(const char *data, std::size_t size, google::protobuf::Message& message) const
+{
+    auto& binary = scratch();
+    {
+        google::protobuf::io::ArrayInputStream input(data, int(size));
+        google::protobuf::io::StringOutputStream output(&binary);
+        auto status = google::protobuf::util::JsonToBinaryStream(resolver_.get(),
+                                                                 type_url(message.GetDescriptor()),
+                                                                 &input, &output,
+                                                                 parse_options_);
+        if (not status.ok()) {
+            throw std::runtime_error("failed to parse json: " + status.ToString());
+        }
+    }
+    if (not message.ParseFromArray(binary.data(), int(binary.size()))) {
+        throw std::runtime_error("failed to parse " + message.GetDescriptor()->full_name());
+    }
+}
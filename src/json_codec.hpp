@@ -0,0 +1,71 @@
+//
+// Created by Richard Hodges on 26/04/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include <amy.hpp>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/util/json_util.h>
+#include <google/protobuf/util/type_resolver.h>
+#include <array>
+#include <memory>
+#include <string>
+
+/// A ZeroCopyOutputStream which escapes everything written to it with the connection's
+/// character set and appends it to `target`. Quotes are not added.
+/// Data is escaped block by block, so no intermediate copy of the whole payload is made.
+struct escaping_output_stream
+    : google::protobuf::io::ZeroCopyOutputStream
+{
+    escaping_output_stream(amy::connector& connector, std::string& target)
+        : connector(connector)
+        , target(target)
+    {}
+
+    ~escaping_output_stream() override;
+
+    bool Next(void **data, int *size) override;
+
+    void BackUp(int count) override;
+
+    google::protobuf::int64 ByteCount() const override;
+
+    /// Escape and append anything still held in the block
+    void flush();
+
+private:
+    amy::connector& connector;
+    std::string& target;
+    std::array<char, 8192> block_;
+    int pending_ = 0;
+    google::protobuf::int64 total_ = 0;
+};
+
+/// Type resolver and options for JSON conversion, built once and shared by every call.
+struct json_codec
+{
+    static json_codec const& instance();
+
+    /// Append the json representation of `message` to `target`, escaped for use inside a quoted literal
+    void append_escaped(amy::connector& connector, google::protobuf::Message const& message, std::string& target) const;
+
+    /// Append the json representation of `message` to `target`
+    void append(google::protobuf::Message const& message, std::string& target) const;
+
+    /// Parse json held in [data, data + size) into message without copying the input
+    void parse(const char *data, std::size_t size, google::protobuf::Message& message) const;
+
+private:
+    json_codec();
+
+    void to_json(google::protobuf::Message const& message, google::protobuf::io::ZeroCopyOutputStream& output) const;
+
+    static std::string type_url(google::protobuf::Descriptor const *descriptor);
+
+    std::unique_ptr<google::protobuf::util::TypeResolver> resolver_;
+    google::protobuf::util::JsonPrintOptions print_options_;
+    google::protobuf::util::JsonParseOptions parse_options_;
+};
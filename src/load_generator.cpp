@@ -0,0 +1,399 @@
+//
+// Created by Richard Hodges on 03/05/2017.
+//
+
+#include "load_generator.hpp"
+#include "message_store.hpp"
+#include "query_builder.hpp"
+#include "field_bytes.hpp"
+#include "type_dictionary.hpp"
+#include "logging.hpp"
+
+#include "proto/test.pb.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+
+using namespace amytest;
+
+namespace {
+
+    using clock_type = std::chrono::steady_clock;
+
+    const char insert_template[] =
+        "INSERT INTO tbl_load_people (`name`, `age`) VALUES (%1%, %2%)";
+    const char count_template[] =
+        "SELECT COUNT(*) FROM tbl_load_people WHERE `age` = %1%";
+    const char range_select_template[] =
+        "SELECT `id`, `name`, `age` FROM tbl_load_people WHERE `age` >= %1% AND `age` < %2% LIMIT 100";
+    const char blob_write_template[] =
+        "INSERT INTO tbl_message_store (type_id, binary_data) VALUES(%1%, FROM_BASE64(%2%))";
+    const char blob_read_template[] =
+        "SELECT type_id, binary_data FROM tbl_message_store WHERE unique_id = %1%";
+
+    /// A session gives up after this many failures in a row, e.g. when its connection has gone
+    constexpr int max_consecutive_errors = 10;
+
+    struct load_control
+    {
+        load_control(load_options const& options, std::vector<int> blob_ids)
+            : options(options)
+            , blob_ids(std::move(blob_ids))
+        {}
+
+        /// Reserve the right to issue one more operation
+        bool claim()
+        {
+            if (options.operations)
+                return issued.fetch_add(1, std::memory_order_relaxed) < options.operations;
+            return clock_type::now() < deadline;
+        }
+
+        load_options const& options;
+        std::vector<int> const blob_ids;
+        clock_type::time_point deadline;
+        std::atomic<std::uint64_t> issued { 0 };
+    };
+
+    /// One connection. It has at most one asynchronous operation outstanding, so it needs no strand
+    /// even when the io_service is run by several threads.
+    struct load_session
+    {
+        load_session(asio::io_service& owner, load_control& control, std::size_t index)
+            : control_(control)
+            , index_(index)
+            , connector_(owner)
+            , timer_(owner)
+            , random_(control.options.random_seed * 7919 + index)
+            , choose_(control.options.mix.begin(), control.options.mix.end())
+        {
+            auto&& options = control.options;
+            if (options.target_qps > 0) {
+                interval_ = std::chrono::duration_cast<clock_type::duration>(
+                    std::chrono::duration<double>(options.connections / options.target_qps));
+            }
+            auto letters = std::uniform_int_distribution<int>('a', 'z');
+            auto payload = std::string(options.blob_bytes, ' ');
+            for (auto& c : payload)
+                c = char(letters(random_));
+            blob_.set_x(std::move(payload));
+        }
+
+        void start()
+        {
+            auto&& options = control_.options;
+            connector_.async_connect(options.endpoint,
+                                     amy::auth_info(options.user, options.password),
+                                     options.database,
+                                     amy::client_multi_statements | amy::client_multi_results,
+                                     [this](auto&& ...args)
+                                     {
+                                         this->handle_connect(std::forward<decltype(args)>(args)...);
+                                     });
+        }
+
+        void merge_into(load_report& report) const
+        {
+            for (std::size_t i = 0; i < load_operation_count; ++i) {
+                report.latency[i] += latency_[i];
+                report.errors[i] += errors_[i];
+            }
+            report.late_starts += late_starts_;
+        }
+
+    private:
+        void handle_connect(boost::system::error_code const& ec)
+        {
+            if (ec) {
+                AMY_LOG(error, "load session ", index_, " : ", connector_.error_message(ec));
+                return;
+            }
+            // stagger the sessions so that an open-loop schedule does not start with a burst
+            next_start_ = clock_type::now() + interval_ * index_ / control_.options.connections;
+            schedule();
+        }
+
+        void schedule()
+        {
+            if (not control_.claim())
+                return;
+
+            if (interval_ == clock_type::duration::zero()) {
+                issue(clock_type::now());
+                return;
+            }
+
+            auto when = next_start_;
+            next_start_ += interval_;
+            if (when <= clock_type::now()) {
+                // the previous operation overran this one's slot
+                ++late_starts_;
+                issue(when);
+                return;
+            }
+            timer_.expires_at(when);
+            timer_.async_wait([this, when](boost::system::error_code const& ec)
+                              {
+                                  if (not ec)
+                                      this->issue(when);
+                              });
+        }
+
+        void issue(clock_type::time_point scheduled)
+        {
+            scheduled_ = scheduled;
+            operation_ = load_operation(choose_(random_));
+            auto query = build_operation();
+            AMY_LOG(trace, "load session ", index_, " : ", query);
+            connector_.async_query(query,
+                                   [this](auto&& ...args)
+                                   {
+                                       this->handle_query(std::forward<decltype(args)>(args)...);
+                                   });
+        }
+
+        std::string build_operation()
+        {
+            auto ages = std::uniform_int_distribution<int>(1, 99);
+            switch (operation_) {
+                case load_operation::insert:
+                    return build_query(connector_, insert_template,
+                                       "load-" + std::to_string(index_), ages(random_));
+                case load_operation::count:
+                    return build_query(connector_, count_template, ages(random_));
+                case load_operation::range_select: {
+                    auto low = ages(random_);
+                    return build_query(connector_, range_select_template, low, low + 10);
+                }
+                case load_operation::blob_write:
+                    return build_query(connector_, blob_write_template,
+                                       type_dictionary::id_for(blob_.GetDescriptor()),
+                                       to_base64(blob_.SerializeAsString()));
+                case load_operation::blob_read: {
+                    auto&& ids = control_.blob_ids;
+                    auto pick = std::uniform_int_distribution<std::size_t>(0, ids.size() - 1);
+                    return build_query(connector_, blob_read_template, ids[pick(random_)]);
+                }
+                case load_operation::operation_count:
+                    break;
+            }
+            throw std::logic_error("invalid load operation");
+        }
+
+        void handle_query(boost::system::error_code const& ec)
+        {
+            if (ec) {
+                fail(ec);
+                return;
+            }
+            connector_.async_store_result([this](auto&& ...args)
+                                          {
+                                              this->handle_store_result(std::forward<decltype(args)>(args)...);
+                                          });
+        }
+
+        void handle_store_result(boost::system::error_code const& ec, amy::result_set rs)
+        {
+            if (ec) {
+                fail(ec);
+                return;
+            }
+            if (operation_ == load_operation::blob_read and not decode_blob(rs)) {
+                fail(ec);
+                return;
+            }
+            consecutive_errors_ = 0;
+            auto elapsed = clock_type::now() - scheduled_;
+            latency_[std::size_t(operation_)].record(
+                std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+            schedule();
+        }
+
+        /// Reading a blob includes decoding it
+        bool decode_blob(amy::result_set const& rs)
+        {
+            if (rs.empty())
+                return false;
+            auto bytes = field_bytes(rs.at(0).at(1));
+            return decoded_.ParseFromArray(bytes.data, int(bytes.size));
+        }
+
+        void fail(boost::system::error_code const& ec)
+        {
+            ++errors_[std::size_t(operation_)];
+            if (ec) {
+                AMY_LOG(warning, "load session ", index_, " ", name(operation_), " : ", connector_.error_message(ec));
+            }
+            else {
+                AMY_LOG(warning, "load session ", index_, " ", name(operation_), " : no usable result");
+            }
+            if (++consecutive_errors_ >= max_consecutive_errors) {
+                AMY_LOG(error, "load session ", index_, " : giving up after ", consecutive_errors_, " errors");
+                return;
+            }
+            schedule();
+        }
+
+        load_control& control_;
+        std::size_t index_;
+        amy::connector connector_;
+        asio::steady_timer timer_;
+        std::mt19937_64 random_;
+        std::discrete_distribution<int> choose_;
+        test::BigMessage blob_;
+        test::BigMessage decoded_;
+
+        clock_type::duration interval_ = clock_type::duration::zero();
+        clock_type::time_point next_start_;
+        clock_type::time_point scheduled_;
+        load_operation operation_ = load_operation::insert;
+        int consecutive_errors_ = 0;
+
+        std::array<metrics::histogram_snapshot, load_operation_count> latency_;
+        std::array<std::uint64_t, load_operation_count> errors_ {};
+        std::uint64_t late_starts_ = 0;
+    };
+}
+
+const char *name(load_operation op)
+{
+    static const char *const names[] = {
+        "insert", "count", "range_select", "blob_write", "blob_read"
+    };
+    return names[std::size_t(op)];
+}
+
+load_mix parse_load_mix(std::string const& text)
+{
+    auto mix = load_mix {};
+    std::size_t pos = 0;
+    while (pos < text.size()) {
+        auto comma = std::min(text.find(',', pos), text.size());
+        auto item = text.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        auto equals = item.find('=');
+        if (equals == std::string::npos)
+            throw std::invalid_argument("load mix entry has no weight: " + item);
+        auto op_name = item.substr(0, equals);
+        auto weight = std::stoul(item.substr(equals + 1));
+
+        std::size_t i = 0;
+        while (i < load_operation_count and op_name != name(load_operation(i)))
+            ++i;
+        if (i == load_operation_count)
+            throw std::invalid_argument("unknown load operation: " + op_name);
+        mix[i] = unsigned(weight);
+    }
+    return mix;
+}
+
+metrics::histogram_snapshot load_report::total() const
+{
+    auto result = metrics::histogram_snapshot();
+    for (auto&& h : latency)
+        result += h;
+    return result;
+}
+
+double load_report::throughput() const
+{
+    auto secs = std::chrono::duration<double>(elapsed).count();
+    return secs > 0 ? completed() / secs : 0.0;
+}
+
+std::ostream& operator<<(std::ostream& os, load_report const& report)
+{
+    if (report.target_qps > 0)
+        os << "open loop at " << report.target_qps << " ops/s";
+    else
+        os << "closed loop";
+    os << ", " << report.connections << " connections, "
+       << std::chrono::duration<double>(report.elapsed).count() << "s\n";
+    os << "throughput: " << report.throughput() << " ops/s\n";
+    for (std::size_t i = 0; i < load_operation_count; ++i) {
+        if (report.latency[i].count() or report.errors[i])
+            os << "  " << name(load_operation(i)) << ": " << report.latency[i]
+               << " errors=" << report.errors[i] << '\n';
+    }
+    os << "  total: " << report.total() << '\n';
+    if (report.target_qps > 0)
+        os << "late starts: " << report.late_starts << '\n';
+    return os;
+}
+
+std::vector<int> prepare_load(amy::connector& conn, load_options const& options)
+{
+    make_blob_store(conn);
+    type_dictionary(conn).lookup(test::BigMessage::descriptor());
+    execute(conn, R"__(
+CREATE TABLE IF NOT EXISTS `tbl_load_people` (
+  `id` int(11) NOT NULL AUTO_INCREMENT,
+  `name` varchar(64) NOT NULL,
+  `age` int(11) NOT NULL,
+  PRIMARY KEY (`id`),
+  KEY `age` (`age`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+)__");
+
+    auto ids = std::vector<int>();
+    if (options.mix[std::size_t(load_operation::blob_read)] == 0)
+        return ids;
+    if (options.seed_blobs == 0)
+        throw std::invalid_argument("blob_read needs at least one seeded blob");
+
+    auto message = test::BigMessage();
+    message.set_x(std::string(options.blob_bytes, 's'));
+    ids.reserve(options.seed_blobs);
+    for (std::size_t i = 0; i < options.seed_blobs; ++i)
+        ids.push_back(write_message(conn, message));
+    return ids;
+}
+
+load_report run_load(load_options const& options)
+{
+    auto&& mix = options.mix;
+    if (std::all_of(mix.begin(), mix.end(), [](unsigned w) { return w == 0; }))
+        throw std::invalid_argument("load mix has no operations");
+    if (options.connections == 0)
+        throw std::invalid_argument("load needs at least one connection");
+
+    asio::io_service ios;
+
+    amy::connector setup(ios);
+    setup.connect(options.endpoint,
+                  amy::auth_info(options.user, options.password),
+                  options.database,
+                  amy::client_multi_statements | amy::client_multi_results);
+    load_control control(options, prepare_load(setup, options));
+    setup.close();
+
+    auto sessions = std::vector<std::unique_ptr<load_session>>();
+    for (std::size_t i = 0; i < options.connections; ++i)
+        sessions.push_back(std::make_unique<load_session>(ios, control, i));
+
+    auto start = clock_type::now();
+    control.deadline = start + options.duration;
+    for (auto&& session : sessions)
+        session->start();
+
+    auto workers = std::vector<std::thread>();
+    for (std::size_t i = 1; i < options.threads; ++i)
+        workers.emplace_back([&ios] { ios.run(); });
+    ios.run();
+    for (auto&& worker : workers)
+        worker.join();
+
+    auto report = load_report();
+    report.elapsed = clock_type::now() - start;
+    report.connections = options.connections;
+    report.target_qps = options.target_qps;
+    for (auto&& session : sessions)
+        session->merge_into(report);
+    return report;
+}
@@ -0,0 +1,98 @@
+//
+// Created by Richard Hodges on 03/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include "metrics.hpp"
+
+#include <amy.hpp>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+/// Drives a mix of storage operations over many concurrent connections and measures them.
+///
+/// Closed loop (target_qps == 0): every connection issues its next operation as soon as the previous one completes.
+/// Open loop (target_qps > 0): operations are scheduled at a fixed rate spread over the connections. Latency is
+/// measured from the scheduled start, not the actual one, so a stalled server shows up in the percentiles rather
+/// than being hidden by the generator slowing down (coordinated omission).
+
+enum class load_operation
+{
+    insert,
+    count,
+    range_select,
+    blob_write,
+    blob_read,
+    operation_count
+};
+
+constexpr std::size_t load_operation_count = std::size_t(load_operation::operation_count);
+
+const char *name(load_operation op);
+
+/// Relative weights of each operation, indexed by load_operation
+using load_mix = std::array<unsigned, load_operation_count>;
+
+/// Parse "insert=4,count=2,range_select=2,blob_write=1,blob_read=1". Operations not mentioned get weight 0.
+load_mix parse_load_mix(std::string const& text);
+
+struct load_options
+{
+    amytest::tcp_endpoint endpoint { amytest::ip_address::from_string("127.0.0.1"), 3306 };
+    std::string user = "test-user";
+    std::string password = "test-password";
+    std::string database = "test";
+
+    std::size_t connections = 8;
+    std::size_t threads = 1;
+
+    /// Stop after this long...
+    std::chrono::milliseconds duration { 10000 };
+
+    /// ...or after this many operations, if non-zero
+    std::uint64_t operations = 0;
+
+    /// Operations per second across all connections. 0 selects closed-loop mode
+    double target_qps = 0;
+
+    load_mix mix {{ 4, 2, 2, 1, 1 }};
+
+    /// Size of the string payload in each blob written
+    std::size_t blob_bytes = 1024;
+
+    /// Blobs written before the run for blob_read to pick from
+    std::size_t seed_blobs = 100;
+
+    std::uint64_t random_seed = 0;
+};
+
+struct load_report
+{
+    metrics::histogram_snapshot total() const;
+
+    std::uint64_t completed() const { return total().count(); }
+
+    double throughput() const;
+
+    std::chrono::steady_clock::duration elapsed {};
+    std::size_t connections = 0;
+    double target_qps = 0;
+    std::array<metrics::histogram_snapshot, load_operation_count> latency;
+    std::array<std::uint64_t, load_operation_count> errors {};
+
+    /// Open loop only: operations which could not start at their scheduled time
+    std::uint64_t late_starts = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, load_report const& report);
+
+/// Create the tables used by the load and return the ids of the seeded blobs
+std::vector<int> prepare_load(amy::connector& conn, load_options const& options);
+
+load_report run_load(load_options const& options);
@@ -0,0 +1,102 @@
+//
+// Created by Richard Hodges on 03/05/2017.
+//
+// Load generator. For example, 32 connections at a fixed 5000 ops/s for a minute against a local stand-in server:
+//    amy-fake-server --port 3307 --latency-us 250 &
+//    amy-load --port 3307 --connections 32 --qps 5000 --duration-s 60 --mix insert=1,blob_read=4
+//
+
+#include "config.hpp"
+#include "load_generator.hpp"
+#include "logging.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+using namespace amytest;
+
+namespace {
+
+    void usage(const char *program)
+    {
+        std::cerr << "usage: " << program
+                  << " [--host addr] [--port n] [--user name] [--password pw] [--database name]\n"
+                     "       [--connections n] [--threads n] [--duration-s n] [--operations n] [--qps n]\n"
+                     "       [--mix insert=4,count=2,range_select=2,blob_write=1,blob_read=1]\n"
+                     "       [--blob-bytes n] [--seed-blobs n] [--seed n]" << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (auto level = std::getenv("AMYTEST_LOG_LEVEL"))
+        logging::logger::instance().set_level(logging::parse_level(level, logging::level::info));
+
+    auto options = load_options();
+    try {
+        for (int i = 1; i < argc; i += 2) {
+            if (i + 1 == argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            auto value = argv[i + 1];
+            if (std::strcmp(argv[i], "--host") == 0) {
+                options.endpoint.address(ip_address::from_string(value));
+            }
+            else if (std::strcmp(argv[i], "--port") == 0) {
+                options.endpoint.port(static_cast<unsigned short>(std::atoi(value)));
+            }
+            else if (std::strcmp(argv[i], "--user") == 0) {
+                options.user = value;
+            }
+            else if (std::strcmp(argv[i], "--password") == 0) {
+                options.password = value;
+            }
+            else if (std::strcmp(argv[i], "--database") == 0) {
+                options.database = value;
+            }
+            else if (std::strcmp(argv[i], "--connections") == 0) {
+                options.connections = std::strtoull(value, nullptr, 10);
+            }
+            else if (std::strcmp(argv[i], "--threads") == 0) {
+                options.threads = std::strtoull(value, nullptr, 10);
+            }
+            else if (std::strcmp(argv[i], "--duration-s") == 0) {
+                options.duration = std::chrono::seconds(std::atoll(value));
+            }
+            else if (std::strcmp(argv[i], "--operations") == 0) {
+                options.operations = std::strtoull(value, nullptr, 10);
+            }
+            else if (std::strcmp(argv[i], "--qps") == 0) {
+                options.target_qps = std::atof(value);
+            }
+            else if (std::strcmp(argv[i], "--mix") == 0) {
+                options.mix = parse_load_mix(value);
+            }
+            else if (std::strcmp(argv[i], "--blob-bytes") == 0) {
+                options.blob_bytes = std::strtoull(value, nullptr, 10);
+            }
+            else if (std::strcmp(argv[i], "--seed-blobs") == 0) {
+                options.seed_blobs = std::strtoull(value, nullptr, 10);
+            }
+            else if (std::strcmp(argv[i], "--seed") == 0) {
+                options.random_seed = std::strtoull(value, nullptr, 10);
+            }
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+
+        auto report = run_load(options);
+        logging::logger::instance().flush();
+        std::cout << report;
+    }
+    catch (std::exception const& e) {
+        logging::logger::instance().flush();
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
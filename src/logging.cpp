@@ -0,0 +1,187 @@
+//
+// Created by Richard Hodges on 02/05/2017.
+//
+
+#include "logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+namespace logging {
+
+    const char *name(level l)
+    {
+        static const char *const names[] = {"trace", "debug", "info", "warning", "error", "off"};
+        return names[std::size_t(l)];
+    }
+
+    level parse_level(std::string const& text, level fallback)
+    {
+        for (auto l : {level::trace, level::debug, level::info, level::warning, level::error, level::off})
+            if (text == name(l))
+                return l;
+        return fallback;
+    }
+
+    std::string truncate(const char *data, std::size_t size, std::size_t limit)
+    {
+        if (size <= limit)
+            return std::string(data, size);
+        auto result = std::string(data, limit);
+        result += "...(";
+        result += std::to_string(size);
+        result += " bytes)";
+        return result;
+    }
+
+    record_queue::record_queue(std::size_t capacity_power_of_two)
+        : cells_(capacity_power_of_two)
+        , mask_(capacity_power_of_two - 1)
+    {
+        for (std::size_t i = 0; i < cells_.size(); ++i)
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool record_queue::push(record *r)
+    {
+        auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            auto& c = cells_[pos & mask_];
+            auto seq = c.sequence.load(std::memory_order_acquire);
+            auto diff = std::intptr_t(seq) - std::intptr_t(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.data = r;
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;   // full
+            }
+            else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    record *record_queue::pop()
+    {
+        auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            auto& c = cells_[pos & mask_];
+            auto seq = c.sequence.load(std::memory_order_acquire);
+            auto diff = std::intptr_t(seq) - std::intptr_t(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    auto r = c.data;
+                    c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return r;
+                }
+            }
+            else if (diff < 0) {
+                return nullptr; // empty
+            }
+            else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    logger& logger::instance()
+    {
+        static logger the_logger;
+        return the_logger;
+    }
+
+    logger::logger()
+        : queue_(1 << 14)
+        , sinks_ {{ &std::cout, &std::cout, &std::cout, &std::cerr, &std::cerr }}
+    {
+        thread_ = std::thread([this] { run(); });
+    }
+
+    logger::~logger()
+    {
+        stopping_.store(true);
+        thread_.join();
+        drain();
+    }
+
+    void logger::set_sink(std::ostream& os)
+    {
+        auto lock = std::unique_lock<std::mutex>(sink_mutex_);
+        for (auto& sink : sinks_) {
+            sink->flush();
+            sink = &os;
+        }
+    }
+
+    void logger::set_sink(level l, std::ostream& os)
+    {
+        if (l == level::off)
+            throw std::invalid_argument("logging::logger::set_sink: no sink for level off");
+        auto lock = std::unique_lock<std::mutex>(sink_mutex_);
+        auto& sink = sinks_[std::size_t(l)];
+        sink->flush();
+        sink = &os;
+    }
+
+    void logger::post(std::unique_ptr<record> r)
+    {
+        if (queue_.push(r.get())) {
+            r.release();
+            posted_.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void logger::flush()
+    {
+        auto target = posted_.load();
+        while (written_.load() < target)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    std::size_t logger::drain()
+    {
+        std::size_t count = 0;
+        std::array<bool, level_count> used {};
+        auto lock = std::unique_lock<std::mutex>(sink_mutex_);
+        while (auto raw = queue_.pop()) {
+            auto r = std::unique_ptr<record>(raw);
+            auto index = std::min(std::size_t(r->level_), level_count - 1);
+            auto& sink = *sinks_[index];
+            sink << '[' << name(r->level_) << "] ";
+            r->write(sink);
+            sink << '\n';
+            used[index] = true;
+            ++count;
+        }
+        if (count) {
+            for (std::size_t i = 0; i < level_count; ++i)
+                if (used[i])
+                    sinks_[i]->flush();
+            written_.fetch_add(count);
+        }
+        return count;
+    }
+
+    void logger::run()
+    {
+        auto idle = std::chrono::microseconds(50);
+        while (not stopping_.load()) {
+            if (drain()) {
+                idle = std::chrono::microseconds(50);
+            }
+            else {
+                std::this_thread::sleep_for(idle);
+                idle = std::min(idle * 2, std::chrono::microseconds(5000));
+            }
+        }
+    }
+}
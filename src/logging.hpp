@@ -0,0 +1,197 @@
+//
+// Created by Richard Hodges on 02/05/2017.
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "notstd.hpp"
+
+/// Leveled, asynchronous logging.
+///
+///    AMY_LOG(debug, "executing: ", query);
+///
+/// The level check is a single relaxed load, and when it fails the arguments are not evaluated.
+/// Enabled records capture their arguments by value (strings are truncated to max_payload at capture)
+/// and are pushed onto a bounded lock-free queue. A background thread formats and writes them.
+/// If the queue is full the record is dropped and counted rather than blocking the caller.
+/// Each line is prefixed with its level, e.g. "[warning] ".
+
+namespace logging {
+
+    enum class level
+    {
+        trace, debug, info, warning, error, off
+    };
+
+    constexpr std::size_t level_count = std::size_t(level::off);
+
+    const char *name(level l);
+
+    /// Parse "trace", "debug", ... (as produced by name()). Unknown names yield `fallback`
+    level parse_level(std::string const& text, level fallback);
+
+    struct record
+    {
+        record(level l) : level_(l) {}
+
+        virtual ~record() = default;
+
+        virtual void write(std::ostream& os) const = 0;
+
+        level level_;
+    };
+
+    /// A bounded multi-producer queue of records (Vyukov's sequence-numbered ring)
+    struct record_queue
+    {
+        explicit record_queue(std::size_t capacity_power_of_two);
+
+        bool push(record *r);
+
+        record *pop();
+
+    private:
+        struct cell
+        {
+            std::atomic<std::size_t> sequence;
+            record *data;
+        };
+
+        std::vector<cell> cells_;
+        std::size_t mask_;
+        alignas(64) std::atomic<std::size_t> enqueue_pos_ { 0 };
+        alignas(64) std::atomic<std::size_t> dequeue_pos_ { 0 };
+    };
+
+    struct logger
+    {
+        static logger& instance();
+
+        ~logger();
+
+        bool enabled(level l) const
+        {
+            return l >= threshold_.load(std::memory_order_relaxed);
+        }
+
+        void set_level(level l) { threshold_.store(l, std::memory_order_relaxed); }
+
+        std::size_t max_payload() const { return max_payload_.load(std::memory_order_relaxed); }
+
+        /// Strings longer than this are truncated when captured
+        void set_max_payload(std::size_t n) { max_payload_.store(n, std::memory_order_relaxed); }
+
+        /// Where formatted records of every level go. Must outlive the logger.
+        /// Defaults to std::cout, except warning and error which go to std::cerr
+        void set_sink(std::ostream& os);
+
+        /// Where formatted records of one level go. Must outlive the logger
+        void set_sink(level l, std::ostream& os);
+
+        void post(std::unique_ptr<record> r);
+
+        /// Block until everything posted so far has been written
+        void flush();
+
+        std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    private:
+        logger();
+
+        void run();
+
+        std::size_t drain();
+
+        std::atomic<level> threshold_ { level::info };
+        std::atomic<std::size_t> max_payload_ { 256 };
+        std::atomic<std::uint64_t> dropped_ { 0 };
+        std::atomic<std::uint64_t> posted_ { 0 };
+        std::atomic<std::uint64_t> written_ { 0 };
+        std::atomic<bool> stopping_ { false };
+        record_queue queue_;
+        std::mutex sink_mutex_;
+        std::array<std::ostream *, level_count> sinks_;
+        std::thread thread_;
+    };
+
+    /// Marks a string which must be logged in full
+    struct whole
+    {
+        std::string text;
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, whole const& w)
+    {
+        return os << w.text;
+    }
+
+    std::string truncate(const char *data, std::size_t size, std::size_t limit);
+
+    // how each argument is captured
+
+    inline std::string capture_arg(std::string const& s)
+    {
+        return truncate(s.data(), s.size(), logger::instance().max_payload());
+    }
+
+    inline std::string capture_arg(const char *s)
+    {
+        return capture_arg(std::string(s));
+    }
+
+    inline whole capture_arg(whole w)
+    {
+        return w;
+    }
+
+    template<class T, std::enable_if_t<not std::is_convertible<T const&, std::string const&>::value
+                                       and not std::is_convertible<T const&, const char *>::value>* = nullptr>
+    std::decay_t<T> capture_arg(T const& t)
+    {
+        return t;
+    }
+
+    template<class...Ts>
+    struct deferred_record
+        : record
+    {
+        deferred_record(level l, Ts...args)
+            : record(l)
+            , args_(std::move(args)...)
+        {}
+
+        void write(std::ostream& os) const override
+        {
+            notstd::for_each(args_, [&os](auto const& arg) { os << arg; });
+        }
+
+        std::tuple<Ts...> args_;
+    };
+
+    template<class...Args>
+    auto make_record(level l, Args const& ...args)
+    {
+        using record_type = deferred_record<decltype(capture_arg(args))...>;
+        return std::unique_ptr<record>(new record_type(l, capture_arg(args)...));
+    }
+}
+
+#define AMY_LOG(which, ...)                                                                   \
+    do {                                                                                      \
+        auto& amy_log_instance_ = ::logging::logger::instance();                              \
+        if (amy_log_instance_.enabled(::logging::level::which))                               \
+            amy_log_instance_.post(::logging::make_record(::logging::level::which, __VA_ARGS__)); \
+    } while (false)
@@ -7,8 +7,9 @@
 #include <amy.hpp>
 #include <mysql/mysql.h>
 
-#include <iostream>
-#include <iomanip>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <boost/format.hpp>
@@ -21,11 +22,18 @@
 #include "proto/test.pb.h"
 #include "proto/proto_storage.pb.h"
 
-#include "base64.hpp"
-
-#include "sql_escaper.hpp"
+#include "query_builder.hpp"
 #include "table_lookup.hpp"
 #include "query_builder.hpp"
+#include "message_store.hpp"
+#include "sharded_store.hpp"
+#include "fake_mysql_server.hpp"
+#include "bulk_loader.hpp"
+#include "storage_plan.hpp"
+#include "field_bytes.hpp"
+#include "typed_rows.hpp"
+#include "metrics.hpp"
+#include "logging.hpp"
 
 using namespace amytest;
 
@@ -55,7 +63,7 @@ private:
     void handle_connect(boost::system::error_code const& error)
     {
         if (error) {
-            std::cout << __func__ << " : " << connector_.error_message(error) << std::endl;
+            AMY_LOG(error, __func__, " : ", connector_.error_message(error));
         }
         else {
             connector_.autocommit(false);
@@ -74,7 +82,7 @@ COMMIT;
 select * from people)__",
                                      "richard",
                                      age, age / 2);
-            std::cout << "query: " << query << std::endl;
+            AMY_LOG(debug, "query: ", query);
             connector_.async_query(query,
                                    [this](auto&& ...args)
                                    {
@@ -86,10 +94,10 @@ select * from people)__",
     void handle_query(boost::system::error_code const& ec)
     {
         if (ec) {
-            std::cout << __func__ << " : " << ec.message() << std::endl;
+            AMY_LOG(error, __func__, " : ", ec.message());
         }
         else {
-            std::cout << "affected rows: " << connector_.affected_rows() << std::endl;
+            AMY_LOG(info, "affected rows: ", connector_.affected_rows());
             connector_.async_store_result([this](auto&& ...args)
                                           {
                                               this->handle_store_result(std::forward<decltype(args)>(args)...);
@@ -102,17 +110,29 @@ select * from people)__",
                              amy::result_set rs)
     {
         if (ec) {
-            std::cout << __func__ << " : " << connector_.error_message(ec) << std::endl;
+            AMY_LOG(error, __func__, " : ", connector_.error_message(ec));
         }
         else {
-            std::cout << "result set: " << rs.affected_rows() << " affected rows:\n";
-            for (auto&& r : rs) {
-                const char *sep = "";
-                for (auto&& f : r) {
-                    std::cout << sep << f.as<std::string>();
-                    sep = ", ";
+            AMY_LOG(info, "result set: ", rs.affected_rows(), " affected rows:");
+            if (logging::logger::instance().enabled(logging::level::info)) {
+                // the statements return differently shaped results, so print the raw text of each cell
+                std::string line;
+                for (auto&& r : rs) {
+                    line.clear();
+                    const char *sep = "";
+                    for (auto&& f : r) {
+                        line += sep;
+                        if (f.is_null()) {
+                            line += "NULL";
+                        }
+                        else {
+                            auto bytes = field_bytes(f);
+                            line.append(bytes.data, bytes.size);
+                        }
+                        sep = ", ";
+                    }
+                    AMY_LOG(info, line);
                 }
-                std::cout << std::endl;
             }
         }
         if (connector_.has_more_results()) {
@@ -132,17 +152,20 @@ struct query_doer
         : con(con)
     {
         con.query("SELECT DATABASE()");
-        auto rs = con.store_result();
-        if (rs.affected_rows() != 1) { throw std::runtime_error("not 1 row for select database()"); }
-        schema = rs[0][0].as<std::string>();
+        schema = single_value<std::string>(con.store_result());
     }
 
     template<class...Ts>
     auto operator ()(const std::string& sql, Ts&& ...ts) const
     {
         auto query = build_query(con, sql, std::forward<Ts>(ts)...);
-        std::cout << "executing:\n" << query << std::endl;
-        con.query(query);
+        AMY_LOG(debug, "executing:\n", query);
+        {
+            AMYTEST_METRIC_STAGE(round_trip);
+            AMYTEST_METRIC_COUNT(bytes_out, query.size());
+            con.query(query);
+        }
+        AMYTEST_METRIC_STAGE(store_result);
         return con.store_result();
     }
 
@@ -155,7 +178,7 @@ WHERE
     `TABLE_SCHEMA` = %1%
 AND `TABLE_NAME` = %2%
 AND `COLUMN_NAME` = %3%)__", schema, table_name, column_name);
-        if (rs.at(0).at(0).as<int>() == 0) {
+        if (single_value<std::int64_t>(rs) == 0) {
             self()(R"__(ALTER TABLE %1% ADD %2% %3%)__",
                    db_name(table_name), db_name(column_name), verbatim(column_def));
             return true;
@@ -180,157 +203,30 @@ AND `COLUMN_NAME` = %3%)__", schema, table_name, column_name);
     table_lookup tbl_lookup { con };
 };
 
-std::string deduce_string_storage(std::int64_t max_length)
+void create_message_table(query_doer& con, table_plan const& table)
 {
-    if (max_length == 0)
-    {
-        return "LONGTEXT";
-    }
-    else if (max_length < 256)
-    {
-        return "VARCHAR(" + std::to_string(max_length) + ")";
-    }
-    else if (max_length < 65536) {
-        return "TEXT";
-    }
-    else {
-        return "LONGTEXT";
-    }
+    auto recorded = con.tbl_lookup.lookup(table.real_name);
+    if (recorded != table.hash_name)
+        throw std::runtime_error("table " + table.real_name + " is recorded as " + recorded
+                                 + ", not " + table.hash_name);
+    AMY_LOG(debug, "executing:\n", table.create_sql);
+    execute(con.con, table.create_sql);
 }
 
-struct member_history
+void build_scheme(query_doer& con, table_plan const& table)
 {
-    using Descriptor = google::protobuf::Descriptor;
-    using FieldDescriptor = google::protobuf::FieldDescriptor;
-
-    member_history(Descriptor const* descriptor)
-            : base(descriptor)
-    {}
-
-    template<class Iter>
-    member_history(Descriptor const* descriptor, Iter first, Iter last)
-            : base(descriptor)
-    , fields { first, last }
-    {}
-
-    member_history& operator+=(FieldDescriptor const* field) {
-        fields.push_back(field);
-        return *this;
-    }
-
-    std::string name() const {
-        std::string myResult = base->full_name();
-        for (auto field : fields)
-        {
-            myResult += ":" + std::to_string(field->number());
-        }
-        return myResult;
-    }
-
-    bool has_parent() const {
-        return not fields.empty();
-    };
-
-    member_history parent() const {
-        auto first = fields.begin();
-        auto last = fields.end();
-        if (last != first) --last;
-        return member_history(base, first, last);
-    }
-
-    google::protobuf::Descriptor const* base;
-    std::vector<::google::protobuf::FieldDescriptor const*> fields;
-};
-
-member_history operator + (member_history l, member_history::FieldDescriptor const* r) {
-    return l += r;
-}
-
-void build_repeated_scheme(query_doer& con,
-                           member_history history)
-{
-    auto this_table_name = history.name();
-}
-
-
-
-void create_message_table(query_doer& con, member_history const& history)
-{
-    query_builder builder(con.escaper);
-    builder.add_component("CREATE TABLE IF NOT EXISTS %s (\n", db_name(con.tbl_lookup.lookup(history.name())));
-    builder.add_component(" __id__ INT NOT NULL AUTO_INCREMENT PRIMARY KEY\n");
-    if (history.has_parent())
-    {
-        builder.add_component(",__parent__ INT NOT NULL\n");
-        builder.add_component(", CONSTRAINT FOREIGN KEY (__parent__)"
-        " REFERENCES %s (__id__)"
-        " ON DELETE CASCADE"
-        " ON UPDATE CASCADE", db_name(con.tbl_lookup.lookup(history.parent().name())));
-    }
-    builder.add_component(")");
-    std::cout << "formatting:\n" << builder.format_str << std::endl;
-    auto query = builder().str();
-    std::cout << "executing:\n" << query << std::endl;
-    execute(con.con, query);
-}
-
-void build_scheme(query_doer& con, member_history const& child)
-{
-    create_message_table(con, child);
+    create_message_table(con, table);
 
+    for (auto&& column : table.columns)
+        con.add_missing_column(table.hash_name, column.name, column.definition);
 
+    for (auto child : table.children)
+        build_scheme(con, *child);
 }
 
 void build_scheme(query_doer& con, google::protobuf::Descriptor const *descriptor)
 {
-    using namespace ::google::protobuf;
-
-    auto table_hash_name = con.tbl_lookup.lookup(descriptor->full_name());
-
-    auto history = member_history(descriptor);
-
-    create_message_table(con, history);
-
-    auto                   nfields = descriptor->field_count();
-
-    for (decltype(nfields) ifield  = 0; ifield < nfields; ++ifield) {
-        auto field = descriptor->field(ifield);
-        std::cout << field->full_name();
-        std::cout << " type: " << field->type() << " - " << field->type_name();
-        std::cout << std::endl;
-        if (field->is_repeated()) {
-            build_repeated_scheme(con, history + field);
-        }
-        else {
-            switch (field->type()) {
-                case FieldDescriptor::TYPE_STRING: {
-                    auto maxLength = field->options().GetExtension(limits::maxLength);
-                    auto storage_def = deduce_string_storage(maxLength);
-                    if (auto oneof = field->containing_oneof()) {
-                        storage_def += " NULL";
-                    }
-                    else {
-                        storage_def += " NOT NULL DEFAULT " + con.enquote(field->default_value_string());
-                    }
-
-                    con.add_missing_column(table_hash_name, std::to_string(field->number()), storage_def);
-                }
-                    break;
-
-                case FieldDescriptor::TYPE_INT32: {
-                    con.add_missing_column(table_hash_name, std::to_string(field->number()), "INT(9) NULL");
-                }
-                    break;
-
-                case FieldDescriptor::TYPE_MESSAGE:
-                    build_scheme(con, history + field);
-                    break;
-                default:
-                    std::cout << "ignored\n";
-            }
-        }
-    }
-
+    build_scheme(con, storage_plan::get(descriptor).root());
 }
 
 void build_scheme(amy::connector& con, const google::protobuf::Descriptor *descriptor)
@@ -339,110 +235,71 @@ void build_scheme(amy::connector& con, const google::protobuf::Descriptor *descr
     build_scheme(helper, descriptor);
 }
 
-void make_blob_store(amy::connector& connection)
-{
-    query_doer helper(connection);
-    execute(connection, R"__(
-CREATE TABLE IF NOT EXISTS `tbl_message_store` (
-  `unique_id` int(11) NOT NULL AUTO_INCREMENT,
-  `message_type` varchar(255) NOT NULL,
-  `binary_data` longblob,
-  `json_data` longtext,
-  PRIMARY KEY (`unique_id`)
-) ENGINE=InnoDB DEFAULT CHARSET=latin1;
-)__");
-}
-
-std::string to_base64(std::string in)
+/// Spread messages over two in-process stand-in servers and read them back
+void sharded_demo()
 {
-    auto        b    = base64();
-    int         len  = b.needed_encoded_length(in.size());
-    std::string result(len, ' ');
-    auto        len2 = b.encode(in.c_str(), in.size(), &result[0]);
-    result.erase(std::strlen(result.c_str()));
-    return result;
-}
-
-std::string to_json(google::protobuf::Message const& message)
-{
-    using namespace google::protobuf;
+    asio::io_service server_ios;
+    auto local = tcp_endpoint(ip_address::from_string("127.0.0.1"), 0);
+    fake_mysql_server first(server_ios, local), second(server_ios, local);
+    first.start();
+    second.start();
+    auto server_thread = std::thread([&server_ios] { server_ios.run(); });
 
-    auto result = std::string();
-    auto status = util::MessageToJsonString(message, &result);
-    if (not status.ok()) {
-        throw std::runtime_error("failed to convert to json: " + status.ToString());
-    }
-    return result;
-
-}
-
-int write_message(amy::connector& conn, ::google::protobuf::Message const& message, bool as_json = false)
-{
-    auto query = std::string();
-    if (as_json) {
-        query = build_query(conn, "INSERT INTO tbl_message_store (message_type, json_data) VALUES(%1%, %2%)",
-                            message.GetDescriptor()->full_name(),
-                            to_json(message));
-
-    }
-    else {
-        query = build_query(conn,
-                            "INSERT INTO tbl_message_store (message_type, binary_data) VALUES(%1%, FROM_BASE64(%2%))",
-                            message.GetDescriptor()->full_name(),
-                            to_base64(message.SerializeAsString()));
+    try {
+        asio::io_service ios;
+        amy::connector   a(ios), b(ios);
+        auto auth_info = amy::auth_info{"test-user", "test-password"};
+        a.connect(first.local_endpoint(), auth_info, "test", amy::default_flags);
+        b.connect(second.local_endpoint(), auth_info, "test", amy::default_flags);
+
+        auto store = sharded_store({a, b});
+        store.init();
+        auto ids = std::vector<sharded_id>();
+        for (int i = 0; i < 8; ++i) {
+            test::BigMessage source;
+            source.set_x("sharded " + std::to_string(i));
+            ids.push_back(store.write_message("customer-" + std::to_string(i), source));
+        }
+        test::BigMessage dest;
+        store.read_message(dest, ids.back());
+        AMY_LOG(info, "sharded read from shard ", sharded_store::shard_of(ids.back()), ": ", dest.ShortDebugString());
+
+        google::protobuf::Arena arena;
+        auto after = sharded_id(0);
+        for (auto page = store.scan(arena, test::BigMessage::default_instance(), after, 3);
+             not page.empty();
+             page = store.scan(arena, test::BigMessage::default_instance(), after, 3)) {
+            for (auto&& entry : page)
+                AMY_LOG(info, "sharded scan ", entry.first, ": ", entry.second->ShortDebugString());
+            after = page.back().first;
+        }
     }
-    std::cout << "executing: " << query << std::endl;
-    auto affected = execute(conn, query);
-    if (not(affected == 1)) {
-        throw std::runtime_error("failed to insert");
+    catch (std::exception const& e) {
+        AMY_LOG(error, "sharded demo: ", e.what());
     }
 
-    execute(conn, "SELECT LAST_INSERT_ID()");
-    auto id = conn.store_result()[0][0].as<int>();
-    return id;
-}
-
-void read_message(amy::connector& conn, ::google::protobuf::Message& message, int id)
-{
-    auto query = build_query(conn,
-                             "SELECT"
-                                 " message_type, binary_data, json_data"
-                                 " FROM tbl_message_store"
-                                 " WHERE unique_id = %1%", id);
-    std::cout << "executing: " << query << std::endl;
-    execute(conn, query);
-    auto rs = conn.store_result();
-    auto&& row = rs.at(0);
-    auto message_type = row.at(0).as<std::string>();
-    if (message_type != message.GetDescriptor()->full_name())
-        throw std::runtime_error("message type mismatch: " + message_type);
-    if (not row.at(1).is_null()) {
-        auto blobdata = row.at(1).as<std::string>();
-        message.ParseFromString(blobdata);
-    }
-    else if (not row.at(2).is_null()) {
-        auto json = row.at(2).as<std::string>();
-        ::google::protobuf::util::JsonStringToMessage(json, &message);
-    }
-    else {
-        throw std::runtime_error("invalid record");
-    }
+    server_ios.stop();
+    server_thread.join();
 }
 
 int main()
 {
+    if (auto level = std::getenv("AMYTEST_LOG_LEVEL"))
+        logging::logger::instance().set_level(logging::parse_level(level, logging::level::info));
+
     auto addr      = tcp_endpoint(ip_address::from_string("127.0.0.1"), 3306);
     auto auth_info = amy::auth_info{"test-user", "test-password"};
 
     asio::io_service ios;
     amy::connector   connection(ios);
-    connection.connect(addr, auth_info, "test", amy::client_multi_statements | amy::client_multi_results);
+    connection.connect(addr, auth_info, "test", amy::client_multi_statements | amy::client_multi_results | amy::client_local_files);
 
     try {
         auto lookup = table_lookup(connection);
         lookup.init();
 
         make_blob_store(connection);
+        message_cache cache(1 << 20);
         auto do_it = [&](auto use_json)
         {
             test::BigMessage source;
@@ -456,31 +313,65 @@ int main()
             auto             id = write_message(connection, source, use_json);
             test::BigMessage dest;
             read_message(connection, dest, id);
-            std::cout << source.ShortDebugString() << std::endl;
-            std::cout << dest.ShortDebugString() << std::endl;
+            AMY_LOG(info, source.ShortDebugString());
+            AMY_LOG(info, dest.ShortDebugString());
+
+            AMY_LOG(info, "same? ", (source.ShortDebugString() == dest.ShortDebugString() ? "true" : "false"));
 
-            std::cout << std::boolalpha << "same? " << (source.ShortDebugString() == dest.ShortDebugString())
-                      << std::endl;
+            google::protobuf::Arena arena;
+            auto batch = read_messages<test::BigMessage>(connection, arena, {id, id});
+            AMY_LOG(info, "arena read: ", batch.at(1)->ShortDebugString());
+
+            auto cached_id = write_message(connection, cache, source, use_json);
+            for (auto i = 0; i < 3; ++i) {
+                read_message<test::BigMessage>(connection, cache, cached_id);
+                read_message<test::BigMessage>(connection, cache, id);
+            }
+            AMY_LOG(info, "message cache: ", cache.stats());
         };
         do_it(true);
         do_it(false);
 
+        {
+            google::protobuf::Arena arena;
+            auto found = find_messages(connection, arena, test::BigMessage::default_instance(), "y.a", "value for a");
+            AMY_LOG(info, "indexed lookup of y.a: ", found.size(), " messages");
+        }
+
+        auto remaining = 1000;
+        auto stats     = bulk_load_messages(connection, [&](serialized_message& message)
+        {
+            if (remaining-- == 0)
+                return false;
+            test::BigMessage source;
+            source.set_x("bulk " + std::to_string(remaining));
+            message.message_type = source.GetDescriptor()->full_name();
+            source.SerializeToString(&message.payload);
+            return true;
+        });
+        AMY_LOG(info, "bulk load: ", stats);
+
         build_scheme(connection, test::BigMessage::descriptor());
     }
     catch (AMY_SYSTEM_NS::system_error const& se) {
         auto&& category = se.code().category();
         if (category == amy::error::get_client_category()) {
-            std::cerr << connection.error_message(se.code());
+            AMY_LOG(error, connection.error_message(se.code()));
         }
         else {
-            std::cerr << se.code().message() << std::endl;
+            AMY_LOG(error, se.code().message());
         }
     }
 
 
+    sharded_demo();
+
     perform_test tester{ios};
     tester.start();
     ios.run();
 
-
+    std::ostringstream report;
+    metrics::dump(report, metrics::take_snapshot());
+    AMY_LOG(info, logging::whole { report.str() });
+    logging::logger::instance().flush();
 }
\ No newline at end of file
@@ -0,0 +1,57 @@
+//
+// Created by Richard Hodges on 27/04/2017.
+//
+
+#pragma once
+
+#include <google/protobuf/descriptor.h>
+#include <string>
+#include <vector>
+
+struct member_history
+{
+    using Descriptor = google::protobuf::Descriptor;
+    using FieldDescriptor = google::protobuf::FieldDescriptor;
+
+    member_history(Descriptor const* descriptor)
+            : base(descriptor)
+    {}
+
+    template<class Iter>
+    member_history(Descriptor const* descriptor, Iter first, Iter last)
+            : base(descriptor)
+    , fields { first, last }
+    {}
+
+    member_history& operator+=(FieldDescriptor const* field) {
+        fields.push_back(field);
+        return *this;
+    }
+
+    std::string name() const {
+        std::string myResult = base->full_name();
+        for (auto field : fields)
+        {
+            myResult += ":" + std::to_string(field->number());
+        }
+        return myResult;
+    }
+
+    bool has_parent() const {
+        return not fields.empty();
+    };
+
+    member_history parent() const {
+        auto first = fields.begin();
+        auto last = fields.end();
+        if (last != first) --last;
+        return member_history(base, first, last);
+    }
+
+    google::protobuf::Descriptor const* base;
+    std::vector<::google::protobuf::FieldDescriptor const*> fields;
+};
+
+inline member_history operator + (member_history l, member_history::FieldDescriptor const* r) {
+    return l += r;
+}
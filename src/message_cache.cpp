@@ -0,0 +1,163 @@
+//
+// Created by Richard Hodges on 05/05/2017.
+//
+
+#include "message_cache.hpp"
+
+#include <functional>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+
+struct message_cache::shard
+{
+    struct key
+    {
+        bool operator==(key const& other) const { return id == other.id and type == other.type; }
+
+        int id;
+        ::google::protobuf::Descriptor const *type;
+    };
+
+    struct key_hash
+    {
+        std::size_t operator()(key const& k) const
+        {
+            return std::hash<int>()(k.id) * 31 + std::hash<void const *>()(k.type);
+        }
+    };
+
+    struct entry
+    {
+        key k;
+        message_ptr message;
+        std::size_t cost;
+    };
+
+    using entry_list = std::list<entry>;
+
+    explicit shard(std::size_t budget) : budget(budget) {}
+
+    // call with the mutex held
+    void remove(entry_list::iterator pos)
+    {
+        bytes -= pos->cost;
+        index.erase(pos->k);
+        lru.erase(pos);
+    }
+
+    mutable std::mutex mutex;
+    entry_list lru;     // most recently used first
+    std::unordered_map<key, entry_list::iterator, key_hash> index;
+    std::size_t const budget;
+    std::size_t bytes = 0;
+    message_cache_stats counters;
+};
+
+message_cache::message_cache(std::size_t budget_bytes, std::size_t shard_count)
+    : budget_(budget_bytes)
+{
+    if (shard_count == 0)
+        throw std::invalid_argument("message_cache needs at least one shard");
+    shards_.reserve(shard_count);
+    for (std::size_t i = 0; i < shard_count; ++i)
+        shards_.push_back(std::make_unique<shard>(budget_bytes / shard_count));
+}
+
+message_cache::~message_cache() = default;
+
+auto message_cache::shard_for(int id) const -> shard&
+{
+    // ids are sequential, so mix them before picking a shard
+    auto mixed = std::uint32_t(id) * 0x9E3779B1u;
+    return *shards_[(mixed >> 16) % shards_.size()];
+}
+
+auto message_cache::find(int id, ::google::protobuf::Descriptor const *type) -> message_ptr
+{
+    auto& s = shard_for(id);
+    auto lock = std::unique_lock<std::mutex>(s.mutex);
+    auto ifind = s.index.find({ id, type });
+    if (ifind == s.index.end()) {
+        ++s.counters.misses;
+        return nullptr;
+    }
+    ++s.counters.hits;
+    s.lru.splice(s.lru.begin(), s.lru, ifind->second);
+    return ifind->second->message;
+}
+
+void message_cache::insert(int id, message_ptr message)
+{
+    auto k = shard::key { id, message->GetDescriptor() };
+    auto cost = message->SpaceUsedLong();
+
+    auto& s = shard_for(id);
+    auto lock = std::unique_lock<std::mutex>(s.mutex);
+    auto ifind = s.index.find(k);
+    if (ifind != s.index.end())
+        s.remove(ifind->second);
+    if (cost > s.budget)
+        return;
+
+    s.lru.push_front({ k, std::move(message), cost });
+    s.index.emplace(k, s.lru.begin());
+    s.bytes += cost;
+    ++s.counters.insertions;
+
+    while (s.bytes > s.budget) {
+        s.remove(std::prev(s.lru.end()));
+        ++s.counters.evictions;
+    }
+}
+
+void message_cache::erase(int id, ::google::protobuf::Descriptor const *type)
+{
+    auto& s = shard_for(id);
+    auto lock = std::unique_lock<std::mutex>(s.mutex);
+    auto ifind = s.index.find({ id, type });
+    if (ifind != s.index.end()) {
+        s.remove(ifind->second);
+        ++s.counters.invalidations;
+    }
+}
+
+void message_cache::clear()
+{
+    for (auto&& s : shards_) {
+        auto lock = std::unique_lock<std::mutex>(s->mutex);
+        s->index.clear();
+        s->lru.clear();
+        s->bytes = 0;
+    }
+}
+
+message_cache_stats message_cache::stats() const
+{
+    auto result = message_cache_stats();
+    for (auto&& s : shards_) {
+        auto lock = std::unique_lock<std::mutex>(s->mutex);
+        result.hits += s->counters.hits;
+        result.misses += s->counters.misses;
+        result.insertions += s->counters.insertions;
+        result.evictions += s->counters.evictions;
+        result.invalidations += s->counters.invalidations;
+        result.entries += s->index.size();
+        result.bytes += s->bytes;
+    }
+    return result;
+}
+
+std::ostream& operator<<(std::ostream& os, message_cache_stats const& stats)
+{
+    return os << stats.entries << " entries, "
+              << stats.bytes << " bytes, "
+              << stats.hits << " hits, "
+              << stats.misses << " misses, "
+              << stats.insertions << " insertions, "
+              << stats.evictions << " evictions, "
+              << stats.invalidations << " invalidations";
+}
@@ -0,0 +1,67 @@
+//
+// Created by Richard Hodges on 05/05/2017.
+//
+
+#pragma once
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <vector>
+
+struct message_cache_stats
+{
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t insertions = 0;
+    std::uint64_t evictions = 0;
+    std::uint64_t invalidations = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+};
+
+std::ostream& operator<<(std::ostream& os, message_cache_stats const& stats);
+
+/// A bounded cache of decoded messages, keyed by unique_id and message type.
+///
+/// Values are immutable and shared, so a hit costs a lock, a hash lookup and a reference count; readers keep
+/// their message alive even if it is evicted. The budget is measured with Message::SpaceUsedLong() and split
+/// evenly over the shards, each of which is an LRU list under its own mutex.
+struct message_cache
+{
+    using message_ptr = std::shared_ptr<const ::google::protobuf::Message>;
+
+    explicit message_cache(std::size_t budget_bytes, std::size_t shard_count = 16);
+
+    message_cache(message_cache const&) = delete;
+
+    message_cache& operator=(message_cache const&) = delete;
+
+    ~message_cache();
+
+    /// nullptr on a miss
+    message_ptr find(int id, ::google::protobuf::Descriptor const *type);
+
+    /// Add or replace. Messages larger than a shard's budget are not cached
+    void insert(int id, message_ptr message);
+
+    /// Forget a message which has been changed or deleted in the store
+    void erase(int id, ::google::protobuf::Descriptor const *type);
+
+    void clear();
+
+    std::size_t budget() const { return budget_; }
+
+    message_cache_stats stats() const;
+
+private:
+    struct shard;
+
+    shard& shard_for(int id) const;
+
+    std::size_t budget_;
+    std::vector<std::unique_ptr<shard>> shards_;
+};
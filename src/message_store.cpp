@@ -0,0 +1,388 @@
+//
+// Created by Richard Hodges on 24/04/2017.
+//
+
+#include "message_store.hpp"
+#include "base64.hpp"
+#include "query_builder.hpp"
+#include "typed_rows.hpp"
+#include "type_dictionary.hpp"
+#include "field_index.hpp"
+#include "json_codec.hpp"
+#include "metrics.hpp"
+#include "logging.hpp"
+
+#include <mysql/mysql.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+    const char insert_binary_template[] =
+        "INSERT INTO tbl_message_store (type_id, binary_data) VALUES(%1%, FROM_BASE64(%2%))";
+    const char insert_json_template[] =
+        "INSERT INTO tbl_message_store (type_id, json_data) VALUES(%1%, %2%)";
+    const char select_one_template[] =
+        "SELECT"
+            " type_id, binary_data, json_data"
+            " FROM tbl_message_store"
+            " WHERE unique_id = %1%";
+    const char select_many_template[] =
+        "SELECT"
+            " unique_id, type_id, binary_data, json_data"
+            " FROM tbl_message_store"
+            " WHERE unique_id IN (%1%)";
+    const char scan_template[] =
+        "SELECT"
+            " unique_id, type_id, binary_data, json_data"
+            " FROM tbl_message_store"
+            " WHERE type_id = %1% AND unique_id >= %2%"
+            " ORDER BY unique_id LIMIT %3%";
+    const char last_insert_id_query[] = "SELECT LAST_INSERT_ID()";
+
+    std::uint64_t timed_execute(amy::connector& conn, std::string const& query, const char *query_template)
+    {
+        AMYTEST_METRIC_COUNT(bytes_out, query.size());
+        AMYTEST_METRIC_QUERY(query_template);
+        return execute(conn, query);
+    }
+
+    amy::result_set timed_store_result(amy::connector& conn)
+    {
+        AMYTEST_METRIC_STAGE(store_result);
+        auto rs = conn.store_result();
+        AMYTEST_METRIC_COUNT(rows, rs.size());
+        return rs;
+    }
+
+    bool has_store_column(amy::connector& conn, const char *column)
+    {
+        conn.query(build_query(conn, R"__(SELECT COUNT(*)
+FROM `information_schema`.`COLUMNS`
+WHERE
+    `TABLE_SCHEMA` = DATABASE()
+AND `TABLE_NAME` = 'tbl_message_store'
+AND `COLUMN_NAME` = %1%)__", std::string(column)));
+        return single_value<std::int64_t>(conn.store_result()) != 0;
+    }
+
+    using optional_bytes = boost::optional<boost::string_view>;
+
+    using type_id = type_dictionary::type_id;
+
+    void parse_one(amy::result_set const& rs, ::google::protobuf::Message& message)
+    {
+        auto row = typed_rows<type_id, optional_bytes, optional_bytes>(rs).at(0);
+        parse_stored(std::get<0>(row), std::get<1>(row), std::get<2>(row), message);
+    }
+}
+
+void parse_stored(type_dictionary::type_id type,
+                  boost::optional<boost::string_view> blob,
+                  boost::optional<boost::string_view> json,
+                  ::google::protobuf::Message& message)
+{
+    auto&& expected = message.GetDescriptor()->full_name();
+    if (type != type_dictionary::id_for(message.GetDescriptor()))
+        throw std::runtime_error("message type mismatch: stored type id " + std::to_string(type)
+                                 + " is not " + expected);
+
+    AMYTEST_METRIC_STAGE(parse);
+    if (blob) {
+        AMYTEST_METRIC_COUNT(bytes_in, blob->size());
+        if (not message.ParseFromArray(blob->data(), int(blob->size())))
+            throw std::runtime_error("failed to parse " + expected);
+    }
+    else if (json) {
+        AMYTEST_METRIC_COUNT(bytes_in, json->size());
+        json_codec::instance().parse(json->data(), json->size(), message);
+    }
+    else {
+        throw std::runtime_error("invalid record");
+    }
+}
+
+void make_blob_store(amy::connector& connection)
+{
+    type_dictionary(connection).init();
+    make_field_index(connection);
+    execute(connection, R"__(
+CREATE TABLE IF NOT EXISTS `tbl_message_store` (
+  `unique_id` int(11) NOT NULL AUTO_INCREMENT,
+  `type_id` int(10) unsigned NOT NULL,
+  `binary_data` longblob,
+  `json_data` longtext,
+  PRIMARY KEY (`unique_id`),
+  KEY `type_unique_id` (`type_id`, `unique_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+)__");
+    migrate_blob_store(connection);
+}
+
+bool migrate_blob_store(amy::connector& connection)
+{
+    if (not has_store_column(connection, "message_type"))
+        return false;
+
+    // every step can be repeated, so a migration interrupted part way through resumes where it stopped
+    auto dictionary = type_dictionary(connection);
+    dictionary.init();
+    if (not has_store_column(connection, "type_id"))
+        execute(connection, "ALTER TABLE tbl_message_store ADD COLUMN `type_id` int(10) unsigned NOT NULL DEFAULT 0");
+
+    connection.query("SELECT DISTINCT message_type FROM tbl_message_store WHERE type_id = 0");
+    auto rs = connection.store_result();
+    for (auto&& row : typed_rows<boost::string_view>(rs)) {
+        auto name = std::get<0>(row).to_string();
+        auto id = dictionary.lookup(name);
+        execute(connection, build_query(connection,
+                                        "UPDATE tbl_message_store SET type_id = %1%"
+                                            " WHERE message_type = %2% AND type_id = 0",
+                                        id, name));
+    }
+
+    connection.query("SELECT COUNT(*) FROM tbl_message_store WHERE type_id = 0");
+    auto unconverted = single_value<std::int64_t>(connection.store_result());
+    if (unconverted)
+        throw std::runtime_error("cannot finish migrating tbl_message_store: " + std::to_string(unconverted)
+                                 + " rows still have no type_id");
+
+    execute(connection, "ALTER TABLE tbl_message_store"
+        " DROP COLUMN `message_type`,"
+        " ADD KEY `type_unique_id` (`type_id`, `unique_id`)");
+    return true;
+}
+
+std::string to_base64(std::string in)
+{
+    AMYTEST_METRIC_STAGE(base64);
+    auto        b    = base64();
+    int         len  = b.needed_encoded_length(in.size());
+    std::string result(len, ' ');
+    b.encode(in.c_str(), in.size(), &result[0]);
+    result.erase(std::strlen(result.c_str()));
+    return result;
+}
+
+std::string to_json(google::protobuf::Message const& message)
+{
+    auto result = std::string();
+    json_codec::instance().append(message, result);
+    return result;
+}
+
+int write_message(amy::connector& conn, ::google::protobuf::Message const& message, bool as_json)
+{
+    auto type = type_dictionary(conn).lookup(message.GetDescriptor());
+    auto query = std::string();
+    auto query_template = as_json ? insert_json_template : insert_binary_template;
+    if (as_json) {
+        // the json is escaped straight into the query as it is generated
+        AMYTEST_METRIC_STAGE(format);
+        query = "INSERT INTO tbl_message_store (type_id, json_data) VALUES(";
+        query += std::to_string(type);
+        query += ", '";
+        json_codec::instance().append_escaped(conn, message, query);
+        query += "')";
+    }
+    else {
+        auto binary = std::string();
+        {
+            AMYTEST_METRIC_STAGE(serialize);
+            binary = message.SerializeAsString();
+        }
+        query = build_query(conn, insert_binary_template,
+                            type,
+                            to_base64(std::move(binary)));
+    }
+
+    // a message must not be stored without its index rows, or find_messages() could never return it.
+    // START TRANSACTION would commit a transaction the caller has open, so within one use a savepoint.
+    auto indexed = not indexed_fields(message.GetDescriptor()).empty();
+    auto nested = indexed and (conn.native()->server_status & SERVER_STATUS_IN_TRANS);
+    if (indexed)
+        execute(conn, nested ? "SAVEPOINT write_message" : "START TRANSACTION");
+    try {
+        AMY_LOG(debug, "executing: ", query);
+        auto affected = timed_execute(conn, query, query_template);
+        if (not(affected == 1)) {
+            throw std::runtime_error("failed to insert");
+        }
+
+        timed_execute(conn, last_insert_id_query, last_insert_id_query);
+        auto id = single_value<int>(timed_store_result(conn));
+        if (indexed) {
+            index_message(conn, id, message);
+            execute(conn, nested ? "RELEASE SAVEPOINT write_message" : "COMMIT");
+        }
+        return id;
+    }
+    catch (...) {
+        if (indexed) {
+            try {
+                execute(conn, nested ? "ROLLBACK TO SAVEPOINT write_message" : "ROLLBACK");
+            }
+            catch (...) {
+                // the original error is the one worth reporting
+            }
+        }
+        throw;
+    }
+}
+
+void read_message(amy::connector& conn, ::google::protobuf::Message& message, int id)
+{
+    auto query = build_query(conn, select_one_template, id);
+    AMY_LOG(debug, "executing: ", query);
+    timed_execute(conn, query, select_one_template);
+    auto rs = timed_store_result(conn);
+    parse_one(rs, message);
+}
+
+int write_message(amy::connector& conn, message_cache& cache,
+                  ::google::protobuf::Message const& message, bool as_json)
+{
+    auto id = write_message(conn, message, as_json);
+    auto copy = std::shared_ptr<::google::protobuf::Message>(message.New());
+    copy->CopyFrom(message);
+    cache.insert(id, std::move(copy));
+    return id;
+}
+
+message_cache::message_ptr read_message(amy::connector& conn, message_cache& cache,
+                                        ::google::protobuf::Message const& prototype, int id)
+{
+    if (auto cached = cache.find(id, prototype.GetDescriptor()))
+        return cached;
+    auto message = std::shared_ptr<::google::protobuf::Message>(prototype.New());
+    read_message(conn, *message, id);
+    cache.insert(id, message);
+    return message;
+}
+
+::google::protobuf::Message* read_message(amy::connector& conn,
+                                          ::google::protobuf::Arena& arena,
+                                          ::google::protobuf::Message const& prototype,
+                                          int id)
+{
+    auto query = build_query(conn, select_one_template, id);
+    AMY_LOG(debug, "executing: ", query);
+    timed_execute(conn, query, select_one_template);
+    auto rs = timed_store_result(conn);
+    auto message = prototype.New(&arena);
+    parse_one(rs, *message);
+    return message;
+}
+
+namespace {
+
+    /// read_messages(). With `this_type_only`, rows of other types are left as nullptr instead of throwing
+    std::vector<::google::protobuf::Message*> read_by_ids(amy::connector& conn,
+                                                          ::google::protobuf::Arena& arena,
+                                                          ::google::protobuf::Message const& prototype,
+                                                          std::vector<int> const& ids,
+                                                          bool this_type_only)
+    {
+        auto result = std::vector<::google::protobuf::Message*>(ids.size(), nullptr);
+        if (ids.empty())
+            return result;
+
+        auto query = std::string("SELECT"
+                                     " unique_id, type_id, binary_data, json_data"
+                                     " FROM tbl_message_store"
+                                     " WHERE unique_id IN (");
+        auto position = std::unordered_map<int, std::vector<std::size_t>>();
+        position.reserve(ids.size());
+        for (std::size_t i = 0; i < ids.size(); ++i) {
+            auto& slots = position[ids[i]];
+            if (slots.empty()) {
+                if (i) query += ',';
+                query += std::to_string(ids[i]);
+            }
+            slots.push_back(i);
+        }
+        query += ')';
+        if (this_type_only)
+            query += " AND type_id = " + std::to_string(type_dictionary::id_for(prototype.GetDescriptor()));
+
+        AMY_LOG(debug, "executing: ", query);
+        timed_execute(conn, query, select_many_template);
+        auto rs = timed_store_result(conn);
+        typed_rows<int, type_id, optional_bytes, optional_bytes>(rs).for_each(
+            [&](int id, type_id type, optional_bytes blob, optional_bytes json)
+            {
+                auto message = prototype.New(&arena);
+                parse_stored(type, blob, json, *message);
+                for (auto i : position.at(id))
+                    result[i] = message;
+            });
+        return result;
+    }
+}
+
+std::vector<::google::protobuf::Message*> read_messages(amy::connector& conn,
+                                                        ::google::protobuf::Arena& arena,
+                                                        ::google::protobuf::Message const& prototype,
+                                                        std::vector<int> const& ids)
+{
+    return read_by_ids(conn, arena, prototype, ids, false);
+}
+
+std::vector<std::pair<int, ::google::protobuf::Message*>> scan_messages(amy::connector& conn,
+                                                                        ::google::protobuf::Arena& arena,
+                                                                        ::google::protobuf::Message const& prototype,
+                                                                        int first_id,
+                                                                        std::size_t limit)
+{
+    auto result = std::vector<std::pair<int, ::google::protobuf::Message*>>();
+    if (limit == 0)
+        return result;
+
+    auto rs = scan_rows(conn, type_dictionary::id_for(prototype.GetDescriptor()), first_id, limit);
+    result.reserve(rs.size());
+    typed_rows<int, type_id, optional_bytes, optional_bytes>(rs).for_each(
+        [&](int id, type_id type, optional_bytes blob, optional_bytes json)
+        {
+            auto message = prototype.New(&arena);
+            parse_stored(type, blob, json, *message);
+            result.emplace_back(id, message);
+        });
+    return result;
+}
+
+amy::result_set scan_rows(amy::connector& conn, type_dictionary::type_id type, int first_id, std::size_t limit)
+{
+    auto query = build_query(conn, scan_template, type, first_id, limit);
+    AMY_LOG(debug, "executing: ", query);
+    timed_execute(conn, query, scan_template);
+    return timed_store_result(conn);
+}
+
+std::vector<std::pair<int, ::google::protobuf::Message*>> find_messages(amy::connector& conn,
+                                                                        ::google::protobuf::Arena& arena,
+                                                                        ::google::protobuf::Message const& prototype,
+                                                                        std::string const& field_path,
+                                                                        std::string const& value)
+{
+    auto&& field = find_indexed_field(prototype.GetDescriptor(), field_path);
+    auto ids = lookup_index(conn, field, value);
+
+    // a field of another type may share the field id, so its messages are skipped rather than parsed
+    auto messages = read_by_ids(conn, arena, prototype, ids, true);
+
+    // the index holds a prefix of long values, so check the real ones
+    auto result = std::vector<std::pair<int, ::google::protobuf::Message*>>();
+    result.reserve(ids.size());
+    auto values = std::vector<std::string>();
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        if (not messages[i])
+            continue;
+        values.clear();
+        extract_index_values(*messages[i], field, values);
+        if (std::find(values.begin(), values.end(), value) != values.end())
+            result.emplace_back(ids[i], messages[i]);
+    }
+    return result;
+}
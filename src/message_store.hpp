@@ -0,0 +1,108 @@
+//
+// Created by Richard Hodges on 24/04/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include "message_cache.hpp"
+#include "type_dictionary.hpp"
+#include <amy.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/message.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Create tbl_message_store, the message type dictionary and the field index, migrating a tbl_message_store
+/// created by an earlier version
+void make_blob_store(amy::connector& connection);
+
+/// Convert a tbl_message_store created before type ids were introduced: add type_id, fill it in from the
+/// message_type names (recording them in the dictionary), then drop message_type. This rewrites the table.
+/// Safe to run again after an interruption: only rows still without a type_id are converted, and
+/// message_type is dropped only once every row has one. Returns false if there was nothing to do.
+bool migrate_blob_store(amy::connector& connection);
+
+/// Decode the type_id, binary_data and json_data columns of a tbl_message_store row into `message`.
+/// Throws std::runtime_error if the row holds a different type or cannot be parsed.
+void parse_stored(type_dictionary::type_id type,
+                  boost::optional<boost::string_view> blob,
+                  boost::optional<boost::string_view> json,
+                  ::google::protobuf::Message& message);
+
+std::string to_base64(std::string in);
+
+std::string to_json(google::protobuf::Message const& message);
+
+/// Store a message and return its unique_id. A type with indexed fields is stored and indexed in one
+/// transaction, or under a savepoint when a transaction is already open on `conn`.
+int write_message(amy::connector& conn, ::google::protobuf::Message const& message, bool as_json = false);
+
+void read_message(amy::connector& conn, ::google::protobuf::Message& message, int id);
+
+/// Write, then put a copy of `message` in `cache` under its new id
+int write_message(amy::connector& conn, message_cache& cache,
+                  ::google::protobuf::Message const& message, bool as_json = false);
+
+/// Read through `cache`. The result is shared with the cache and must not be modified.
+message_cache::message_ptr read_message(amy::connector& conn, message_cache& cache,
+                                        ::google::protobuf::Message const& prototype, int id);
+
+template<class Message>
+std::shared_ptr<const Message> read_message(amy::connector& conn, message_cache& cache, int id)
+{
+    return std::static_pointer_cast<const Message>(read_message(conn, cache, Message::default_instance(), id));
+}
+
+/// Read a message whose sub-objects are allocated on `arena`, parsing straight from the row buffer.
+/// The result is owned by the arena. `prototype` supplies the type.
+::google::protobuf::Message* read_message(amy::connector& conn,
+                                          ::google::protobuf::Arena& arena,
+                                          ::google::protobuf::Message const& prototype,
+                                          int id);
+
+/// Multi-get onto a single arena in one round trip. Results are in the order of `ids`;
+/// ids that are not in the store yield nullptr.
+std::vector<::google::protobuf::Message*> read_messages(amy::connector& conn,
+                                                        ::google::protobuf::Arena& arena,
+                                                        ::google::protobuf::Message const& prototype,
+                                                        std::vector<int> const& ids);
+
+/// Up to `limit` messages of the prototype's type with unique_id >= first_id, in id order, onto `arena`
+std::vector<std::pair<int, ::google::protobuf::Message*>> scan_messages(amy::connector& conn,
+                                                                        ::google::protobuf::Arena& arena,
+                                                                        ::google::protobuf::Message const& prototype,
+                                                                        int first_id,
+                                                                        std::size_t limit);
+
+/// The rows scan_messages() parses, left unparsed: unique_id, type_id, binary_data and json_data, in id order.
+/// For a caller which fetches more rows than it keeps; decode the kept ones with parse_stored().
+amy::result_set scan_rows(amy::connector& conn, type_dictionary::type_id type, int first_id, std::size_t limit);
+
+/// Messages of the prototype's type whose indexed field `field_path` (e.g. "y.a") has `value`, in id order,
+/// onto `arena`. Throws std::invalid_argument if the field does not carry (limits.index).
+std::vector<std::pair<int, ::google::protobuf::Message*>> find_messages(amy::connector& conn,
+                                                                        ::google::protobuf::Arena& arena,
+                                                                        ::google::protobuf::Message const& prototype,
+                                                                        std::string const& field_path,
+                                                                        std::string const& value);
+
+template<class Message>
+Message* read_message(amy::connector& conn, ::google::protobuf::Arena& arena, int id)
+{
+    return static_cast<Message*>(read_message(conn, arena, Message::default_instance(), id));
+}
+
+template<class Message>
+std::vector<Message*> read_messages(amy::connector& conn, ::google::protobuf::Arena& arena, std::vector<int> const& ids)
+{
+    auto messages = read_messages(conn, arena, Message::default_instance(), ids);
+    auto result = std::vector<Message*>();
+    result.reserve(messages.size());
+    for (auto message : messages)
+        result.push_back(static_cast<Message*>(message));
+    return result;
+}
@@ -0,0 +1,337 @@
+//
+// Created by Richard Hodges on 01/05/2017.
+//
+
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+
+namespace metrics {
+
+    namespace {
+
+        /// Enough for every query template in the project. Further templates are folded into the last slot.
+        constexpr std::size_t template_slots = 32;
+
+        struct template_slot
+        {
+            std::atomic<const char *> key { nullptr };
+            latency_histogram histogram;
+        };
+
+        struct thread_metrics
+        {
+            latency_histogram& for_template(const char *query_template)
+            {
+                for (auto& slot : templates) {
+                    auto key = slot.key.load(std::memory_order_relaxed);
+                    if (key == query_template)
+                        return slot.histogram;
+                    if (key == nullptr) {
+                        slot.key.store(query_template, std::memory_order_release);
+                        return slot.histogram;
+                    }
+                }
+                overflowed.store(true, std::memory_order_relaxed);
+                return templates.back().histogram;
+            }
+
+            std::array<latency_histogram, stage_count> stages;
+            std::array<std::atomic<std::uint64_t>, counter_count> counters {};
+            std::array<template_slot, template_slots> templates;
+            std::atomic<bool> overflowed { false };
+        };
+
+        struct registry
+        {
+            std::shared_ptr<thread_metrics> enrol()
+            {
+                auto metrics = std::make_shared<thread_metrics>();
+                auto lock = std::unique_lock<std::mutex>(mutex_);
+                threads_.push_back(metrics);
+                return metrics;
+            }
+
+            std::vector<std::shared_ptr<thread_metrics>> threads()
+            {
+                auto lock = std::unique_lock<std::mutex>(mutex_);
+                return threads_;
+            }
+
+            std::mutex mutex_;
+
+            // kept after the owning thread exits so that its measurements are not lost
+            std::vector<std::shared_ptr<thread_metrics>> threads_;
+        };
+
+        registry& get_registry()
+        {
+            // never destroyed: operator new may still count into a thread's slot during static destruction
+            static registry& r = *new registry;
+            return r;
+        }
+
+        thread_local bool enrolling = false;
+
+        std::shared_ptr<thread_metrics> enrol_this_thread()
+        {
+            enrolling = true;
+            auto metrics = get_registry().enrol();
+            enrolling = false;
+            return metrics;
+        }
+
+        thread_metrics& this_thread()
+        {
+            thread_local auto metrics = enrol_this_thread();
+            return *metrics;
+        }
+
+        thread_local std::atomic<std::uint64_t> *allocation_slot = nullptr;
+
+        /// Called from operator new. Enrolling the thread allocates, so those allocations go uncounted
+        /// rather than recursing.
+        void count_allocation()
+        {
+            if (enrolling)
+                return;
+            if (not allocation_slot)
+                allocation_slot = &this_thread().counters[std::size_t(counter::allocations)];
+            allocation_slot->store(allocation_slot->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+        int highest_bit(std::uint64_t value)
+        {
+            int bit = 0;
+            while (value >>= 1) ++bit;
+            return bit;
+        }
+    }
+
+    const char *name(stage s)
+    {
+        static const char *const names[] = {
+            "serialize", "base64", "escape", "format", "round_trip", "store_result", "parse"
+        };
+        return names[std::size_t(s)];
+    }
+
+    const char *name(counter c)
+    {
+        static const char *const names[] = {
+            "bytes_out", "bytes_in", "rows", "allocations"
+        };
+        return names[std::size_t(c)];
+    }
+
+    int histogram_layout::bucket_for(std::uint64_t value)
+    {
+        if (value < sub_bucket_count)
+            return int(value);
+        auto magnitude = highest_bit(value) - sub_bucket_bits + 1;
+        auto sub = int(value >> (magnitude - 1)) & (sub_bucket_count - 1);
+        auto bucket = magnitude * sub_bucket_count + sub;
+        return std::min(bucket, bucket_count - 1);
+    }
+
+    std::uint64_t histogram_layout::upper_bound(int bucket)
+    {
+        auto magnitude = bucket / sub_bucket_count;
+        auto sub = std::uint64_t(bucket % sub_bucket_count);
+        if (magnitude == 0)
+            return sub;
+        auto base = std::uint64_t(1) << (magnitude + sub_bucket_bits - 1);
+        auto width = std::uint64_t(1) << (magnitude - 1);
+        return base + (sub + 1) * width - 1;
+    }
+
+    void histogram_snapshot::record(std::uint64_t value, std::uint64_t n)
+    {
+        buckets_[histogram_layout::bucket_for(value)] += n;
+        count_ += n;
+        sum_ += value * n;
+        max_ = std::max(max_, value);
+    }
+
+    histogram_snapshot& histogram_snapshot::operator+=(histogram_snapshot const& other)
+    {
+        for (std::size_t i = 0; i < buckets_.size(); ++i)
+            buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+        return *this;
+    }
+
+    std::uint64_t histogram_snapshot::percentile(double p) const
+    {
+        if (count_ == 0)
+            return 0;
+        auto wanted = std::uint64_t(p / 100.0 * count_ + 0.5);
+        wanted = std::max<std::uint64_t>(1, std::min(wanted, count_));
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < buckets_.size(); ++i) {
+            seen += buckets_[i];
+            if (seen >= wanted)
+                return std::min(histogram_layout::upper_bound(int(i)), max_);
+        }
+        return max_;
+    }
+
+    void latency_histogram::copy_to(histogram_snapshot& target) const
+    {
+        histogram_snapshot copy;
+        for (std::size_t i = 0; i < buckets_.size(); ++i)
+            copy.buckets_[i] = buckets_[i].load(std::memory_order_relaxed);
+        copy.count_ = count_.load(std::memory_order_relaxed);
+        copy.sum_ = sum_.load(std::memory_order_relaxed);
+        copy.max_ = max_.load(std::memory_order_relaxed);
+        target += copy;
+    }
+
+    void record(stage s, std::chrono::nanoseconds elapsed)
+    {
+        this_thread().stages[std::size_t(s)].record(elapsed);
+    }
+
+    void record(const char *query_template, std::chrono::nanoseconds elapsed)
+    {
+        this_thread().for_template(query_template).record(elapsed);
+    }
+
+    void add(counter c, std::uint64_t n)
+    {
+        auto& a = this_thread().counters[std::size_t(c)];
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    std::uint64_t thread_allocations()
+    {
+        return this_thread().counters[std::size_t(counter::allocations)].load(std::memory_order_relaxed);
+    }
+
+    snapshot take_snapshot()
+    {
+        snapshot result;
+        for (auto&& thread : get_registry().threads()) {
+            for (std::size_t i = 0; i < stage_count; ++i)
+                thread->stages[i].copy_to(result.stages[i]);
+            for (std::size_t i = 0; i < counter_count; ++i)
+                result.counters[i] += thread->counters[i].load(std::memory_order_relaxed);
+            for (auto&& slot : thread->templates) {
+                auto key = slot.key.load(std::memory_order_acquire);
+                if (not key)
+                    break;
+                auto ifind = std::find_if(result.query_templates.begin(), result.query_templates.end(),
+                                          [key](auto&& entry) { return entry.first == key; });
+                if (ifind == result.query_templates.end()) {
+                    result.query_templates.emplace_back(key, histogram_snapshot());
+                    ifind = std::prev(result.query_templates.end());
+                }
+                slot.histogram.copy_to(ifind->second);
+            }
+        }
+        return result;
+    }
+
+    std::ostream& operator<<(std::ostream& os, histogram_snapshot const& h)
+    {
+        return os << "count=" << h.count()
+                  << " mean=" << std::uint64_t(h.mean()) << "ns"
+                  << " p50=" << h.percentile(50) << "ns"
+                  << " p99=" << h.percentile(99) << "ns"
+                  << " p999=" << h.percentile(99.9) << "ns"
+                  << " max=" << h.max() << "ns";
+    }
+
+    void dump(std::ostream& os, snapshot const& s)
+    {
+        os << "stages:\n";
+        for (std::size_t i = 0; i < stage_count; ++i)
+            if (s.stages[i].count())
+                os << "  " << name(stage(i)) << ": " << s.stages[i] << '\n';
+        os << "queries:\n";
+        for (auto&& entry : s.query_templates) {
+            auto text = entry.first.substr(0, 60);
+            std::replace(text.begin(), text.end(), '\n', ' ');
+            os << "  [" << text << "]: " << entry.second << '\n';
+        }
+        os << "counters:\n";
+        for (std::size_t i = 0; i < counter_count; ++i)
+            os << "  " << name(counter(i)) << ": " << s.counters[i] << '\n';
+    }
+}
+
+#if AMYTEST_METRICS
+
+void *operator new(std::size_t size)
+{
+    metrics::count_allocation();
+    if (size == 0)
+        size = 1;
+    while (true) {
+        if (auto p = std::malloc(size))
+            return p;
+        auto handler = std::get_new_handler();
+        if (not handler)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+void *operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+    try {
+        return ::operator new(size);
+    }
+    catch (std::bad_alloc&) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, std::nothrow_t const&) noexcept
+{
+    return ::operator new(size, std::nothrow);
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::nothrow_t const&) noexcept
+{
+    std::free(p);
+}
+
+void operator delete[](void *p, std::nothrow_t const&) noexcept
+{
+    std::free(p);
+}
+
+#endif
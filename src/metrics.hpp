@@ -0,0 +1,205 @@
+//
+// Created by Richard Hodges on 01/05/2017.
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+/// Instrumentation for the storage pipeline.
+/// Every thread records into its own histograms and counters; only that thread writes them, so recording is
+/// a couple of relaxed atomic stores. take_snapshot() merges all threads without stopping them.
+///
+/// Build with AMYTEST_METRICS=0 to compile every AMYTEST_METRIC_* macro away.
+/// The histogram types remain available for tools which report latencies themselves.
+
+#ifndef AMYTEST_METRICS
+#define AMYTEST_METRICS 1
+#endif
+
+namespace metrics {
+
+    enum class stage
+    {
+        serialize,
+        base64,
+        escape,
+        format,
+        round_trip,
+        store_result,
+        parse,
+        stage_count
+    };
+
+    enum class counter
+    {
+        bytes_out,
+        bytes_in,
+        rows,
+        allocations,
+        counter_count
+    };
+
+    constexpr std::size_t stage_count = std::size_t(stage::stage_count);
+    constexpr std::size_t counter_count = std::size_t(counter::counter_count);
+
+    const char *name(stage s);
+
+    const char *name(counter c);
+
+    /// Log-linear buckets in the style of HdrHistogram: 8 linear sub-buckets per power of two,
+    /// so any recorded value is reported to within 12.5%. Values are nanoseconds.
+    struct histogram_layout
+    {
+        static constexpr int sub_bucket_bits = 3;
+        static constexpr int sub_bucket_count = 1 << sub_bucket_bits;
+        static constexpr int magnitudes = 41;      // up to 2^43ns, about 2.4 hours
+        static constexpr int bucket_count = magnitudes * sub_bucket_count;
+
+        static int bucket_for(std::uint64_t value);
+
+        /// The highest value which maps to `bucket`
+        static std::uint64_t upper_bound(int bucket);
+    };
+
+    /// A plain copy of a histogram which can be merged, queried and printed
+    struct histogram_snapshot
+    {
+        void record(std::uint64_t value, std::uint64_t n = 1);
+
+        histogram_snapshot& operator+=(histogram_snapshot const& other);
+
+        std::uint64_t count() const { return count_; }
+
+        std::uint64_t max() const { return max_; }
+
+        double mean() const { return count_ ? double(sum_) / count_ : 0.0; }
+
+        /// e.g. percentile(99.9)
+        std::uint64_t percentile(double p) const;
+
+        std::array<std::uint64_t, histogram_layout::bucket_count> buckets_ {};
+        std::uint64_t count_ = 0;
+        std::uint64_t sum_ = 0;
+        std::uint64_t max_ = 0;
+    };
+
+    /// Single-writer histogram which may be read concurrently
+    struct latency_histogram
+    {
+        void record(std::uint64_t value)
+        {
+            bump(buckets_[histogram_layout::bucket_for(value)], 1);
+            bump(count_, 1);
+            bump(sum_, value);
+            if (value > max_.load(std::memory_order_relaxed))
+                max_.store(value, std::memory_order_relaxed);
+        }
+
+        void record(std::chrono::nanoseconds elapsed)
+        {
+            record(std::uint64_t(elapsed.count() < 0 ? 0 : elapsed.count()));
+        }
+
+        void copy_to(histogram_snapshot& target) const;
+
+    private:
+        static void bump(std::atomic<std::uint64_t>& a, std::uint64_t n)
+        {
+            a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        std::array<std::atomic<std::uint64_t>, histogram_layout::bucket_count> buckets_ {};
+        std::atomic<std::uint64_t> count_ { 0 };
+        std::atomic<std::uint64_t> sum_ { 0 };
+        std::atomic<std::uint64_t> max_ { 0 };
+    };
+
+    void record(stage s, std::chrono::nanoseconds elapsed);
+
+    /// `query_template` must be a string with static storage duration; it is used as the key by address
+    void record(const char *query_template, std::chrono::nanoseconds elapsed);
+
+    void add(counter c, std::uint64_t n);
+
+    /// Global operator new calls made so far by the calling thread. The allocator hook that feeds
+    /// `counter::allocations` is only installed when AMYTEST_METRICS is on; otherwise this stays zero.
+    std::uint64_t thread_allocations();
+
+    struct snapshot
+    {
+        std::array<histogram_snapshot, stage_count> stages;
+        std::array<std::uint64_t, counter_count> counters {};
+        std::vector<std::pair<std::string, histogram_snapshot>> query_templates;
+    };
+
+    snapshot take_snapshot();
+
+    /// Human readable summary: count, mean and p50/p99/p999 per stage and template, then the counters
+    void dump(std::ostream& os, snapshot const& s);
+
+    std::ostream& operator<<(std::ostream& os, histogram_snapshot const& h);
+
+    struct stage_timer
+    {
+        stage_timer(stage s)
+            : stage_(s)
+            , start_(std::chrono::steady_clock::now())
+        {}
+
+        ~stage_timer()
+        {
+            record(stage_, std::chrono::steady_clock::now() - start_);
+        }
+
+        stage stage_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    struct query_timer
+    {
+        query_timer(const char *query_template)
+            : query_template_(query_template)
+            , start_(std::chrono::steady_clock::now())
+        {}
+
+        ~query_timer()
+        {
+            auto elapsed = std::chrono::steady_clock::now() - start_;
+            record(query_template_, elapsed);
+            record(stage::round_trip, elapsed);
+        }
+
+        const char *query_template_;
+        std::chrono::steady_clock::time_point start_;
+    };
+}
+
+#define AMYTEST_METRIC_CONCAT2(a, b) a##b
+#define AMYTEST_METRIC_CONCAT(a, b) AMYTEST_METRIC_CONCAT2(a, b)
+
+#if AMYTEST_METRICS
+
+/// Time the rest of the enclosing scope as metrics::stage::which
+#define AMYTEST_METRIC_STAGE(which) \
+    ::metrics::stage_timer AMYTEST_METRIC_CONCAT(amytest_stage_timer_, __LINE__) { ::metrics::stage::which }
+
+/// Time the rest of the enclosing scope as a round trip of the given static query template
+#define AMYTEST_METRIC_QUERY(query_template) \
+    ::metrics::query_timer AMYTEST_METRIC_CONCAT(amytest_query_timer_, __LINE__) { query_template }
+
+#define AMYTEST_METRIC_COUNT(which, n) ::metrics::add(::metrics::counter::which, (n))
+
+#else
+
+#define AMYTEST_METRIC_STAGE(which) static_cast<void>(0)
+#define AMYTEST_METRIC_QUERY(query_template) static_cast<void>(0)
+#define AMYTEST_METRIC_COUNT(which, n) static_cast<void>(0)
+
+#endif
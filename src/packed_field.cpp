@@ -0,0 +1,235 @@
+//
+// Created by Richard Hodges on 10/05/2017.
+//
+
+#include "packed_field.hpp"
+#include "metrics.hpp"
+
+#include "proto/limits.pb.h"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+
+    using google::protobuf::FieldDescriptor;
+    using google::protobuf::Message;
+    using google::protobuf::io::CodedInputStream;
+    using google::protobuf::io::CodedOutputStream;
+
+    /// Bytes per element, or 0 for strings and bytes
+    int element_width(FieldDescriptor const *field)
+    {
+        switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_BOOL:
+                return 1;
+            case FieldDescriptor::CPPTYPE_INT32:
+            case FieldDescriptor::CPPTYPE_UINT32:
+            case FieldDescriptor::CPPTYPE_ENUM:
+            case FieldDescriptor::CPPTYPE_FLOAT:
+                return 4;
+            case FieldDescriptor::CPPTYPE_INT64:
+            case FieldDescriptor::CPPTYPE_UINT64:
+            case FieldDescriptor::CPPTYPE_DOUBLE:
+                return 8;
+            case FieldDescriptor::CPPTYPE_STRING:
+                return 0;
+            default:
+                throw std::invalid_argument("field " + field->full_name() + " cannot be packed");
+        }
+    }
+
+    template<class To, class From>
+    To bit_cast(From from)
+    {
+        static_assert(sizeof(To) == sizeof(From), "");
+        To to;
+        std::memcpy(&to, &from, sizeof(to));
+        return to;
+    }
+
+    [[noreturn]] void throw_corrupt(FieldDescriptor const *field)
+    {
+        throw std::runtime_error("corrupt packed data for " + field->full_name());
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    constexpr bool little_endian_host = true;
+#else
+    constexpr bool little_endian_host = false;
+#endif
+
+    void read_little_endian(std::uint8_t const *first, std::uint32_t& value)
+    {
+        CodedInputStream::ReadLittleEndian32FromArray(first, &value);
+    }
+
+    void read_little_endian(std::uint8_t const *first, std::uint64_t& value)
+    {
+        CodedInputStream::ReadLittleEndian64FromArray(first, &value);
+    }
+
+    /// Replace the contents of a repeated fixed width field with `size` little endian elements of type `Raw`
+    /// at `first`, in one resize rather than an Add per element. On a little endian host this is a memcpy.
+    template<class T, class Raw>
+    void fill_fixed(std::uint8_t const *first, std::uint32_t size, Message& message, FieldDescriptor const *field)
+    {
+        static_assert(sizeof(T) == sizeof(Raw), "");
+        auto repeated = message.GetReflection()->MutableRepeatedField<T>(&message, field);
+        repeated->Resize(int(size), T());
+        if (size == 0)
+            return;
+        auto out = repeated->mutable_data();
+        if (little_endian_host) {
+            std::memcpy(out, first, std::size_t(size) * sizeof(T));
+            return;
+        }
+        for (std::uint32_t i = 0; i < size; ++i, first += sizeof(Raw)) {
+            Raw raw;
+            read_little_endian(first, raw);
+            out[i] = bit_cast<T>(raw);
+        }
+    }
+}
+
+bool stores_packed(google::protobuf::FieldDescriptor const *field)
+{
+    return field->is_repeated()
+           and field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE
+           and field->options().GetExtension(limits::repeated) == limits::PACKED;
+}
+
+void encode_packed(google::protobuf::Message const& message,
+                   google::protobuf::FieldDescriptor const *field,
+                   std::string& out)
+{
+    AMYTEST_METRIC_STAGE(serialize);
+    auto reflection = message.GetReflection();
+    auto size = reflection->FieldSize(message, field);
+    auto width = element_width(field);
+    if (width)
+        out.reserve(out.size() + 5 + std::size_t(size) * width);
+
+    google::protobuf::io::StringOutputStream stream(&out);
+    CodedOutputStream output(&stream);
+    std::string scratch;
+    output.WriteVarint32(std::uint32_t(size));
+    for (int i = 0; i < size; ++i) {
+        switch (field->cpp_type()) {
+            case FieldDescriptor::CPPTYPE_STRING: {
+                auto&& value = reflection->GetRepeatedStringReference(message, field, i, &scratch);
+                output.WriteVarint32(std::uint32_t(value.size()));
+                output.WriteString(value);
+            }
+                break;
+            case FieldDescriptor::CPPTYPE_BOOL: {
+                auto byte = std::uint8_t(reflection->GetRepeatedBool(message, field, i) ? 1 : 0);
+                output.WriteRaw(&byte, 1);
+            }
+                break;
+            case FieldDescriptor::CPPTYPE_INT32:
+                output.WriteLittleEndian32(std::uint32_t(reflection->GetRepeatedInt32(message, field, i)));
+                break;
+            case FieldDescriptor::CPPTYPE_UINT32:
+                output.WriteLittleEndian32(reflection->GetRepeatedUInt32(message, field, i));
+                break;
+            case FieldDescriptor::CPPTYPE_ENUM:
+                output.WriteLittleEndian32(std::uint32_t(reflection->GetRepeatedEnumValue(message, field, i)));
+                break;
+            case FieldDescriptor::CPPTYPE_FLOAT:
+                output.WriteLittleEndian32(bit_cast<std::uint32_t>(reflection->GetRepeatedFloat(message, field, i)));
+                break;
+            case FieldDescriptor::CPPTYPE_INT64:
+                output.WriteLittleEndian64(std::uint64_t(reflection->GetRepeatedInt64(message, field, i)));
+                break;
+            case FieldDescriptor::CPPTYPE_UINT64:
+                output.WriteLittleEndian64(reflection->GetRepeatedUInt64(message, field, i));
+                break;
+            case FieldDescriptor::CPPTYPE_DOUBLE:
+                output.WriteLittleEndian64(bit_cast<std::uint64_t>(reflection->GetRepeatedDouble(message, field, i)));
+                break;
+            default:
+                throw std::invalid_argument("field " + field->full_name() + " cannot be packed");
+        }
+    }
+}
+
+void decode_packed(boost::string_view data,
+                   google::protobuf::Message& message,
+                   google::protobuf::FieldDescriptor const *field)
+{
+    AMYTEST_METRIC_STAGE(parse);
+    AMYTEST_METRIC_COUNT(bytes_in, data.size());
+    auto reflection = message.GetReflection();
+    reflection->ClearField(&message, field);
+
+    CodedInputStream input(reinterpret_cast<std::uint8_t const *>(data.data()), int(data.size()));
+    std::uint32_t size;
+    if (not input.ReadVarint32(&size))
+        throw_corrupt(field);
+
+    // a count which cannot fit in the rest of the column is corrupt; checking first bounds the work
+    auto width = element_width(field);
+    auto remaining = data.size() - std::size_t(input.CurrentPosition());
+    if (std::uint64_t(size) * std::uint64_t(width ? width : 1) > remaining)
+        throw_corrupt(field);
+
+    auto first = reinterpret_cast<std::uint8_t const *>(data.data()) + input.CurrentPosition();
+    switch (field->cpp_type()) {
+        case FieldDescriptor::CPPTYPE_INT32:
+        case FieldDescriptor::CPPTYPE_UINT32:
+        case FieldDescriptor::CPPTYPE_FLOAT:
+        case FieldDescriptor::CPPTYPE_INT64:
+        case FieldDescriptor::CPPTYPE_UINT64:
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+            if (std::uint64_t(size) * std::uint64_t(width) != remaining)
+                throw_corrupt(field);
+            switch (field->cpp_type()) {
+                case FieldDescriptor::CPPTYPE_INT32:
+                    return fill_fixed<std::int32_t, std::uint32_t>(first, size, message, field);
+                case FieldDescriptor::CPPTYPE_UINT32:
+                    return fill_fixed<std::uint32_t, std::uint32_t>(first, size, message, field);
+                case FieldDescriptor::CPPTYPE_FLOAT:
+                    return fill_fixed<float, std::uint32_t>(first, size, message, field);
+                case FieldDescriptor::CPPTYPE_INT64:
+                    return fill_fixed<std::int64_t, std::uint64_t>(first, size, message, field);
+                case FieldDescriptor::CPPTYPE_UINT64:
+                    return fill_fixed<std::uint64_t, std::uint64_t>(first, size, message, field);
+                default:
+                    return fill_fixed<double, std::uint64_t>(first, size, message, field);
+            }
+        case FieldDescriptor::CPPTYPE_STRING: {
+            auto repeated = reflection->MutableRepeatedPtrField<std::string>(&message, field);
+            repeated->Reserve(int(size));
+            for (std::uint32_t i = 0; i < size; ++i) {
+                std::uint32_t length;
+                if (not input.ReadVarint32(&length) or not input.ReadString(repeated->Add(), int(length)))
+                    throw_corrupt(field);
+            }
+        }
+            break;
+        case FieldDescriptor::CPPTYPE_BOOL: {
+            if (size != remaining)
+                throw_corrupt(field);
+            auto repeated = reflection->MutableRepeatedField<bool>(&message, field);
+            repeated->Reserve(int(size));
+            for (std::uint32_t i = 0; i < size; ++i)
+                repeated->AddAlreadyReserved(first[i] != 0);
+            return;
+        }
+        default:
+            // an enum value outside the type's range must go through AddEnumValue, which handles it as
+            // the message's syntax requires
+            for (std::uint32_t i = 0; i < size; ++i) {
+                std::uint32_t value;
+                if (not input.ReadLittleEndian32(&value))
+                    throw_corrupt(field);
+                reflection->AddEnumValue(&message, field, int(std::int32_t(value)));
+            }
+    }
+
+    if (std::size_t(input.CurrentPosition()) != data.size())
+        throw_corrupt(field);
+}
@@ -0,0 +1,31 @@
+//
+// Created by Richard Hodges on 10/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include <boost/utility/string_view.hpp>
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <string>
+
+/// The column format of a repeated field stored with (limits.repeated) = PACKED.
+///
+/// A varint element count, then the elements: strings and bytes as a varint length followed by the bytes,
+/// 32 bit types (int32, uint32, enum, float) as 4 little endian bytes, 64 bit types as 8, bools as 1.
+/// Fixed width elements are contiguous, so a column is decoded in a single pass with no per-element framing.
+
+/// Whether build_scheme stores `field` as one packed column rather than a child table
+bool stores_packed(google::protobuf::FieldDescriptor const *field);
+
+/// Append the elements of the repeated `field` of `message` to `out`
+void encode_packed(google::protobuf::Message const& message,
+                   google::protobuf::FieldDescriptor const *field,
+                   std::string& out);
+
+/// Replace the elements of the repeated `field` of `message` with those encoded in `data`.
+/// Throws std::runtime_error if `data` is truncated or has bytes left over.
+void decode_packed(boost::string_view data,
+                   google::protobuf::Message& message,
+                   google::protobuf::FieldDescriptor const *field);
@@ -3,3 +3,135 @@
 //
 
 #include "query_builder.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+struct query_builder::render_argument
+    : boost::static_visitor<>
+{
+    explicit render_argument(query_builder& self) : self(self) {}
+
+    void operator()(quoted_text const& arg) const
+    {
+        auto& out = self.query_;
+        auto start = out.size();
+        out.resize(start + arg.length * 2 + 2);
+        out[start] = arg.quote;
+        auto length = mysql_real_escape_string_quote(self.escaper.native_,
+                                                     &out[start + 1],
+                                                     self.text_.data() + arg.offset, arg.length,
+                                                     arg.quote);
+        out[start + 1 + length] = arg.quote;
+        out.resize(start + 2 + length);
+    }
+
+    void operator()(verbatim_text const& arg) const
+    {
+        self.query_.append(self.text_, arg.offset, arg.length);
+    }
+
+    void operator()(std::int64_t arg) const
+    {
+        char digits[24];
+        auto length = std::snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(arg));
+        self.query_.append(digits, std::size_t(length));
+    }
+
+    void operator()(std::uint64_t arg) const
+    {
+        char digits[24];
+        auto length = std::snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(arg));
+        self.query_.append(digits, std::size_t(length));
+    }
+
+    query_builder& self;
+};
+
+std::string const& query_builder::operator()()
+{
+    AMYTEST_METRIC_STAGE(format);
+    query_.clear();
+
+    std::size_t next = 0;       // the argument for the next %s
+    std::size_t used = 0;       // how many arguments have been referred to, one way or the other
+    auto first = format_str.data();
+    auto last = first + format_str.size();
+    while (first != last) {
+        auto percent = static_cast<char const *>(std::memchr(first, '%', std::size_t(last - first)));
+        if (not percent) {
+            query_.append(first, last);
+            break;
+        }
+        query_.append(first, percent);
+        first = percent + 1;
+        if (first == last)
+            throw std::invalid_argument("query format ends with %: " + format_str);
+
+        if (*first == '%') {
+            query_ += '%';
+            ++first;
+            continue;
+        }
+
+        std::size_t index;
+        if (*first == 's') {
+            index = next++;
+            ++first;
+        }
+        else {
+            index = 0;
+            while (first != last and *first >= '0' and *first <= '9')
+                index = index * 10 + std::size_t(*first++ - '0');
+            if (first == last or *first != '%' or index == 0)
+                throw std::invalid_argument("bad placeholder in query format: " + format_str);
+            ++first;
+            --index;
+        }
+        if (index >= arguments_.size())
+            throw std::invalid_argument("query format refers to argument " + std::to_string(index + 1) + " of "
+                                        + std::to_string(arguments_.size()) + ": " + format_str);
+        used = std::max(used, index + 1);
+        render(arguments_[index]);
+    }
+
+    if (used != arguments_.size())
+        throw std::invalid_argument("query format uses " + std::to_string(used) + " of "
+                                    + std::to_string(arguments_.size()) + " arguments: " + format_str);
+    return query_;
+}
+
+void query_builder::clear()
+{
+    format_str.clear();
+    text_.clear();
+    arguments_.clear();
+}
+
+void query_builder::add_argument(verbatim const& arg)
+{
+    arguments_.push_back(verbatim_text { text_.size(), arg.size() });
+    text_ += arg;
+}
+
+void query_builder::add_text(boost::string_view arg, char quote)
+{
+    arguments_.push_back(quoted_text { text_.size(), arg.size(), quote });
+    text_.append(arg.data(), arg.size());
+}
+
+void query_builder::render(argument const& arg)
+{
+    AMYTEST_METRIC_STAGE(escape);
+    boost::apply_visitor(render_argument(*this), arg);
+}
+
+query_builder& thread_query_builder(MYSQL* native)
+{
+    thread_local sql_escaper escaper(static_cast<MYSQL*>(nullptr));
+    thread_local query_builder builder(escaper);
+    escaper.native_ = native;
+    builder.clear();
+    return builder;
+}
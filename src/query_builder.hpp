@@ -6,10 +6,21 @@
 
 #include "config.hpp"
 #include <amy.hpp>
-#include <boost/format.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/utility/string_view.hpp>
+#include <boost/variant.hpp>
 #include "notstd.hpp"
 #include "sql_escaper.hpp"
+#include <cstdint>
+#include <string>
+#include <type_traits>
 
+/// Builds a query from format pieces and arguments, escaping each argument as sql_escaper would.
+///
+/// Placeholders are `%s` for the next argument, `%N%` for the N'th and `%%` for a percent sign. The format
+/// and the text of the arguments are copied into buffers the builder owns, and the query is rendered in one
+/// pass into another, escaping straight into it. clear() keeps the buffers, so a builder reused for queries
+/// of a similar size stops allocating.
 struct query_builder {
 
     query_builder(sql_escaper& escaper)
@@ -17,30 +28,86 @@ struct query_builder {
     {}
 
     template<class...Args>
-    void add_component(std::string const& fmt, Args&&...args)
+    void add_component(boost::string_view fmt, Args&&...args)
     {
-        format_str += fmt;
+        format_str.append(fmt.data(), fmt.size());
         notstd::for_each(std::forward_as_tuple(std::forward<Args>(args)...),
-        [&](auto&& arg) {
-            using arg_type = decltype(arg);
-            arg_functions.emplace_back([this, arg = std::forward<arg_type>(arg)](boost::format& formatter) {
-                formatter % this->escaper(arg);
-            });
+        [this](auto&& arg) {
+            this->add_argument(arg);
         });
     }
 
-    boost::format operator()() const {
-        boost::format formatter(format_str);
-        for (auto&& func : arg_functions) {
-            func(formatter);
-        }
-        return formatter;
-    }
+    /// Render the query. The result is valid until the builder is next changed or rendered.
+    /// Throws std::invalid_argument if the placeholders and the arguments do not match.
+    std::string const& operator()();
+
+    /// Forget the format and the arguments, keeping the storage
+    void clear();
 
     std::string format_str;
-    std::vector<std::function<void(boost::format&)>> arg_functions;
     sql_escaper& escaper;
+
+private:
+    /// Text stored in `text_` to be escaped between `quote` characters
+    struct quoted_text
+    {
+        std::size_t offset, length;
+        char quote;
+    };
+
+    /// Text stored in `text_` to be copied as it is
+    struct verbatim_text
+    {
+        std::size_t offset, length;
+    };
+
+    using argument = boost::variant<quoted_text, verbatim_text, std::int64_t, std::uint64_t>;
+
+    struct render_argument;
+
+    void add_argument(boost::string_view arg) { add_text(arg, '\''); }
+    void add_argument(std::string const& arg) { add_text(arg, '\''); }
+    void add_argument(char const *arg) { add_text(arg, '\''); }
+    void add_argument(db_name const& arg) { add_text(arg, '`'); }
+    void add_argument(verbatim const& arg);
+
+    // every integer is widened to 64 bits, keeping its signedness
+    template<class Integer,
+             std::enable_if_t<std::is_integral<Integer>::value and std::is_signed<Integer>::value>* = nullptr>
+    void add_argument(Integer arg) { arguments_.push_back(std::int64_t(arg)); }
+
+    template<class Integer,
+             std::enable_if_t<std::is_integral<Integer>::value and std::is_unsigned<Integer>::value
+                              and not std::is_same<Integer, bool>::value>* = nullptr>
+    void add_argument(Integer arg) { arguments_.push_back(std::uint64_t(arg)); }
+
+    void add_text(boost::string_view arg, char quote);
+
+    void render(argument const& arg);
+
+    std::string text_;
+    boost::container::small_vector<argument, 8> arguments_;
+    std::string query_;
 };
 
+/// The query_builder of the calling thread, cleared and escaping for `native`. build_query() renders with it
+/// so that repeated queries reuse its buffers.
+query_builder& thread_query_builder(MYSQL* native);
 
+/// Render `format` with `parts` as a query_builder would. Only the returned string is allocated once the
+/// thread's builder has grown to fit.
+template<class...Ts>
+std::string build_query(sql_escaper& escaper, boost::string_view format, Ts&& ...parts)
+{
+    auto& builder = thread_query_builder(escaper.native_);
+    builder.add_component(format, std::forward<Ts>(parts)...);
+    return builder();
+}
 
+template<class...Ts>
+std::string build_query(amy::connector& connector, boost::string_view format, Ts&& ...parts)
+{
+    auto& builder = thread_query_builder(connector.native());
+    builder.add_component(format, std::forward<Ts>(parts)...);
+    return builder();
+}
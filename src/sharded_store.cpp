@@ -0,0 +1,157 @@
+//
+// Created by Richard Hodges on 06/05/2017.
+//
+
+#include "sharded_store.hpp"
+#include "message_store.hpp"
+#include "hasher.hpp"
+#include "typed_rows.hpp"
+
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+
+namespace {
+
+    auto routing_hash_algorithm() -> proto::storage::HashAlgorithm const&
+    {
+        static auto const algorithm = []
+        {
+            auto result = proto::storage::HashAlgorithm();
+            result.mutable_cryptogenerichash()->set_hashlength(16);   // the shortest generichash supports
+            return result;
+        }();
+        return algorithm;
+    }
+}
+
+sharded_store::sharded_store(std::vector<std::reference_wrapper<amy::connector>> shards)
+    : shards_(std::move(shards))
+{
+    if (shards_.empty() or shards_.size() > max_shards)
+        throw std::invalid_argument("sharded_store needs between 1 and " + std::to_string(max_shards) + " shards");
+}
+
+void sharded_store::init()
+{
+    for (auto&& conn : shards_)
+        make_blob_store(conn);
+}
+
+std::size_t sharded_store::shard_for(std::string const& routing_key) const
+{
+    if (shards_.size() == 1)
+        return 0;
+    std::vector<std::uint8_t> digest;
+    auto first = reinterpret_cast<std::uint8_t const *>(routing_key.data());
+    hash(digest, first, first + routing_key.size(), routing_hash_algorithm());
+    std::uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value = (value << 8) | digest[i];
+    return std::size_t(value % shards_.size());
+}
+
+sharded_id sharded_store::make_id(std::size_t shard, int unique_id)
+{
+    return (sharded_id(unique_id) << shard_bits) | sharded_id(shard);
+}
+
+std::size_t sharded_store::shard_of(sharded_id id)
+{
+    return std::size_t(id & sharded_id(max_shards - 1));
+}
+
+int sharded_store::unique_id_of(sharded_id id)
+{
+    return int(id >> shard_bits);
+}
+
+amy::connector& sharded_store::shard(sharded_id id)
+{
+    auto index = shard_of(id);
+    if (index >= shards_.size())
+        throw std::out_of_range("id " + std::to_string(id) + " names shard " + std::to_string(index)
+                                + " of " + std::to_string(shards_.size()));
+    return shards_[index];
+}
+
+sharded_id sharded_store::write_message(::google::protobuf::Message const& message, bool as_json)
+{
+    return write_message(message.GetDescriptor()->full_name(), message, as_json);
+}
+
+sharded_id sharded_store::write_message(std::string const& routing_key,
+                                        ::google::protobuf::Message const& message,
+                                        bool as_json)
+{
+    auto index = shard_for(routing_key);
+    return make_id(index, ::write_message(shards_[index], message, as_json));
+}
+
+void sharded_store::read_message(::google::protobuf::Message& message, sharded_id id)
+{
+    ::read_message(shard(id), message, unique_id_of(id));
+}
+
+auto sharded_store::scan(::google::protobuf::Arena& arena,
+                         ::google::protobuf::Message const& prototype,
+                         sharded_id after,
+                         std::size_t limit) -> std::vector<std::pair<sharded_id, ::google::protobuf::Message*>>
+{
+    using stored_row = typed_rows<int, type_dictionary::type_id,
+                                  boost::optional<boost::string_view>, boost::optional<boost::string_view>>;
+
+    auto result = std::vector<std::pair<sharded_id, ::google::protobuf::Message*>>();
+    if (limit == 0)
+        return result;
+
+    after = std::max<sharded_id>(after, 0);
+    auto after_shard = shard_of(after);
+    auto after_unique = unique_id_of(after);
+
+    // each shard returns up to `limit` rows in unique_id order. They stay unparsed until the merge picks them,
+    // so at most `limit` messages are parsed onto the arena however many shards there are.
+    auto type = type_dictionary::id_for(prototype.GetDescriptor());
+    auto pages = std::vector<amy::result_set>();
+    pages.reserve(shards_.size());
+    std::size_t available = 0;
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        auto first = i > after_shard ? after_unique : after_unique + 1;
+        pages.push_back(scan_rows(shards_[i], type, first, limit));
+        available += pages.back().size();
+    }
+    auto rows = std::vector<stored_row>();
+    rows.reserve(pages.size());
+    for (auto&& page : pages)
+        rows.emplace_back(page);
+
+    // k-way merge on the sharded id
+    struct cursor
+    {
+        sharded_id id;
+        std::size_t shard;
+        std::size_t position;
+
+        bool operator<(cursor const& other) const { return id > other.id; }  // smallest on top
+    };
+    auto heads = std::priority_queue<cursor>();
+    for (std::size_t i = 0; i < rows.size(); ++i)
+        if (not rows[i].empty())
+            heads.push({ make_id(i, std::get<0>(rows[i].at(0))), i, 0 });
+
+    result.reserve(std::min(limit, available));
+    while (result.size() < limit and not heads.empty()) {
+        auto head = heads.top();
+        heads.pop();
+        auto&& r = rows[head.shard];
+        auto row = r.at(head.position);
+        auto message = prototype.New(&arena);
+        parse_stored(std::get<1>(row), std::get<2>(row), std::get<3>(row), *message);
+        result.emplace_back(head.id, message);
+        if (++head.position < r.size()) {
+            head.id = make_id(head.shard, std::get<0>(r.at(head.position)));
+            heads.push(head);
+        }
+    }
+    return result;
+}
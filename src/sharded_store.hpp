@@ -0,0 +1,68 @@
+//
+// Created by Richard Hodges on 06/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include <amy.hpp>
+#include <google/protobuf/arena.h>
+#include <google/protobuf/message.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// A message id issued by a sharded_store: the shard's own unique_id with the shard number in the low bits.
+/// Ordering sharded ids orders by unique_id first, so a merged scan interleaves the shards roughly by age.
+using sharded_id = std::int64_t;
+
+/// tbl_message_store spread over several servers.
+///
+/// Each write goes to the shard chosen by a stable hash (see hasher.hpp) of a routing key, by default the
+/// message's type name. The id it returns names the shard, so reads go straight to the right server.
+/// Changing the number of shards changes the routing of keys, but not the location of existing ids.
+///
+/// The connectors are not owned and must be connected. Like amy::connector, a sharded_store is not thread safe.
+struct sharded_store
+{
+    static constexpr int shard_bits = 8;
+    static constexpr std::size_t max_shards = std::size_t(1) << shard_bits;
+
+    explicit sharded_store(std::vector<std::reference_wrapper<amy::connector>> shards);
+
+    /// Create the table on every shard
+    void init();
+
+    std::size_t shard_count() const { return shards_.size(); }
+
+    std::size_t shard_for(std::string const& routing_key) const;
+
+    static sharded_id make_id(std::size_t shard, int unique_id);
+
+    static std::size_t shard_of(sharded_id id);
+
+    static int unique_id_of(sharded_id id);
+
+    sharded_id write_message(::google::protobuf::Message const& message, bool as_json = false);
+
+    sharded_id write_message(std::string const& routing_key,
+                             ::google::protobuf::Message const& message,
+                             bool as_json = false);
+
+    void read_message(::google::protobuf::Message& message, sharded_id id);
+
+    /// Up to `limit` messages of the prototype's type with ids greater than `after`, in id order, gathered from
+    /// every shard. Pass the last id returned to fetch the next page; start with 0.
+    std::vector<std::pair<sharded_id, ::google::protobuf::Message*>> scan(::google::protobuf::Arena& arena,
+                                                                          ::google::protobuf::Message const& prototype,
+                                                                          sharded_id after,
+                                                                          std::size_t limit);
+
+private:
+    amy::connector& shard(sharded_id id);
+
+    std::vector<std::reference_wrapper<amy::connector>> shards_;
+};
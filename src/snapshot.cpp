@@ -0,0 +1,355 @@
+//
+// Created by Richard Hodges on 11/05/2017.
+//
+
+#include "snapshot.hpp"
+#include "message_store.hpp"
+#include "query_builder.hpp"
+#include "typed_rows.hpp"
+#include "json_codec.hpp"
+#include "metrics.hpp"
+#include "logging.hpp"
+
+#include <google/protobuf/descriptor.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace snapshot {
+
+    namespace {
+
+        const char magic[8] = { 'A', 'M', 'Y', 'S', 'N', 'A', 'P', '1' };
+        constexpr std::size_t record_header_size = 8;
+        constexpr std::size_t index_entry_size = 16;
+
+        const char export_template[] =
+            "SELECT"
+                " unique_id, type_id, binary_data, json_data"
+                " FROM tbl_message_store"
+                " WHERE unique_id > %1%"
+                " ORDER BY unique_id LIMIT %2%";
+
+        using optional_bytes = boost::optional<boost::string_view>;
+
+        void put32(std::string& out, std::uint32_t value)
+        {
+            for (int shift = 0; shift < 32; shift += 8)
+                out.push_back(char(value >> shift));
+        }
+
+        void put64(std::string& out, std::uint64_t value)
+        {
+            for (int shift = 0; shift < 64; shift += 8)
+                out.push_back(char(value >> shift));
+        }
+
+        std::uint32_t get32(char const *p)
+        {
+            std::uint32_t value = 0;
+            for (int i = 4; i--;)
+                value = (value << 8) | std::uint8_t(p[i]);
+            return value;
+        }
+
+        std::uint64_t get64(char const *p)
+        {
+            std::uint64_t value = 0;
+            for (int i = 8; i--;)
+                value = (value << 8) | std::uint8_t(p[i]);
+            return value;
+        }
+
+        [[noreturn]] void throw_corrupt(std::string const& what)
+        {
+            throw std::runtime_error("corrupt snapshot: " + what);
+        }
+    }
+
+    //
+    // writer
+    //
+
+    writer::writer(std::string const& path)
+        : path_(path)
+        , offset_(header_size)
+    {
+        buffer_.resize(1 << 20);
+        out_.rdbuf()->pubsetbuf(buffer_.data(), std::streamsize(buffer_.size()));
+        out_.open(path, std::ios::binary | std::ios::trunc);
+        if (not out_)
+            throw std::runtime_error("cannot create " + path);
+        write(std::string(header_size, '\0'));     // filled in by finish()
+    }
+
+    void writer::add_type(type_id type, std::string const& name)
+    {
+        auto same = [type](auto&& entry) { return entry.first == type; };
+        if (std::find_if(types_.begin(), types_.end(), same) == types_.end())
+            types_.emplace_back(type, name);
+    }
+
+    void writer::add(std::int64_t unique_id, type_id type, boost::string_view payload)
+    {
+        if (finished_)
+            throw std::logic_error("snapshot " + path_ + " is already finished");
+        if (not index_.empty() and unique_id <= index_.back().first)
+            throw std::invalid_argument("snapshot messages must be added in increasing unique_id order");
+        if (payload.size() > std::numeric_limits<std::uint32_t>::max())
+            throw std::invalid_argument("message " + std::to_string(unique_id) + " is too large for a snapshot");
+
+        index_.emplace_back(unique_id, offset_);
+        scratch_.clear();
+        put32(scratch_, type);
+        put32(scratch_, std::uint32_t(payload.size()));
+        scratch_.append(payload.data(), payload.size());
+        write(scratch_);
+        offset_ += scratch_.size();
+    }
+
+    void writer::finish()
+    {
+        if (finished_)
+            return;
+        finished_ = true;
+
+        auto types_offset = offset_;
+        scratch_.clear();
+        for (auto&& type : types_) {
+            put32(scratch_, type.first);
+            put32(scratch_, std::uint32_t(type.second.size()));
+            scratch_ += type.second;
+        }
+        write(scratch_);
+        offset_ += scratch_.size();
+
+        auto index_offset = offset_;
+        scratch_.clear();
+        scratch_.reserve(index_.size() * index_entry_size);
+        for (auto&& entry : index_) {
+            put64(scratch_, std::uint64_t(entry.first));
+            put64(scratch_, entry.second);
+        }
+        write(scratch_);
+        offset_ += scratch_.size();
+
+        scratch_.assign(magic, sizeof(magic));
+        put32(scratch_, format_version);
+        put32(scratch_, std::uint32_t(types_.size()));
+        put64(scratch_, index_.size());
+        put64(scratch_, types_offset);
+        put64(scratch_, index_offset);
+        scratch_.resize(header_size, '\0');
+        out_.seekp(0);
+        write(scratch_);
+
+        out_.close();
+        if (not out_)
+            throw std::runtime_error("failed to write " + path_);
+    }
+
+    void writer::write(std::string const& bytes)
+    {
+        out_.write(bytes.data(), std::streamsize(bytes.size()));
+        if (not out_)
+            throw std::runtime_error("failed to write " + path_);
+        AMYTEST_METRIC_COUNT(bytes_out, bytes.size());
+    }
+
+    //
+    // reader
+    //
+
+    reader::reader(std::string const& path)
+        : file_(path.c_str(), boost::interprocess::read_only)
+        , region_(file_, boost::interprocess::read_only)
+        , base_(static_cast<char const *>(region_.get_address()))
+        , file_size_(region_.get_size())
+    {
+        if (file_size_ < header_size or std::memcmp(base_, magic, sizeof(magic)) != 0)
+            throw std::runtime_error(path + " is not a message store snapshot");
+        if (get32(base_ + 8) != format_version)
+            throw std::runtime_error(path + " has snapshot format version " + std::to_string(get32(base_ + 8)));
+
+        auto type_count = get32(base_ + 12);
+        auto count = get64(base_ + 16);
+        types_offset_ = get64(base_ + 24);
+        auto index_offset = get64(base_ + 32);
+        if (types_offset_ < header_size or types_offset_ > index_offset or index_offset > file_size_
+            or count != (file_size_ - index_offset) / index_entry_size
+            or (file_size_ - index_offset) % index_entry_size != 0)
+            throw_corrupt(path + " is truncated or has a bad header");
+        count_ = std::size_t(count);
+        index_ = base_ + index_offset;
+
+        auto p = base_ + types_offset_;
+        auto last = base_ + index_offset;
+        for (std::uint32_t i = 0; i < type_count; ++i) {
+            if (std::size_t(last - p) < record_header_size)
+                throw_corrupt(path + " has a truncated type dictionary");
+            auto type = get32(p);
+            auto length = get32(p + 4);
+            p += record_header_size;
+            if (std::size_t(last - p) < length)
+                throw_corrupt(path + " has a truncated type dictionary");
+            types_.emplace(type, std::string(p, length));
+            p += length;
+        }
+    }
+
+    entry reader::at(std::size_t i) const
+    {
+        if (i >= count_)
+            throw std::out_of_range("snapshot entry " + std::to_string(i) + " of " + std::to_string(count_));
+        auto offset = get64(index_ + i * index_entry_size + 8);
+        if (offset < header_size or offset > types_offset_ or types_offset_ - offset < record_header_size)
+            throw_corrupt("bad offset for entry " + std::to_string(i));
+        auto record = base_ + offset;
+        auto length = get32(record + 4);
+        if (types_offset_ - offset - record_header_size < length)
+            throw_corrupt("truncated message for entry " + std::to_string(i));
+        return { id_at(i), get32(record), boost::string_view(record + record_header_size, length) };
+    }
+
+    boost::optional<entry> reader::find(std::int64_t unique_id) const
+    {
+        std::size_t first = 0, last = count_;
+        while (first < last) {
+            auto middle = first + (last - first) / 2;
+            if (id_at(middle) < unique_id)
+                first = middle + 1;
+            else
+                last = middle;
+        }
+        if (first == count_ or id_at(first) != unique_id)
+            return boost::none;
+        return at(first);
+    }
+
+    void reader::parse(entry const& e, google::protobuf::Message& message) const
+    {
+        if (e.type != type_dictionary::id_for(message.GetDescriptor()))
+            throw std::runtime_error("message type mismatch: snapshot type id " + std::to_string(e.type)
+                                     + " is not " + message.GetDescriptor()->full_name());
+        AMYTEST_METRIC_STAGE(parse);
+        if (not message.ParseFromArray(e.payload.data(), int(e.payload.size())))
+            throw std::runtime_error("failed to parse " + message.GetDescriptor()->full_name());
+    }
+
+    std::int64_t reader::id_at(std::size_t i) const
+    {
+        return std::int64_t(get64(index_ + i * index_entry_size));
+    }
+
+    //
+    // export and import
+    //
+
+    bulk_load_stats export_store(amy::connector& conn, std::string const& path, std::size_t batch_size)
+    {
+        if (batch_size == 0)
+            throw std::invalid_argument("export batch size must be at least 1");
+
+        auto start = std::chrono::steady_clock::now();
+        auto dictionary = type_dictionary(conn);
+        writer out(path);
+
+        // json rows are re-encoded, which needs the generated type
+        auto known = std::unordered_set<type_id>();
+        auto parsers = std::unordered_map<type_id, std::unique_ptr<google::protobuf::Message>>();
+        auto binary = std::string();
+        auto json_to_binary = [&](type_id type, boost::string_view json) -> boost::string_view
+        {
+            auto& message = parsers[type];
+            if (not message) {
+                auto name = dictionary.name_of(type);
+                auto descriptor = google::protobuf::DescriptorPool::generated_pool()->FindMessageTypeByName(name);
+                if (not descriptor)
+                    throw std::runtime_error("cannot export json rows of unknown type " + name);
+                message.reset(google::protobuf::MessageFactory::generated_factory()->GetPrototype(descriptor)->New());
+            }
+            message->Clear();
+            json_codec::instance().parse(json.data(), json.size(), *message);
+            binary.clear();
+            message->SerializeToString(&binary);
+            return binary;
+        };
+
+        int after = std::numeric_limits<int>::min();
+        for (;;) {
+            auto query = build_query(conn, export_template, after, batch_size);
+            AMY_LOG(debug, "executing: ", query);
+            auto rs = [&] {
+                AMYTEST_METRIC_QUERY(export_template);
+                conn.query(query);
+                return conn.store_result();
+            }();
+            AMYTEST_METRIC_COUNT(rows, rs.size());
+
+            typed_rows<int, type_id, optional_bytes, optional_bytes>(rs).for_each(
+                [&](int id, type_id type, optional_bytes blob, optional_bytes json)
+                {
+                    if (known.insert(type).second) {
+                        auto name = dictionary.name_of(type);
+                        if (name.empty())
+                            throw std::runtime_error("type id " + std::to_string(type)
+                                                     + " is not in tbl_message_type");
+                        out.add_type(type, name);
+                    }
+                    if (blob)
+                        out.add(id, type, *blob);
+                    else if (json)
+                        out.add(id, type, json_to_binary(type, *json));
+                    else
+                        throw std::runtime_error("invalid record " + std::to_string(id));
+                    after = id;
+                });
+
+            if (rs.size() < batch_size)
+                break;
+        }
+        out.finish();
+
+        auto stats = bulk_load_stats();
+        stats.rows = out.messages();
+        stats.stored = out.messages();
+        stats.bytes = out.bytes();
+        stats.elapsed = std::chrono::steady_clock::now() - start;
+        return stats;
+    }
+
+    bulk_load_stats import_store(amy::connector& conn, reader const& snapshot)
+    {
+        make_blob_store(conn);
+
+        // a type whose id differs here would make every one of its rows unreadable, so check before loading
+        auto dictionary = type_dictionary(conn);
+        for (auto&& type : snapshot.types()) {
+            auto id = dictionary.lookup(type.second);
+            if (id != type.first)
+                throw std::runtime_error("snapshot type id " + std::to_string(type.first) + " of " + type.second
+                                         + " is " + std::to_string(id) + " here");
+        }
+
+        std::size_t next = 0;
+        auto stats = bulk_load(conn, "tbl_message_store", { "unique_id", "type_id", "binary_data" },
+                               [&](bulk_row& row)
+                               {
+                                   if (next == snapshot.size())
+                                       return false;
+                                   auto e = snapshot.at(next++);
+                                   row.add(e.unique_id)
+                                       .add(std::int64_t(e.type))
+                                       .add(e.payload.data(), e.payload.size());
+                                   return true;
+                               });
+        if (stats.stored != stats.rows)
+            AMY_LOG(warning, "snapshot import stored ", stats.stored, " of ", stats.rows,
+                    " messages; the rest have unique_ids already in tbl_message_store");
+        return stats;
+    }
+}
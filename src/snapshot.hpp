@@ -0,0 +1,130 @@
+//
+// Created by Richard Hodges on 11/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include "bulk_loader.hpp"
+#include "type_dictionary.hpp"
+#include <amy.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
+#include <google/protobuf/message.h>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// A snapshot of tbl_message_store in a single file which can be memory mapped and read in place.
+///
+/// All integers are little endian.
+///
+///   header      64 bytes: "AMYSNAP1", u32 version, u32 type count, u64 message count,
+///               u64 offset of the type dictionary, u64 offset of the index, 24 bytes reserved
+///   messages    for each message: u32 type id, u32 length, the serialized message
+///   types       for each type: u32 type id, u32 length, the type name
+///   index       for each message, in unique_id order: i64 unique_id, u64 offset of its record
+///
+/// Rows stored as json are converted to binary on export.
+namespace snapshot {
+
+    using type_id = type_dictionary::type_id;
+
+    constexpr std::uint32_t format_version = 1;
+    constexpr std::size_t header_size = 64;
+
+    struct entry
+    {
+        std::int64_t unique_id;
+        type_id type;
+        boost::string_view payload;     // points into the mapping
+    };
+
+    /// Writes a snapshot file. Messages must be added in increasing unique_id order.
+    struct writer
+    {
+        explicit writer(std::string const& path);
+
+        void add_type(type_id type, std::string const& name);
+
+        void add(std::int64_t unique_id, type_id type, boost::string_view payload);
+
+        /// Write the type dictionary, the index and the header. Nothing may be added afterwards.
+        void finish();
+
+        std::uint64_t messages() const { return index_.size(); }
+
+        std::uint64_t bytes() const { return offset_; }
+
+    private:
+        void write(std::string const& bytes);
+
+        std::vector<char> buffer_;     // outlives out_, which writes through it
+        std::ofstream out_;
+        std::string path_;
+        std::uint64_t offset_;
+        std::vector<std::pair<std::int64_t, std::uint64_t>> index_;
+        std::vector<std::pair<type_id, std::string>> types_;
+        std::string scratch_;
+        bool finished_ = false;
+    };
+
+    /// A read only mapping of a snapshot file. Entries refer to the mapping, so they are valid for the
+    /// lifetime of the reader. Throws std::runtime_error if the file is not a complete snapshot.
+    struct reader
+    {
+        explicit reader(std::string const& path);
+
+        reader(reader const&) = delete;
+        reader& operator=(reader const&) = delete;
+
+        std::size_t size() const { return count_; }
+
+        bool empty() const { return count_ == 0; }
+
+        /// The i'th message in unique_id order
+        entry at(std::size_t i) const;
+
+        /// Binary search of the index
+        boost::optional<entry> find(std::int64_t unique_id) const;
+
+        template<class F>
+        void for_each(F&& f) const
+        {
+            for (std::size_t i = 0; i < count_; ++i)
+                f(at(i));
+        }
+
+        std::unordered_map<type_id, std::string> const& types() const { return types_; }
+
+        /// Parse an entry into `message`, checking that its type matches
+        void parse(entry const& e, google::protobuf::Message& message) const;
+
+    private:
+        std::int64_t id_at(std::size_t i) const;
+
+        boost::interprocess::file_mapping file_;
+        boost::interprocess::mapped_region region_;
+        char const *base_;
+        std::size_t file_size_;
+        std::size_t count_;
+        std::uint64_t types_offset_;
+        char const *index_;
+        std::unordered_map<type_id, std::string> types_;
+    };
+
+    /// Stream all of tbl_message_store into `path`, `batch_size` rows per round trip
+    bulk_load_stats export_store(amy::connector& conn, std::string const& path, std::size_t batch_size = 1000);
+
+    /// Load every message of a snapshot into tbl_message_store with LOAD DATA, keeping the unique_ids. Its types
+    /// are recorded in the dictionary first; a type whose id differs on this server throws before anything is
+    /// loaded. A message whose unique_id is already taken is skipped, so compare the stats' `stored` with `rows`.
+    /// As with bulk_load_messages, nothing is added to tbl_message_index.
+    /// @note the connection must have been opened with amy::client_local_files
+    bulk_load_stats import_store(amy::connector& conn, reader const& snapshot);
+}
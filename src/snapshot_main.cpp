@@ -0,0 +1,94 @@
+//
+// Created by Richard Hodges on 11/05/2017.
+//
+// Snapshot tool. For example, copy a store from one server to another:
+//    amy-snapshot export store.snap --port 3306
+//    amy-snapshot import store.snap --port 3307
+//
+
+#include "config.hpp"
+#include "snapshot.hpp"
+#include "logging.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+
+using namespace amytest;
+
+namespace {
+
+    void usage(const char *program)
+    {
+        std::cerr << "usage: " << program << " export|import file\n"
+                     "       [--host addr] [--port n] [--user name] [--password pw] [--database name]\n"
+                     "       [--batch n]" << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (auto level = std::getenv("AMYTEST_LOG_LEVEL"))
+        logging::logger::instance().set_level(logging::parse_level(level, logging::level::info));
+
+    if (argc < 3 or (std::strcmp(argv[1], "export") != 0 and std::strcmp(argv[1], "import") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    auto exporting = std::strcmp(argv[1], "export") == 0;
+    auto path = std::string(argv[2]);
+
+    auto endpoint = tcp_endpoint(ip_address::from_string("127.0.0.1"), 3306);
+    auto user = std::string("test-user");
+    auto password = std::string("test-password");
+    auto database = std::string("test");
+    std::size_t batch = 1000;
+    try {
+        for (int i = 3; i < argc; i += 2) {
+            if (i + 1 == argc) {
+                usage(argv[0]);
+                return 1;
+            }
+            auto value = argv[i + 1];
+            if (std::strcmp(argv[i], "--host") == 0) {
+                endpoint.address(ip_address::from_string(value));
+            }
+            else if (std::strcmp(argv[i], "--port") == 0) {
+                endpoint.port(static_cast<unsigned short>(std::atoi(value)));
+            }
+            else if (std::strcmp(argv[i], "--user") == 0) {
+                user = value;
+            }
+            else if (std::strcmp(argv[i], "--password") == 0) {
+                password = value;
+            }
+            else if (std::strcmp(argv[i], "--database") == 0) {
+                database = value;
+            }
+            else if (std::strcmp(argv[i], "--batch") == 0) {
+                batch = std::strtoull(value, nullptr, 10);
+            }
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+
+        asio::io_service ios;
+        amy::connector connection(ios);
+        connection.connect(endpoint, amy::auth_info(user, password), database,
+                           exporting ? amy::default_flags : amy::client_local_files);
+
+        auto stats = exporting
+                     ? snapshot::export_store(connection, path, batch)
+                     : snapshot::import_store(connection, snapshot::reader(path));
+        logging::logger::instance().flush();
+        std::cout << (exporting ? "exported " : "imported ") << stats << std::endl;
+    }
+    catch (std::exception const& e) {
+        logging::logger::instance().flush();
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -11,7 +11,7 @@ std::string const& sql_escaper::operator ()(db_name const& arg)
     output_.resize(slen * 2 + 1 + 2);
     output_[0] = '`';
 
-    auto length = mysql_real_escape_string_quote(connector.native(),
+    auto length = mysql_real_escape_string_quote(native_,
                                                  &output_[1],
                                                  arg.data(), slen,
                                                  '`');
@@ -7,24 +7,34 @@
 #include "config.hpp"
 #include <amy.hpp>
 #include "notstd.hpp"
-#include <boost/format.hpp>
+#include "metrics.hpp"
 
 struct db_name
     : std::string
 {
     using std::string::string;
+
+    db_name(std::string const& str) : std::string(str) {}
+    db_name(std::string&& str) : std::string(std::move(str)) {}
 };
 
 struct verbatim
     : std::string
 {
     using std::string::string;
+
+    verbatim(std::string const& str) : std::string(str) {}
+    verbatim(std::string&& str) : std::string(std::move(str)) {}
 };
 
 struct sql_escaper
 {
     sql_escaper(amy::connector& connector)
-        : connector(connector) {}
+        : native_(connector.native()) {}
+
+    /// Escape using a bare client handle, e.g. one from mysql_init() which has never connected
+    sql_escaper(MYSQL* native)
+        : native_(native) {}
 
 
     template<std::size_t N>
@@ -34,7 +44,7 @@ struct sql_escaper
         output_.resize(slen * 2 + 1 + 2);
         output_[0] = '\'';
 
-        auto length = mysql_real_escape_string_quote(connector.native(),
+        auto length = mysql_real_escape_string_quote(native_,
                                                      &output_[1],
                                                      arg, slen,
                                                      '\'');
@@ -50,7 +60,7 @@ struct sql_escaper
         output_.resize(slen * 2 + 1 + 2);
         output_[0] = '\'';
 
-        auto length = mysql_real_escape_string_quote(connector.native(),
+        auto length = mysql_real_escape_string_quote(native_,
                                                      &output_[1],
                                                      arg.data(), slen,
                                                      '\'');
@@ -73,29 +83,7 @@ struct sql_escaper
         return output_;
     }
 
-    amy::connector& connector;
+    MYSQL* native_;
     std::vector<char> buffer_;
     std::string       output_;
 };
-
-
-
-template<class...Ts>
-auto format_query(amy::connector& connector, std::string const& format, Ts&& ...parts)
-{
-    auto escaper = sql_escaper(connector);
-    auto fmt     = boost::format(format);
-
-    std::string result;
-    notstd::for_each(std::forward_as_tuple(std::forward<Ts>(parts)...), [&escaper, &fmt](auto&& part)
-    {
-        fmt % escaper(std::forward<decltype(part)>(part));
-    });
-    return fmt;
-}
-
-template<class...Ts>
-auto build_query(amy::connector& connector, std::string const& format, Ts&& ...parts)
-{
-    return format_query(connector, format, std::forward<Ts>(parts)...).str();
-}
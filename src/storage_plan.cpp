@@ -0,0 +1,216 @@
+//
+// Created by Richard Hodges on 09/05/2017.
+//
+
+#include "storage_plan.hpp"
+#include "packed_field.hpp"
+#include "table_lookup.hpp"
+#include "sql_escaper.hpp"
+#include "logging.hpp"
+
+#include "proto/limits.pb.h"
+
+#include <mysql/mysql.h>
+#include <boost/optional.hpp>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace {
+
+    using google::protobuf::Descriptor;
+    using google::protobuf::FieldDescriptor;
+
+    /// A client handle which is initialised but never connected. Enough for escaping.
+    MYSQL* unconnected_handle()
+    {
+        static MYSQL* handle = mysql_init(nullptr);
+        return handle;
+    }
+
+    std::string deduce_string_storage(std::int64_t max_length)
+    {
+        if (max_length == 0)
+        {
+            return "LONGTEXT";
+        }
+        else if (max_length < 256)
+        {
+            return "VARCHAR(" + std::to_string(max_length) + ")";
+        }
+        else if (max_length < 65536) {
+            return "TEXT";
+        }
+        else {
+            return "LONGTEXT";
+        }
+    }
+
+    /// The column for a scalar field, or for each element of a repeated one. none for types not yet stored
+    boost::optional<std::string> column_definition(sql_escaper& escaper, FieldDescriptor const *field)
+    {
+        switch (field->type()) {
+            case FieldDescriptor::TYPE_STRING: {
+                auto maxLength = field->options().GetExtension(limits::maxLength);
+                auto storage_def = deduce_string_storage(maxLength);
+                if (field->containing_oneof()) {
+                    storage_def += " NULL";
+                }
+                else {
+                    storage_def += " NOT NULL DEFAULT " + escaper(field->default_value_string());
+                }
+                return storage_def;
+            }
+
+            case FieldDescriptor::TYPE_INT32:
+                return std::string("INT(9) NULL");
+
+            default:
+                AMY_LOG(debug, field->full_name(), " type: ", field->type_name(), " ignored");
+                return boost::none;
+        }
+    }
+
+    /// Whether a sub-message of type `type` at the end of `history` would repeat a type already on the path
+    bool recursive(member_history const& history, Descriptor const *type)
+    {
+        if (history.base == type)
+            return true;
+        for (auto field : history.fields)
+            if (field->message_type() == type)
+                return true;
+        return false;
+    }
+
+    void render_sql(table_plan& table)
+    {
+        auto escaper = sql_escaper(unconnected_handle());
+        auto quoted_name = escaper(db_name(table.hash_name));
+
+        table.create_sql = "CREATE TABLE IF NOT EXISTS " + quoted_name + " (\n";
+        table.create_sql += " __id__ INT NOT NULL AUTO_INCREMENT PRIMARY KEY\n";
+        if (table.parent) {
+            table.create_sql += ",__parent__ INT NOT NULL\n";
+            table.create_sql += ", CONSTRAINT FOREIGN KEY (__parent__) REFERENCES ";
+            table.create_sql += escaper(db_name(table.parent->hash_name));
+            table.create_sql += " (__id__) ON DELETE CASCADE ON UPDATE CASCADE\n";
+        }
+        if (table.what == table_plan::kind::repeated) {
+            table.create_sql += ",__index__ INT NOT NULL\n";
+            table.create_sql += ", UNIQUE KEY (__parent__, __index__)";
+        }
+        table.create_sql += ")";
+
+        auto names = std::string();
+        auto values = std::string();
+        int placeholder = 0;
+        auto add = [&](std::string const& quoted)
+        {
+            if (placeholder) {
+                names += ", ";
+                values += ", ";
+            }
+            names += quoted;
+            values += '%' + std::to_string(++placeholder) + '%';
+        };
+        if (table.parent)
+            add("__parent__");
+        if (table.what == table_plan::kind::repeated)
+            add("__index__");
+        for (auto&& column : table.columns)
+            add(escaper(db_name(column.name)));
+        table.insert_template = "INSERT INTO " + quoted_name + " (" + names + ") VALUES (" + values + ")";
+    }
+
+    struct plan_cache
+    {
+        std::mutex mutex_;
+        std::unordered_map<Descriptor const *, std::unique_ptr<storage_plan const>> plans_;
+    };
+
+    plan_cache& get_plan_cache()
+    {
+        static plan_cache cache_;
+        return cache_;
+    }
+}
+
+storage_plan const& storage_plan::get(google::protobuf::Descriptor const *descriptor)
+{
+    auto& cache = get_plan_cache();
+    auto lock = std::unique_lock<std::mutex>(cache.mutex_);
+    auto ifind = cache.plans_.find(descriptor);
+    if (ifind == cache.plans_.end()) {
+        auto plan = std::unique_ptr<storage_plan const>(new storage_plan(descriptor));
+        ifind = cache.plans_.emplace(descriptor, std::move(plan)).first;
+    }
+    return *ifind->second;
+}
+
+storage_plan::storage_plan(google::protobuf::Descriptor const *descriptor)
+    : descriptor(descriptor)
+    , indexes(plan_indexed_fields(descriptor))
+{
+    auto& root = add_table(table_plan::kind::message, member_history(descriptor), nullptr);
+    add_fields(root, descriptor);
+}
+
+table_plan const& storage_plan::table(std::vector<google::protobuf::FieldDescriptor const *> const& path) const
+{
+    auto ifind = by_path.find(path);
+    if (ifind == by_path.end())
+        throw std::invalid_argument("no table for " + member_history(descriptor, path.begin(), path.end()).name());
+    return *ifind->second;
+}
+
+table_plan& storage_plan::add_table(table_plan::kind what, member_history history, table_plan const *parent)
+{
+    auto table = new table_plan { what, std::move(history) };
+    tables.emplace_back(table);
+    table->real_name = table->history.name();
+    table->hash_name = table_lookup::hash_name_for(table->real_name);
+    table->parent = parent;
+    by_path.emplace(table->history.fields, table);
+    return *table;
+}
+
+void storage_plan::add_fields(table_plan& table, google::protobuf::Descriptor const *type)
+{
+    auto escaper = sql_escaper(unconnected_handle());
+    auto nfields = type->field_count();
+    for (decltype(nfields) ifield = 0; ifield < nfields; ++ifield) {
+        auto field = type->field(ifield);
+        auto column_name = std::to_string(field->number());
+        auto is_message = field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE;
+        if (is_message and recursive(table.history, field->message_type())) {
+            AMY_LOG(debug, field->full_name(), " is recursive; not stored");
+            continue;
+        }
+
+        if (field->is_repeated()) {
+            if (stores_packed(field)) {
+                table.columns.push_back({ field, std::move(column_name), "LONGBLOB NULL", true });
+                continue;
+            }
+            auto& child = add_table(table_plan::kind::repeated, table.history + field, &table);
+            if (is_message) {
+                add_fields(child, field->message_type());
+            }
+            else {
+                if (auto definition = column_definition(escaper, field))
+                    child.columns.push_back({ field, std::move(column_name), std::move(*definition) });
+                render_sql(child);
+            }
+            table.children.push_back(&child);
+        }
+        else if (is_message) {
+            auto& child = add_table(table_plan::kind::message, table.history + field, &table);
+            add_fields(child, field->message_type());
+            table.children.push_back(&child);
+        }
+        else if (auto definition = column_definition(escaper, field)) {
+            table.columns.push_back({ field, std::move(column_name), std::move(*definition) });
+        }
+    }
+    render_sql(table);
+}
@@ -0,0 +1,91 @@
+//
+// Created by Richard Hodges on 09/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include "member_history.hpp"
+#include "field_index.hpp"
+#include <google/protobuf/descriptor.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// One column of a message table: a singular scalar field, or a packed repeated one, named by its field number
+struct column_plan
+{
+    google::protobuf::FieldDescriptor const *field;
+    std::string name;
+    std::string definition;     // e.g. "VARCHAR(128) NOT NULL DEFAULT ''"
+
+    /// Holds every element of a repeated field in the encode_packed() format
+    bool packed = false;
+};
+
+/// Everything needed to create and address the table for one position in a message tree.
+struct table_plan
+{
+    enum class kind
+    {
+        message,    // the root, or a singular sub-message
+        repeated,   // a repeated field stored as a TABLE, one row per element
+    };
+
+    kind what;
+    member_history history;
+
+    /// history.name(), and the name recorded for it in tbl_table_name
+    std::string real_name;
+    std::string hash_name;
+
+    /// nullptr for the root
+    table_plan const *parent;
+
+    std::vector<column_plan> columns;
+    std::vector<table_plan const *> children;
+
+    /// CREATE TABLE IF NOT EXISTS for the table with its __id__, __parent__ and, for a repeated field, __index__
+    /// columns. Other columns are added one by one so that existing tables are brought up to date.
+    std::string create_sql;
+
+    /// INSERT of one row: %1% is __parent__ (omitted for the root), then __index__ for a repeated field, then
+    /// one placeholder per column in order
+    std::string insert_template;
+};
+
+/// The storage layout of a message type, derived once from its Descriptor and then shared, read only, by schema
+/// sync and the read/write paths. Safe to use from any thread.
+struct storage_plan
+{
+    /// The plan for `descriptor`, built on first use
+    static storage_plan const& get(google::protobuf::Descriptor const *descriptor);
+
+    storage_plan(storage_plan const&) = delete;
+    storage_plan& operator=(storage_plan const&) = delete;
+
+    table_plan const& root() const { return *tables.front(); }
+
+    /// The table at a field path from the root. Throws std::invalid_argument if there is none
+    table_plan const& table(std::vector<google::protobuf::FieldDescriptor const *> const& path) const;
+
+    table_plan const& table(member_history const& history) const { return table(history.fields); }
+
+    google::protobuf::Descriptor const *descriptor;
+
+    /// Every table, each parent before its children
+    std::vector<std::unique_ptr<table_plan const>> tables;
+
+    std::map<std::vector<google::protobuf::FieldDescriptor const *>, table_plan const *> by_path;
+
+    /// The fields recorded in tbl_message_index
+    std::vector<indexed_field> indexes;
+
+private:
+    explicit storage_plan(google::protobuf::Descriptor const *descriptor);
+
+    table_plan& add_table(table_plan::kind what, member_history history, table_plan const *parent);
+
+    void add_fields(table_plan& table, google::protobuf::Descriptor const *type);
+};
@@ -3,12 +3,30 @@
 //
 
 #include "table_lookup.hpp"
-#include "sql_escaper.hpp"
+#include "query_builder.hpp"
 #include "hasher.hpp"
+#include "hex.hpp"
+#include "typed_rows.hpp"
+#include "metrics.hpp"
 #include "google/protobuf/util/json_util.h"
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 namespace {
 
+    // hash_name holds the raw digest; the textual name is its hex encoding
+    const char select_hash_template[] = "select hash_name from tbl_table_name where real_name=%1%;";
+    // the name for a given real name never changes, so a row written meanwhile by a concurrent lookup is
+    // the same row
+    const char insert_hash_template[] = "insert ignore into tbl_table_name (real_name, hash_name, algorithm_id)"
+        " values (%1%, UNHEX(%2%), %3%)";
+    const char insert_algorithm_template[] = "insert ignore into tbl_hash_algorithm (algorithm_id, algorithm)"
+        " values (%1%, %2%)";
+
+    /// The id under which default_hash_algoritm() is recorded in tbl_hash_algorithm
+    constexpr unsigned default_algorithm_id = 1;
+
     auto default_hash_algoritm() -> proto::storage::HashAlgorithm const & {
         static proto::storage::HashAlgorithm store;
         static proto::storage::HashAlgorithm const &ref = [&](auto &store) -> decltype(auto) {
@@ -23,39 +41,76 @@ namespace {
         ::google::protobuf::util::MessageToJsonString(algo, &result);
         return result;
     }
+}
 
-    const
-
-    std::string hex_encode(std::uint8_t const *first, std::uint8_t const *const last) {
-        static const char myDigits[] = "0123456789ABCDEF";
-        std::string myResult;
-        auto dist = std::distance(first, last);
-        myResult.reserve(dist * 2);
-        while (first != last) {
-            auto byte = *first++;
-            myResult.push_back(myDigits[byte >> 4]);
-            myResult.push_back(myDigits[byte & 0xf]);
-        }
-        return myResult;
-    }
+void table_lookup::init() {
+    init_algorithms();
+    migrate();
+    create_name_table("tbl_table_name");
+}
 
-    template<class Iter>
-    std::string hex_encode(Iter first, Iter last) {
-        return hex_encode(reinterpret_cast<std::uint8_t const *>(std::addressof(*first)),
-                          reinterpret_cast<std::uint8_t const *>(std::addressof(*last)));
-    }
+void table_lookup::init_algorithms() {
+    execute(connection_, ""
+            "CREATE TABLE IF NOT EXISTS tbl_hash_algorithm"
+            "("
+            "   algorithm_id INT UNSIGNED NOT NULL PRIMARY KEY,"
+            "   algorithm VARCHAR(512) NOT NULL,"
+            "   UNIQUE INDEX (algorithm)"
+            ")");
+    execute(connection_, build_query(connection_, insert_algorithm_template,
+                                     default_algorithm_id,
+                                     to_json(default_hash_algoritm())));
 }
 
-void table_lookup::init() {
-    static const char query[] = ""
-            "CREATE TABLE IF NOT EXISTS tbl_table_name"
+void table_lookup::create_name_table(std::string const &name) {
+    auto length = default_hash_algoritm().cryptogenerichash().hashlength();
+    execute(connection_, ""
+            "CREATE TABLE IF NOT EXISTS " + name +
             "("
             "   real_name VARCHAR(1024) NOT NULL PRIMARY KEY,"
-            "   hash_name VARCHAR(64) NOT NULL,"
-            "   hash_algorithm VARCHAR(512) NOT NULL,"
-            "   UNIQUE INDEX (hash_name, hash_algorithm)"
-            ")";
-    execute(connection_, query);
+            "   hash_name BINARY(" + std::to_string(length) + ") NOT NULL,"
+            "   algorithm_id INT UNSIGNED NOT NULL,"
+            "   UNIQUE INDEX (hash_name, algorithm_id)"
+            ")");
+}
+
+bool table_lookup::migrate() {
+    connection_.query(R"__(SELECT COUNT(*)
+FROM `information_schema`.`COLUMNS`
+WHERE
+    `TABLE_SCHEMA` = DATABASE()
+AND `TABLE_NAME` = 'tbl_table_name'
+AND `COLUMN_NAME` = 'hash_algorithm')__");
+    if (single_value<std::int64_t>(connection_.store_result()) == 0)
+        return false;
+
+    // check every row before anything is changed
+    static const auto json = to_json(default_hash_algoritm());
+    auto length = std::size_t(default_hash_algoritm().cryptogenerichash().hashlength());
+    connection_.query("SELECT real_name, hash_name, hash_algorithm FROM tbl_table_name");
+    auto rs = connection_.store_result();
+    auto digest = std::vector<std::uint8_t>();
+    for (auto&& row : typed_rows<boost::string_view, boost::string_view, boost::string_view>(rs)) {
+        auto real_name = std::get<0>(row).to_string();
+        if (std::get<2>(row) != json)
+            throw std::runtime_error("cannot migrate " + real_name + ": it was hashed with "
+                                     + std::get<2>(row).to_string());
+        digest.clear();
+        if (not hex_decode(std::get<1>(row), digest) or digest.size() != length)
+            throw std::runtime_error("cannot migrate " + real_name + ": bad hash name "
+                                     + std::get<1>(row).to_string());
+    }
+
+    // the old table stays in place until the swap, so a failure on the way leaves it as it was
+    init_algorithms();
+    execute(connection_, "DROP TABLE IF EXISTS tbl_table_name_migrating");
+    create_name_table("tbl_table_name_migrating");
+    execute(connection_, "INSERT INTO tbl_table_name_migrating (real_name, hash_name, algorithm_id)"
+        " SELECT real_name, UNHEX(hash_name), " + std::to_string(default_algorithm_id) + " FROM tbl_table_name");
+    execute(connection_, "RENAME TABLE tbl_table_name TO tbl_table_name_hex,"
+        " tbl_table_name_migrating TO tbl_table_name");
+    execute(connection_, "DROP TABLE tbl_table_name_hex");
+    return true;
 }
 
 std::string table_lookup::lookup(std::string const &real_name) {
@@ -70,31 +125,146 @@ std::string table_lookup::lookup(std::string const &real_name) {
     return hash_name;
 }
 
+void table_lookup::async_lookup(amytest::asio::io_service& executor, std::string const& real_name,
+                                lookup_handler handler) {
+    auto ifind = my_real_to_hash_.find(real_name);
+    if (ifind != my_real_to_hash_.end()) {
+        handler(boost::system::error_code(), ifind->second);
+        return;
+    }
+
+    auto record = [this, real_name, handler = std::move(handler)](boost::system::error_code const& ec,
+                                                                  std::string const& hash_name) {
+        if (not ec) {
+            my_real_to_hash_[real_name] = hash_name;
+            my_hash_to_real_[hash_name] = real_name;
+        }
+        handler(ec, hash_name);
+    };
+    get_static_cache().async_lookup(connection_, executor, real_name, std::move(record));
+}
+
+void table_lookup::async_lookup(std::string const& real_name, lookup_handler handler) {
+    async_lookup(connection_.get_io_service(), real_name, std::move(handler));
+}
+
+std::string table_lookup::hash_name_for(std::string const &real_name) {
+    std::vector<std::uint8_t> hash_bytes;
+    hash(hash_bytes, std::begin(real_name), std::end(real_name), default_hash_algoritm());
+    return hex_encode(std::begin(hash_bytes), std::end(hash_bytes));
+}
+
 auto table_lookup::cache::lookup(amy::connector &conn,
                                  std::string const &real_name) -> std::string {
+    {
+        auto lock = std::unique_lock<std::mutex>(mutex_);
+        auto ifind = real_to_hash_.find(real_name);
+        if (ifind != real_to_hash_.end())
+            return ifind->second;
+    }
+
+    // the round trip runs unlocked so that it does not hold up lookups on other threads. A concurrent miss
+    // for the same name makes its own round trip, which writes the same row.
+    auto rs = [&] {
+        AMYTEST_METRIC_QUERY(select_hash_template);
+        conn.query(build_query(conn, select_hash_template, real_name));
+        return conn.store_result();
+    }();
+    auto rows = typed_rows<boost::string_view>(rs);
+    auto hash_name = std::string();
+    if (rows.empty()) {
+        hash_name = hash_name_for(real_name);
+        AMYTEST_METRIC_QUERY(insert_hash_template);
+        execute(conn, build_query(conn, insert_hash_template, real_name, hash_name,
+                                  default_algorithm_id));
+    } else {
+        auto digest = std::get<0>(rows.at(0));
+        hash_name = hex_encode(digest.begin(), digest.end());
+    }
+
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    update(real_name, hash_name);
+    return hash_name;
+}
+
+void table_lookup::cache::async_lookup(amy::connector &conn, amytest::asio::io_service &executor,
+                                       std::string const &real_name, lookup_handler handler) {
     auto lock = std::unique_lock<std::mutex>(mutex_);
     auto ifind = real_to_hash_.find(real_name);
-    if (ifind != real_to_hash_.end())
-        return ifind->second;
-    conn.query(build_query(conn, "select hash_name from tbl_table_name where real_name=%1%;", real_name));
-    auto rs = conn.store_result();
-    if (rs.size() == 0) {
-        std::vector<std::uint8_t> hash_bytes;
-        static auto &&algorithm = default_hash_algoritm();
-        static const auto json = to_json(algorithm);
-        hash(hash_bytes, std::begin(real_name), std::end(real_name), default_hash_algoritm());
-        auto hash_name = hex_encode(std::begin(hash_bytes), std::end(hash_bytes));
-        update(real_name, hash_name);
-        execute(conn, build_query(conn,
-                                  "insert into tbl_table_name (real_name, hash_name, hash_algorithm)"
-                                          " values (%1%, %2%, %3%)",
-                                  real_name, hash_name, json));
-        return hash_name;
+    if (ifind != real_to_hash_.end()) {
+        auto hash_name = ifind->second;
+        lock.unlock();
+        handler(boost::system::error_code(), hash_name);
+        return;
+    }
 
-    } else {
-        auto hash_name = rs.at(0).at(0).as<std::string>();
+    auto &waiters = in_flight_[real_name];
+    waiters.push_back(waiter { &executor, std::move(handler) });
+    if (waiters.size() > 1)
+        return;     // another lookup's round trip will complete this one
+    lock.unlock();
+    async_resolve(conn, real_name);
+}
+
+void table_lookup::cache::async_resolve(amy::connector &conn, std::string const &real_name) {
+    auto done = [this, real_name](boost::system::error_code const &ec, std::string const &hash_name) {
+        this->complete(real_name, ec, hash_name);
+    };
+
+    // the name may be recorded by another process, so read before writing as lookup() does
+    auto on_inserted = [&conn, done](std::string const &hash_name, boost::system::error_code const &ec) {
+        if (ec) {
+            done(ec, std::string());
+            return;
+        }
+        conn.async_store_result([done, hash_name](boost::system::error_code const &ec, amy::result_set) {
+            done(ec, hash_name);
+        });
+    };
+
+    auto on_rows = [this, &conn, real_name, done, on_inserted](boost::system::error_code const &ec,
+                                                               amy::result_set rs) {
+        if (ec) {
+            done(ec, std::string());
+            return;
+        }
+        auto rows = typed_rows<boost::string_view>(rs);
+        if (not rows.empty()) {
+            auto digest = std::get<0>(rows.at(0));
+            done(ec, hex_encode(digest.begin(), digest.end()));
+            return;
+        }
+        auto hash_name = hash_name_for(real_name);
+        conn.async_query(build_query(conn, insert_hash_template, real_name, hash_name,
+                                     default_algorithm_id),
+                         [on_inserted, hash_name](boost::system::error_code const &ec) {
+                             on_inserted(hash_name, ec);
+                         });
+    };
+
+    conn.async_query(build_query(conn, select_hash_template, real_name),
+                     [&conn, done, on_rows](boost::system::error_code const &ec) {
+                         if (ec) {
+                             done(ec, std::string());
+                             return;
+                         }
+                         conn.async_store_result(on_rows);
+                     });
+}
+
+void table_lookup::cache::complete(std::string const &real_name, boost::system::error_code const &ec,
+                                   std::string const &hash_name) {
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    if (not ec)
         update(real_name, hash_name);
-        return hash_name;
+    auto waiters = std::move(in_flight_[real_name]);
+    in_flight_.erase(real_name);
+    lock.unlock();
+
+    // a failed round trip is not cached, so the next lookup tries again
+    for (auto &&w : waiters) {
+        auto handler = std::move(w.handler);
+        w.executor->post([handler, ec, hash_name] { handler(ec, hash_name); });
     }
 }
 
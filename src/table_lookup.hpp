@@ -6,25 +6,68 @@
 
 #include "config.hpp"
 #include <amy.hpp>
+#include <boost/system/error_code.hpp>
+#include <functional>
+#include <mutex>
 #include <unordered_map>
 #include <string>
+#include <vector>
 
 struct table_lookup
 {
     table_lookup(amy::connector& conn) : connection_(conn) {}
 
+    /// Create tbl_table_name, which holds each hashed name as its raw digest and the id of the algorithm
+    /// in tbl_hash_algorithm, rather than as hex and the algorithm's json. A table created by an earlier
+    /// version is migrated first.
     void init();
 
+    /// Convert a tbl_table_name created by an earlier version, which stored hex names, to the binary layout.
+    /// Returns false if there was nothing to convert. The converted copy is built beside the old table and
+    /// swapped in with RENAME TABLE, so the old table survives a failure.
+    bool migrate();
+
     std::string lookup(std::string const& real_name);
 
+    using lookup_handler = std::function<void(boost::system::error_code const& ec, std::string const& hash_name)>;
+
+    /// As lookup(), without blocking the io_service. A name already in the cache completes inline. Otherwise
+    /// it is resolved with async queries on this lookup's connection, which must not be used by anything else
+    /// meanwhile, and the handler is posted to `executor`. Concurrent misses for the same name, from any
+    /// table_lookup, share one round trip. This table_lookup must outlive the completion.
+    void async_lookup(amytest::asio::io_service& executor, std::string const& real_name, lookup_handler handler);
+
+    /// async_lookup() completing on the connection's io_service
+    void async_lookup(std::string const& real_name, lookup_handler handler);
+
+    /// The hashed name which lookup() records for a name not yet in tbl_table_name. Never touches the database
+    static std::string hash_name_for(std::string const& real_name);
+
     struct cache
     {
         auto lookup(amy::connector& conn, std::string const& real_name) -> std::string;
 
+        /// Complete inline on a hit, otherwise wait for the name, starting a round trip on `conn` if none is
+        /// in flight
+        void async_lookup(amy::connector& conn, amytest::asio::io_service& executor,
+                          std::string const& real_name, lookup_handler handler);
+
         void update(std::string const& real_name, std::string const& hashed_name);
 
+        struct waiter
+        {
+            amytest::asio::io_service *executor;
+            lookup_handler handler;
+        };
+
+        void async_resolve(amy::connector& conn, std::string const& real_name);
+
+        /// Record the outcome of a round trip and post it to everyone waiting for the name
+        void complete(std::string const& real_name, boost::system::error_code const& ec, std::string const& hash_name);
+
         std::unordered_map<std::string, std::string> real_to_hash_;
         std::unordered_map<std::string, std::string> hash_to_real_;
+        std::unordered_map<std::string, std::vector<waiter>> in_flight_;
         std::mutex mutex_;
     };
 
@@ -33,6 +76,10 @@ struct table_lookup
         return cache_;
     }
 
+    void init_algorithms();
+
+    void create_name_table(std::string const& name);
+
     amy::connector& connection_;
     std::unordered_map<std::string, std::string> my_real_to_hash_;
     std::unordered_map<std::string, std::string> my_hash_to_real_;
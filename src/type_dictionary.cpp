@@ -0,0 +1,199 @@
+//
+// Created by Richard Hodges on 07/05/2017.
+//
+
+#include "type_dictionary.hpp"
+#include "query_builder.hpp"
+#include "typed_rows.hpp"
+#include "hasher.hpp"
+#include "metrics.hpp"
+
+#include <mysql/mysql.h>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+
+    const char insert_type_template[] =
+        "INSERT IGNORE INTO tbl_message_type (type_id, type_name) VALUES (%1%, %2%)";
+    const char select_type_template[] =
+        "SELECT type_name FROM tbl_message_type WHERE type_id = %1%";
+
+    auto type_hash_algorithm() -> proto::storage::HashAlgorithm const&
+    {
+        static auto const algorithm = []
+        {
+            auto result = proto::storage::HashAlgorithm();
+            result.mutable_cryptogenerichash()->set_hashlength(16);
+            return result;
+        }();
+        return algorithm;
+    }
+
+    std::string select_name(amy::connector& conn, type_dictionary::type_id id)
+    {
+        AMYTEST_METRIC_QUERY(select_type_template);
+        conn.query(build_query(conn, select_type_template, id));
+        auto rs = conn.store_result();
+        auto rows = typed_rows<std::string>(rs);
+        return rows.empty() ? std::string() : std::get<0>(rows.at(0));
+    }
+}
+
+void type_dictionary::init()
+{
+    static const char query[] = ""
+        "CREATE TABLE IF NOT EXISTS tbl_message_type"
+        "("
+        "   type_id INT UNSIGNED NOT NULL PRIMARY KEY,"
+        "   type_name VARCHAR(255) NOT NULL,"
+        "   UNIQUE INDEX (type_name)"
+        ")";
+    execute(connection_, query);
+}
+
+auto type_dictionary::hashed_id(std::string const& type_name) -> type_id
+{
+    std::vector<std::uint8_t> digest;
+    hash(digest, std::begin(type_name), std::end(type_name), type_hash_algorithm());
+    auto id = type_id(digest[0]) << 24 | type_id(digest[1]) << 16 | type_id(digest[2]) << 8 | type_id(digest[3]);
+    return id ? id : 1;     // 0 means "not yet classified"
+}
+
+auto type_dictionary::id_for(std::string const& type_name) -> type_id
+{
+    auto id = get_static_cache().assigned_id(type_name);
+    return id ? id : hashed_id(type_name);
+}
+
+auto type_dictionary::id_for(google::protobuf::Descriptor const *descriptor) -> type_id
+{
+    return get_static_cache().id_for(descriptor);
+}
+
+void type_dictionary::assign(std::string const& type_name, type_id id)
+{
+    if (id == 0)
+        throw std::invalid_argument("message type id 0 is reserved");
+    get_static_cache().assign(type_name, id);
+}
+
+auto type_dictionary::lookup(std::string const& type_name) -> type_id
+{
+    return record(id_for(type_name), type_name);
+}
+
+auto type_dictionary::lookup(google::protobuf::Descriptor const *descriptor) -> type_id
+{
+    // the descriptor's id is cached, so a known type costs no hashing
+    return record(id_for(descriptor), descriptor->full_name());
+}
+
+auto type_dictionary::record(type_id id, std::string const& type_name) -> type_id
+{
+    auto& our_cache = get_static_cache();
+    if (our_cache.check_recorded(connection_, id))
+        return id;
+
+    try {
+        auto affected = [&] {
+            AMYTEST_METRIC_QUERY(insert_type_template);
+            return execute(connection_, build_query(connection_, insert_type_template,
+                                                    id, type_name));
+        }();
+        if (affected == 0) {
+            auto recorded = select_name(connection_, id);
+            if (recorded != type_name)
+                throw std::runtime_error("message type id " + std::to_string(id) + " of " + type_name
+                                         + " is already used by " + recorded
+                                         + "; give one of them another id with type_dictionary::assign()");
+        }
+    }
+    catch (...) {
+        our_cache.forget_recorded(connection_, id);
+        throw;
+    }
+
+    auto lock = std::unique_lock<std::mutex>(our_cache.mutex_);
+    our_cache.id_to_name_.emplace(id, type_name);
+    return id;
+}
+
+std::string type_dictionary::name_of(type_id id)
+{
+    auto& our_cache = get_static_cache();
+    {
+        auto lock = std::unique_lock<std::mutex>(our_cache.mutex_);
+        auto ifind = our_cache.id_to_name_.find(id);
+        if (ifind != our_cache.id_to_name_.end())
+            return ifind->second;
+    }
+    auto name = select_name(connection_, id);
+    if (not name.empty()) {
+        auto lock = std::unique_lock<std::mutex>(our_cache.mutex_);
+        our_cache.id_to_name_.emplace(id, name);
+    }
+    return name;
+}
+
+auto type_dictionary::cache::id_for(google::protobuf::Descriptor const *descriptor) -> type_id
+{
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    auto ifind = descriptor_to_id_.find(descriptor);
+    if (ifind != descriptor_to_id_.end())
+        return ifind->second;
+    auto iassigned = assigned_.find(descriptor->full_name());
+    auto id = iassigned != assigned_.end() ? iassigned->second : type_dictionary::hashed_id(descriptor->full_name());
+    descriptor_to_id_.emplace(descriptor, id);
+    return id;
+}
+
+auto type_dictionary::cache::assigned_id(std::string const& type_name) -> type_id
+{
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    auto ifind = assigned_.find(type_name);
+    return ifind == assigned_.end() ? 0 : ifind->second;
+}
+
+void type_dictionary::cache::assign(std::string const& type_name, type_id id)
+{
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    auto result = assigned_.emplace(type_name, id);
+    if (not result.second and result.first->second != id)
+        throw std::invalid_argument("message type " + type_name + " is already assigned id "
+                                    + std::to_string(result.first->second));
+
+    // a descriptor looked up before the assignment must not keep its hashed id
+    for (auto i = descriptor_to_id_.begin(); i != descriptor_to_id_.end(); ) {
+        if (i->first->full_name() == type_name)
+            i = descriptor_to_id_.erase(i);
+        else
+            ++i;
+    }
+}
+
+bool type_dictionary::cache::check_recorded(amy::connector& conn, type_id id)
+{
+    auto handle = static_cast<void const *>(conn.native());
+    auto thread_id = mysql_thread_id(conn.native());
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    auto ifind = recorded_.find(handle);
+    if (ifind == recorded_.end()) {
+        if (recorded_.size() >= max_recorded_connections)
+            recorded_.clear();
+        ifind = recorded_.emplace(handle, connection_record { thread_id, {} }).first;
+    }
+    else if (ifind->second.thread_id != thread_id) {
+        ifind->second.thread_id = thread_id;
+        ifind->second.ids.clear();
+    }
+    return not ifind->second.ids.insert(id).second;
+}
+
+void type_dictionary::cache::forget_recorded(amy::connector& conn, type_id id)
+{
+    auto lock = std::unique_lock<std::mutex>(mutex_);
+    auto ifind = recorded_.find(static_cast<void const *>(conn.native()));
+    if (ifind != recorded_.end())
+        ifind->second.ids.erase(id);
+}
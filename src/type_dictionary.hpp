@@ -0,0 +1,97 @@
+//
+// Created by Richard Hodges on 07/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include <amy.hpp>
+#include <google/protobuf/descriptor.h>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+/// Maps protobuf type names to the integer stored in tbl_message_store.type_id.
+///
+/// Like table_lookup's hashed table names, the id is derived from the name (the leading 32 bits of its
+/// generichash), so every process and every server agrees on it without a round trip, and a row is validated
+/// by comparing integers. tbl_message_type records each mapping so that rows can be named by other tools,
+/// and so that two names colliding on one id are caught when the second is first written.
+///
+/// With n types the chance of any collision is about n^2 / 2^33 (around 1 in 10000 for 1000 types). If one
+/// happens, record() throws for the second name; pin that name to an unused id with assign() in every
+/// process, before it is first stored or read.
+struct type_dictionary
+{
+    using type_id = std::uint32_t;
+
+    type_dictionary(amy::connector& conn) : connection_(conn) {}
+
+    void init();
+
+    /// The id for a type, making sure it is recorded on this connection's server
+    type_id lookup(std::string const& type_name);
+
+    type_id lookup(google::protobuf::Descriptor const *descriptor);
+
+    /// The name recorded for `id`, or an empty string
+    std::string name_of(type_id id);
+
+    /// The id for a type name. Never touches the database
+    static type_id id_for(std::string const& type_name);
+
+    static type_id id_for(google::protobuf::Descriptor const *descriptor);
+
+    /// Use `id` for `type_name` instead of its hashed id. Throws std::invalid_argument if `id` is 0 or the name
+    /// has already been assigned a different id.
+    static void assign(std::string const& type_name, type_id id);
+
+    struct cache
+    {
+        type_id id_for(google::protobuf::Descriptor const *descriptor);
+
+        /// The assigned id for `type_name`, or 0
+        type_id assigned_id(std::string const& type_name);
+
+        void assign(std::string const& type_name, type_id id);
+
+        /// Whether `id` has been recorded through the connection `conn`; marks it recorded if not
+        bool check_recorded(amy::connector& conn, type_id id);
+
+        void forget_recorded(amy::connector& conn, type_id id);
+
+        std::unordered_map<google::protobuf::Descriptor const *, type_id> descriptor_to_id_;
+        std::unordered_map<type_id, std::string> id_to_name_;
+        std::unordered_map<std::string, type_id> assigned_;
+
+        struct connection_record
+        {
+            // distinguishes a new connection which happens to reuse a closed one's handle
+            unsigned long thread_id;
+            std::unordered_set<type_id> ids;
+        };
+
+        // by client handle. A handle's ids are discarded when it turns up with a new server thread id, and the
+        // whole map when it holds max_recorded_connections handles; forgetting only costs an INSERT IGNORE.
+        std::unordered_map<void const *, connection_record> recorded_;
+        std::mutex mutex_;
+    };
+
+    static constexpr std::size_t max_recorded_connections = 256;
+
+    static cache& get_static_cache() {
+        static cache cache_ {};
+        return cache_;
+    }
+
+private:
+    /// The id derived from the name's hash
+    static type_id hashed_id(std::string const& type_name);
+
+    /// Make sure `id` is recorded for `type_name` on this connection's server
+    type_id record(type_id id, std::string const& type_name);
+
+    amy::connector& connection_;
+};
@@ -0,0 +1,60 @@
+//
+// Created by Richard Hodges on 04/05/2017.
+//
+
+#include "typed_rows.hpp"
+
+#include <mysql/mysql.h>
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+    bool is_integer_type(enum_field_types type)
+    {
+        switch (type) {
+            case MYSQL_TYPE_TINY:
+            case MYSQL_TYPE_SHORT:
+            case MYSQL_TYPE_LONG:
+            case MYSQL_TYPE_INT24:
+            case MYSQL_TYPE_LONGLONG:
+            case MYSQL_TYPE_YEAR:
+            case MYSQL_TYPE_NULL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    const char *name(column_kind kind)
+    {
+        return kind == column_kind::integer ? "integer" : "text";
+    }
+}
+
+void check_columns(amy::result_set const& rs, std::initializer_list<column_kind> kinds)
+{
+    if (rs.field_count() != kinds.size()) {
+        throw std::runtime_error("expected " + std::to_string(kinds.size()) + " columns, got "
+                                 + std::to_string(rs.field_count()));
+    }
+    auto&& fields = rs.fields_info();
+    std::size_t i = 0;
+    for (auto kind : kinds) {
+        if (kind == column_kind::integer and not is_integer_type(fields[i].type())) {
+            throw std::runtime_error("column " + std::to_string(i) + " (" + fields[i].name() + ") is not "
+                                     + name(kind));
+        }
+        ++i;
+    }
+}
+
+void throw_unexpected_null()
+{
+    throw std::runtime_error("unexpected NULL");
+}
+
+void throw_bad_integer(const char *data, std::size_t size)
+{
+    throw std::runtime_error("not an integer: " + std::string(data, std::min<std::size_t>(size, 32)));
+}
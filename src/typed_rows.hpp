@@ -0,0 +1,213 @@
+//
+// Created by Richard Hodges on 04/05/2017.
+//
+
+#pragma once
+
+#include "config.hpp"
+#include "field_bytes.hpp"
+#include <amy.hpp>
+#include <boost/optional.hpp>
+#include <boost/utility/string_view.hpp>
+#include <cstddef>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/// Typed access to a result set.
+///
+///    auto rs = conn.store_result();
+///    for (auto&& row : typed_rows<int, boost::string_view, boost::optional<boost::string_view>>(rs)) {
+///        auto id = std::get<0>(row);
+///        ...
+///    }
+///
+/// Column count and types are checked once, when the typed_rows is constructed, rather than once per cell.
+/// boost::string_view columns refer to the result set's own buffers and are valid as long as it is.
+/// Integers are parsed straight from those buffers. Use boost::optional<T> for columns which may be NULL.
+
+enum class column_kind
+{
+    text,       // anything, as it arrives over the text protocol
+    integer
+};
+
+/// Throws std::runtime_error unless `rs` has exactly the columns described by `kinds`
+void check_columns(amy::result_set const& rs, std::initializer_list<column_kind> kinds);
+
+[[noreturn]] void throw_unexpected_null();
+
+[[noreturn]] void throw_bad_integer(const char *data, std::size_t size);
+
+/// Parse a decimal integer from [first, last) in the manner of std::from_chars, but the whole range must be used
+template<class Integer>
+Integer parse_integer(const char *first, const char *last)
+{
+    using unsigned_type = std::make_unsigned_t<Integer>;
+
+    auto start = first;
+    auto negative = std::is_signed<Integer>::value and first != last and *first == '-';
+    if (negative) ++first;
+    if (first == last) throw_bad_integer(start, std::size_t(last - start));
+
+    auto limit = unsigned_type(std::numeric_limits<Integer>::max()) + unsigned_type(negative ? 1 : 0);
+    auto value = unsigned_type(0);
+    for (; first != last; ++first) {
+        auto digit = unsigned(*first - '0');
+        if (digit > 9 or value > (limit - digit) / 10)
+            throw_bad_integer(start, std::size_t(last - start));
+        value = unsigned_type(value * 10 + digit);
+    }
+    return negative ? Integer(unsigned_type(0) - value) : Integer(value);
+}
+
+/// How a C++ type is decoded from a column. Specialise to map further types.
+template<class T, class Enable = void>
+struct column_traits;
+
+template<>
+struct column_traits<boost::string_view>
+{
+    static constexpr column_kind kind = column_kind::text;
+
+    static boost::string_view decode(amy::field const& f)
+    {
+        if (f.is_null()) throw_unexpected_null();
+        auto bytes = field_bytes(f);
+        return boost::string_view(bytes.data, bytes.size);
+    }
+};
+
+template<>
+struct column_traits<std::string>
+{
+    static constexpr column_kind kind = column_kind::text;
+
+    static std::string decode(amy::field const& f)
+    {
+        return column_traits<boost::string_view>::decode(f).to_string();
+    }
+};
+
+template<class Integer>
+struct column_traits<Integer, std::enable_if_t<std::is_integral<Integer>::value>>
+{
+    static constexpr column_kind kind = column_kind::integer;
+
+    static Integer decode(amy::field const& f)
+    {
+        if (f.is_null()) throw_unexpected_null();
+        auto bytes = field_bytes(f);
+        return parse_integer<Integer>(bytes.data, bytes.data + bytes.size);
+    }
+};
+
+template<class T>
+struct column_traits<boost::optional<T>>
+{
+    static constexpr column_kind kind = column_traits<T>::kind;
+
+    static boost::optional<T> decode(amy::field const& f)
+    {
+        if (f.is_null()) return boost::none;
+        return column_traits<T>::decode(f);
+    }
+};
+
+template<class...Ts>
+struct typed_rows
+{
+    using value_type = std::tuple<Ts...>;
+
+    explicit typed_rows(amy::result_set const& rs)
+        : rs_(rs)
+    {
+        check_columns(rs, { column_traits<Ts>::kind... });
+    }
+
+    // the decoded views would outlive the buffers they point into
+    explicit typed_rows(amy::result_set&&) = delete;
+
+    struct iterator
+    {
+        using iterator_category = std::input_iterator_tag;
+        using value_type = typed_rows::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = value_type;
+
+        value_type operator*() const { return decode(*pos_); }
+
+        iterator& operator++()
+        {
+            ++pos_;
+            return *this;
+        }
+
+        bool operator==(iterator const& other) const { return pos_ == other.pos_; }
+
+        bool operator!=(iterator const& other) const { return pos_ != other.pos_; }
+
+        amy::result_set::const_iterator pos_;
+    };
+
+    iterator begin() const { return { rs_.begin() }; }
+
+    iterator end() const { return { rs_.end() }; }
+
+    std::size_t size() const { return rs_.size(); }
+
+    bool empty() const { return rs_.empty(); }
+
+    value_type at(std::size_t i) const { return decode(rs_.at(i)); }
+
+    /// Call f(column0, column1, ...) for every row
+    template<class F>
+    void for_each(F&& f) const
+    {
+        for (auto&& row : rs_)
+            apply(f, row, std::index_sequence_for<Ts...>());
+    }
+
+    static value_type decode(amy::row const& row)
+    {
+        return decode(row, std::index_sequence_for<Ts...>());
+    }
+
+private:
+    template<std::size_t...Is>
+    static value_type decode(amy::row const& row, std::index_sequence<Is...>)
+    {
+        return value_type(column_traits<Ts>::decode(row[Is])...);
+    }
+
+    template<class F, std::size_t...Is>
+    static void apply(F& f, amy::row const& row, std::index_sequence<Is...>)
+    {
+        f(column_traits<Ts>::decode(row[Is])...);
+    }
+
+    amy::result_set const& rs_;
+};
+
+/// The only cell of a one row, one column result, e.g. SELECT COUNT(*) or SELECT LAST_INSERT_ID()
+template<class T>
+T single_value(amy::result_set const& rs)
+{
+    auto rows = typed_rows<T>(rs);
+    if (rows.size() != 1)
+        throw std::runtime_error("expected 1 row, got " + std::to_string(rows.size()));
+    return std::get<0>(rows.at(0));
+}
+
+template<class T>
+T single_value(amy::result_set&& rs)
+{
+    static_assert(not std::is_same<T, boost::string_view>::value, "the view would outlive the result set");
+    return single_value<T>(static_cast<amy::result_set const&>(rs));
+}